@@ -0,0 +1,121 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "admission.h"
+
+
+#define MIN(a,b) (a<b?a:b)
+#define MAX(a,b) (a>b?a:b)
+
+// probed slots before the least recently seen one is taken over
+#define PROBES (8)
+
+struct client {
+  // IPv4 address or IPv6 /64, 0 for a free slot
+  uint64_t key;
+  double tokens;
+  uint64_t last_ms;
+};
+
+static struct client clients[ADMISSION_CLIENTS];
+static double rate = 0, burst = 0;
+static int git_max = 0;
+
+
+void admission_init(double r, double b, int g) {
+  rate = r;
+  burst = b;
+  git_max = g;
+}
+
+static uint64_t client_key(struct mg_connection *c) {
+  const uint8_t *ip6 = c->rem.ip6;
+  static const uint8_t mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+  uint64_t key = 0;
+  if (! c->rem.is_ip6) {
+    memcpy(&key, &c->rem.ip, sizeof(c->rem.ip));
+    return key | 1ULL << 63;
+  }
+  // IPv4 clients of a dual stack listener
+  if (memcmp(ip6, mapped, sizeof(mapped)) == 0) {
+    memcpy(&key, ip6 + 12, 4);
+    return key | 1ULL << 63;
+  }
+  // one host usually has a whole /64
+  memcpy(&key, ip6, 8);
+  return key != 0 ? key : 1;
+}
+
+static struct client * client_for(uint64_t key, uint64_t now) {
+  size_t start = (key * 0x9e3779b97f4a7c15ULL) >> 32;
+  struct client *oldest = NULL;
+  for (size_t i = 0; i < PROBES; i++) {
+    struct client *cl = &clients[(start + i) % ADMISSION_CLIENTS];
+    if (cl->key == key)
+      return cl;
+    if (oldest == NULL || cl->key == 0 || (oldest->key != 0 && cl->last_ms < oldest->last_ms))
+      oldest = cl;
+  }
+  // new clients start with a full bucket
+  oldest->key = key;
+  oldest->tokens = burst;
+  oldest->last_ms = now;
+  return oldest;
+}
+
+static double route_cost(enum metrics_route route) {
+  switch (route) {
+    case METRICS_ROUTE_STATIC:    return ADMISSION_COST_STATIC;
+    case METRICS_ROUTE_MEDIA:     return ADMISSION_COST_MEDIA;
+    case METRICS_ROUTE_GIT_INDEX: return ADMISSION_COST_GIT_INDEX;
+    case METRICS_ROUTE_GIT_TREE:
+    case METRICS_ROUTE_GIT_BLOB:  return ADMISSION_COST_GIT_PAGE;
+    case METRICS_ROUTE_GIT_DIFF:  return ADMISSION_COST_GIT_DIFF;
+    case METRICS_ROUTE_SEARCH:    return ADMISSION_COST_SEARCH;
+    case METRICS_ROUTE_GIT_CLONE: return ADMISSION_COST_GIT_CLONE;
+    case METRICS_ROUTE_ARCHIVE:   return ADMISSION_COST_ARCHIVE;
+    default:                      return ADMISSION_COST_STATIC;
+  }
+}
+
+// 0 is never shed, 2 is shed first when git work piles up
+static int route_priority(enum metrics_route route) {
+  switch (route) {
+    case METRICS_ROUTE_GIT_INDEX:
+    case METRICS_ROUTE_GIT_TREE:
+    case METRICS_ROUTE_GIT_BLOB:  return 1;
+    case METRICS_ROUTE_GIT_DIFF:
+    case METRICS_ROUTE_SEARCH:
+    case METRICS_ROUTE_GIT_CLONE:
+    case METRICS_ROUTE_ARCHIVE:   return 2;
+    default:                      return 0;
+  }
+}
+
+enum admission_verdict admission_check(struct mg_connection *c, enum metrics_route route, int git_load, unsigned *retry_after) {
+  int priority = route_priority(route);
+  if (git_max > 0 && priority > 0) {
+    int limit = priority == 1 ? git_max : MAX(1, git_max * ADMISSION_OVERLOAD_PERCENT / 100);
+    if (git_load >= limit) {
+      *retry_after = ADMISSION_OVERLOAD_RETRY_S;
+      metrics_refused(route, METRICS_REFUSED_OVERLOAD);
+      return ADMISSION_OVERLOAD;
+    }
+  }
+
+  if (rate <= 0)
+    return ADMISSION_OK;
+  uint64_t now = mg_millis();
+  struct client *cl = client_for(client_key(c), now);
+  cl->tokens = MIN(burst, cl->tokens + (now - cl->last_ms) * rate / 1000);
+  cl->last_ms = now;
+  double cost = MIN(route_cost(route), burst);
+  if (cl->tokens >= cost) {
+    cl->tokens -= cost;
+    return ADMISSION_OK;
+  }
+  // when the bucket will have refilled enough, rounded up
+  *retry_after = (unsigned) ((cost - cl->tokens) / rate) + 1;
+  metrics_refused(route, METRICS_REFUSED_RATE);
+  return ADMISSION_RATE;
+}
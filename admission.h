@@ -0,0 +1,44 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <mongoose.h>
+
+#include "metrics.h"
+
+// clients (IPv4 addresses, IPv6 /64s) with a bucket of their own
+#define ADMISSION_CLIENTS (4096)
+// once this share of the git render limit is in use, the expensive git
+// routes (diffs, search, clones, archives) are turned away
+#define ADMISSION_OVERLOAD_PERCENT (50)
+#define ADMISSION_OVERLOAD_RETRY_S (10)
+
+// Tokens a request costs, by route class. Static files and media are
+// cheap and never shed, so pages and video keep working when crawlers
+// walk every diff.
+#define ADMISSION_COST_STATIC (1)
+#define ADMISSION_COST_MEDIA (1)
+#define ADMISSION_COST_GIT_INDEX (1)
+#define ADMISSION_COST_GIT_PAGE (4)
+#define ADMISSION_COST_GIT_DIFF (10)
+#define ADMISSION_COST_SEARCH (10)
+#define ADMISSION_COST_GIT_CLONE (50)
+#define ADMISSION_COST_ARCHIVE (50)
+
+enum admission_verdict {
+  ADMISSION_OK,
+  ADMISSION_RATE,     // the client is over its rate, 429
+  ADMISSION_OVERLOAD, // too much git work in flight, 503
+};
+
+// Every client gets a token bucket that holds burst tokens and refills
+// with rate tokens per second, rate 0 turns that off. At most git_max
+// git renders (queued or running, see workers_pending) are admitted,
+// 0 for no limit. Only used from the event loop.
+void admission_init(double rate, double burst, int git_max);
+
+// Charges c's client for a request of the given class. git_load is the
+// number of git renders in flight. Sets retry_after (seconds) unless the
+// request is admitted. Refusals are counted in the metrics.
+enum admission_verdict admission_check(struct mg_connection *c, enum metrics_route route, int git_load, unsigned *retry_after);
+
+#endif
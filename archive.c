@@ -0,0 +1,534 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <git2.h>
+
+#include "archive.h"
+#include "repo_cache.h"
+#include "compress.h"
+#include "disk_cache.h"
+#include "media.h"
+#include "metrics.h"
+
+#define TAR_BLOCK (512)
+// zip64 isn't written, bigger archives are cut short
+#define ZIP_MAX_ENTRIES (0xffff)
+#define ZIP_MAX_OFFSET (0xffffffffULL)
+
+
+enum format {
+  FORMAT_TAR_GZ,
+  FORMAT_ZIP,
+};
+static const struct { const char *ext, *type; } formats[] = {
+  [FORMAT_TAR_GZ] = { ".tar.gz", "application/gzip" },
+  [FORMAT_ZIP] = { ".zip", "application/zip" },
+};
+
+// /archive/<repo>/<rev><ext>
+struct request {
+  char repo[256];
+  char rev[256];
+  enum format format;
+};
+
+struct zip_entry {
+  char *name;
+  uint16_t flags, method;
+  uint32_t crc, csize, usize;
+  uint32_t offset;
+  uint32_t mode;
+};
+
+struct writer {
+  struct out *o;
+  enum format format;
+  // copy for the cache, closed and NULL after a write error
+  FILE *cache;
+  git_repository *repo;
+  git_time_t mtime;
+  // cut short, see ZIP_MAX_*, or a blob couldn't be read
+  bool failed;
+
+  // tar.gz: the whole tar stream goes through it
+  struct compressor *z;
+
+  // zip: raw deflate, reset for every file
+  z_stream zs;
+  uint64_t offset;
+  struct zip_entry *entries;
+  size_t len, cap;
+};
+
+static struct disk_cache *cache = NULL;
+
+
+void archive_init(const char *cache_dir) {
+  cache = disk_cache_new(cache_dir, ARCHIVE_CACHE_MAX_BYTES);
+}
+
+void archive_free(void) {
+  disk_cache_free(cache);
+  cache = NULL;
+}
+
+static bool parse_url(struct mg_http_message *hm, struct request *r) {
+  const char *prefix = "/archive/";
+  size_t prefixLen = strlen(prefix);
+  if (hm->uri.len <= prefixLen || strncmp(hm->uri.ptr, prefix, prefixLen) != 0)
+    return false;
+  struct mg_str rest = mg_str_n(hm->uri.ptr + prefixLen, hm->uri.len - prefixLen);
+  const char *slash = memchr(rest.ptr, '/', rest.len);
+  if (slash == NULL)
+    return false;
+  size_t repoLen = slash - rest.ptr;
+  struct mg_str file = mg_str_n(slash + 1, rest.len - repoLen - 1);
+
+  size_t f;
+  for (f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+    size_t extLen = strlen(formats[f].ext);
+    if (file.len > extLen && strncmp(file.ptr + file.len - extLen, formats[f].ext, extLen) == 0)
+      break;
+  }
+  if (f == sizeof(formats) / sizeof(formats[0]))
+    return false;
+  r->format = f;
+  size_t revLen = file.len - strlen(formats[f].ext);
+
+  if (repoLen == 0 || repoLen >= sizeof(r->repo) || revLen >= sizeof(r->rev))
+    return false;
+  snprintf(r->repo, sizeof(r->repo), "%.*s", (int) repoLen, rest.ptr);
+  snprintf(r->rev, sizeof(r->rev), "%.*s", (int) revLen, file.ptr);
+  if (strcmp(r->repo, ".") == 0 || strcmp(r->repo, "..") == 0)
+    return false;
+  // commit ids, branch and tag names, nothing revparse would read more into
+  for (const char *p = r->rev; *p != '\0'; p++)
+    if (! (isalnum((unsigned char) *p) || *p == '-' || *p == '_' || (*p == '.' && p[1] != '.')))
+      return false;
+  return true;
+}
+
+// the commit r->rev names, NULL if there is none
+static git_commit * resolve(const char *root, struct request *r, git_repository **repo) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", root, r->repo);
+  *repo = repo_cache_open(path);
+  if (*repo == NULL)
+    return NULL;
+  git_object *obj, *commit = NULL;
+  if (git_revparse_single(&obj, *repo, r->rev) != 0)
+    return NULL;
+  git_object_peel(&commit, obj, GIT_OBJECT_COMMIT);
+  git_object_free(obj);
+  return (git_commit *) commit;
+}
+
+// <tree oid><ext>
+static void cache_name(char *buf, size_t len, git_commit *commit, enum format format) {
+  char hex[GIT_OID_HEXSZ + 1];
+  snprintf(buf, len, "%s%s", git_oid_tostr(hex, sizeof(hex), git_commit_tree_id(commit)), formats[format].ext);
+}
+
+// saved as <repo>-<short commit id><ext>
+static void disposition(char *buf, size_t len, struct request *r, git_commit *commit) {
+  char name[256], hex[8];
+  snprintf(name, sizeof(name), "%s", r->repo);
+  size_t nameLen = strlen(name);
+  if (nameLen > 4 && strcmp(name + nameLen - 4, ".git") == 0)
+    name[nameLen - 4] = '\0';
+  for (char *p = name; *p != '\0'; p++)
+    if (*p == '"' || *p == '\\' || (unsigned char) *p < ' ')
+      *p = '_';
+  snprintf(buf, len, "Content-Disposition: attachment; filename=\"%s-%s%s\"\r\n",
+    name, git_oid_tostr(hex, sizeof(hex), git_commit_id(commit)), formats[r->format].ext);
+}
+
+bool archive_serve_cached(struct mg_connection *c, struct mg_http_message *hm, const char *root) {
+  struct request r;
+  git_repository *repo;
+  if (! parse_url(hm, &r))
+    return false;
+  git_commit *commit = resolve(root, &r, &repo);
+  if (commit == NULL)
+    return false;
+
+  char name[64], path[4096], headers[512];
+  cache_name(name, sizeof(name), commit, r.format);
+  disposition(headers, sizeof(headers), &r, commit);
+  bool hit = disk_cache_lookup(cache, name, path, sizeof(path)) && media_serve_file(c, hm, path, headers);
+  metrics_cache(METRICS_CACHE_ARCHIVE, hit);
+  git_commit_free(commit);
+  return hit;
+}
+
+
+// archive bytes to the client and the cache file
+static void write_raw(struct writer *w, const void *data, size_t len) {
+  out_write(w->o, data, len);
+  if (w->cache != NULL && fwrite(data, 1, len, w->cache) != len) {
+    fclose(w->cache);
+    w->cache = NULL;
+  }
+  w->offset += len;
+}
+static void write_compressed(void *arg, const void *data, size_t len) {
+  write_raw(arg, data, len);
+}
+
+// tar
+
+static void tar_write(struct writer *w, const void *data, size_t len) {
+  compressor_write(w->z, data, len, COMPRESS_NO_FLUSH, write_compressed, w);
+}
+
+static void tar_pad(struct writer *w, size_t len) {
+  static const char zeros[TAR_BLOCK];
+  if (len % TAR_BLOCK != 0)
+    tar_write(w, zeros, TAR_BLOCK - len % TAR_BLOCK);
+}
+
+static void tar_header(struct writer *w, const char *name, int mode, char type, size_t size, const char *link) {
+  char h[TAR_BLOCK];
+  memset(h, 0, sizeof(h));
+  snprintf(h, 100, "%s", name);
+  sprintf(h + 100, "%07o", mode);
+  sprintf(h + 108, "%07o", 0);
+  sprintf(h + 116, "%07o", 0);
+  sprintf(h + 124, "%011llo", (unsigned long long) size);
+  sprintf(h + 136, "%011llo", (unsigned long long) w->mtime);
+  h[156] = type;
+  if (link != NULL)
+    snprintf(h + 157, 100, "%s", link);
+  memcpy(h + 257, "ustar", 6);
+  memcpy(h + 263, "00", 2);
+
+  // computed with the checksum field itself as spaces
+  memset(h + 148, ' ', 8);
+  unsigned sum = 0;
+  for (int i = 0; i < TAR_BLOCK; i++)
+    sum += (unsigned char) h[i];
+  sprintf(h + 148, "%06o", sum);
+  h[155] = ' ';
+  tar_write(w, h, sizeof(h));
+}
+
+// "<len> key=value\n", len counts its own digits too
+static size_t pax_record(char *buf, size_t len, const char *key, const char *value) {
+  size_t n = strlen(key) + strlen(value) + 3;
+  size_t digits = 1;
+  while (snprintf(NULL, 0, "%zu", n + digits) > digits)
+    digits++;
+  return snprintf(buf, len, "%zu %s=%s\n", n + digits, key, value);
+}
+
+static void tar_entry(struct writer *w, const char *name, int mode, char type, const void *data, size_t size, const char *link) {
+  // ustar fields hold 100 bytes, longer names go in a pax header first
+  if (strlen(name) >= 100 || (link != NULL && strlen(link) >= 100)) {
+    size_t cap = strlen(name) + (link != NULL ? strlen(link) : 0) + 64;
+    char *pax = malloc(cap);
+    size_t n = pax_record(pax, cap, "path", name);
+    if (link != NULL)
+      n += pax_record(pax + n, cap - n, "linkpath", link);
+    tar_header(w, "././@PaxHeader", 0644, 'x', n, NULL);
+    tar_write(w, pax, n);
+    tar_pad(w, n);
+    free(pax);
+  }
+  tar_header(w, name, mode, type, size, link);
+  tar_write(w, data, size);
+  tar_pad(w, size);
+}
+
+static void tar_finish(struct writer *w) {
+  static const char zeros[2 * TAR_BLOCK];
+  tar_write(w, zeros, sizeof(zeros));
+  compressor_write(w->z, NULL, 0, COMPRESS_FINISH, write_compressed, w);
+}
+
+// zip
+
+static void put16(char **p, uint16_t v) {
+  (*p)[0] = v;
+  (*p)[1] = v >> 8;
+  *p += 2;
+}
+static void put32(char **p, uint32_t v) {
+  put16(p, v);
+  put16(p, v >> 16);
+}
+
+static void dos_time(git_time_t t, uint16_t *time, uint16_t *date) {
+  time_t tt = t;
+  struct tm tm;
+  gmtime_r(&tt, &tm);
+  if (tm.tm_year < 80) {
+    *time = 0;
+    *date = (1 << 5) | 1;
+    return;
+  }
+  *time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+  *date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+}
+
+// Files are deflated while they are sent, so their sizes follow the data
+// in a descriptor. Directories and symlinks are stored.
+static void zip_entry(struct writer *w, const char *name, uint32_t mode, const void *data, size_t size) {
+  if (w->len == ZIP_MAX_ENTRIES || w->offset > ZIP_MAX_OFFSET) {
+    w->failed = true;
+    return;
+  }
+  if (w->len == w->cap) {
+    w->cap = w->cap ? w->cap * 2 : 256;
+    w->entries = realloc(w->entries, w->cap * sizeof(*w->entries));
+  }
+  struct zip_entry *e = &w->entries[w->len++];
+  e->name = strdup(name);
+  e->mode = mode;
+  e->offset = w->offset;
+  e->crc = crc32(0, data, size);
+  e->usize = size;
+  bool deflated = S_ISREG(mode) && size > 0;
+  // utf-8 names, sizes in a descriptor
+  e->flags = 0x0800 | (deflated ? 0x0008 : 0);
+  e->method = deflated ? 8 : 0;
+  e->csize = deflated ? 0 : size;
+
+  uint16_t time, date;
+  dos_time(w->mtime, &time, &date);
+  size_t nameLen = strlen(name);
+  char head[30], *p = head;
+  put32(&p, 0x04034b50);
+  put16(&p, 20);
+  put16(&p, e->flags);
+  put16(&p, e->method);
+  put16(&p, time);
+  put16(&p, date);
+  put32(&p, deflated ? 0 : e->crc);
+  put32(&p, e->csize);
+  put32(&p, deflated ? 0 : e->usize);
+  put16(&p, nameLen);
+  put16(&p, 0);
+  write_raw(w, head, sizeof(head));
+  write_raw(w, name, nameLen);
+
+  if (! deflated) {
+    write_raw(w, data, size);
+    return;
+  }
+  char buf[64*1024];
+  deflateReset(&w->zs);
+  w->zs.next_in = (Bytef *) data;
+  w->zs.avail_in = size;
+  int rc;
+  do {
+    w->zs.next_out = (Bytef *) buf;
+    w->zs.avail_out = sizeof(buf);
+    rc = deflate(&w->zs, Z_FINISH);
+    write_raw(w, buf, sizeof(buf) - w->zs.avail_out);
+  } while (rc == Z_OK && ! w->o->failed);
+  e->csize = w->zs.total_out;
+
+  char descriptor[16];
+  p = descriptor;
+  put32(&p, 0x08074b50);
+  put32(&p, e->crc);
+  put32(&p, e->csize);
+  put32(&p, e->usize);
+  write_raw(w, descriptor, sizeof(descriptor));
+}
+
+static void zip_finish(struct writer *w) {
+  if (w->offset > ZIP_MAX_OFFSET) {
+    w->failed = true;
+    return;
+  }
+  uint16_t time, date;
+  dos_time(w->mtime, &time, &date);
+  uint64_t start = w->offset;
+  for (size_t i = 0; i < w->len; i++) {
+    struct zip_entry *e = &w->entries[i];
+    size_t nameLen = strlen(e->name);
+    char head[46], *p = head;
+    put32(&p, 0x02014b50);
+    // made by unix, so the mode in the external attributes counts
+    put16(&p, (3 << 8) | 20);
+    put16(&p, 20);
+    put16(&p, e->flags);
+    put16(&p, e->method);
+    put16(&p, time);
+    put16(&p, date);
+    put32(&p, e->crc);
+    put32(&p, e->csize);
+    put32(&p, e->usize);
+    put16(&p, nameLen);
+    put16(&p, 0);
+    put16(&p, 0);
+    put16(&p, 0);
+    put16(&p, 0);
+    put32(&p, (e->mode << 16) | (S_ISDIR(e->mode) ? 0x10 : 0));
+    put32(&p, e->offset);
+    write_raw(w, head, sizeof(head));
+    write_raw(w, e->name, nameLen);
+  }
+  if (w->offset > ZIP_MAX_OFFSET) {
+    w->failed = true;
+    return;
+  }
+
+  char end[22], *p = end;
+  put32(&p, 0x06054b50);
+  put16(&p, 0);
+  put16(&p, 0);
+  put16(&p, w->len);
+  put16(&p, w->len);
+  put32(&p, w->offset - start);
+  put32(&p, start);
+  put16(&p, 0);
+  write_raw(w, end, sizeof(end));
+}
+
+static void add_entry(struct writer *w, const char *name, git_filemode_t mode, const void *data, size_t size) {
+  if (w->format == FORMAT_ZIP) {
+    uint32_t unixMode = mode == GIT_FILEMODE_LINK ? S_IFLNK | 0777 :
+      mode == GIT_FILEMODE_BLOB_EXECUTABLE ? S_IFREG | 0755 :
+      mode == GIT_FILEMODE_BLOB ? S_IFREG | 0644 : S_IFDIR | 0755;
+    zip_entry(w, name, unixMode, data, size);
+    return;
+  }
+  if (mode == GIT_FILEMODE_LINK) {
+    char *link = strndup(data, size);
+    tar_entry(w, name, 0777, '2', NULL, 0, link);
+    free(link);
+  }
+  else if (mode == GIT_FILEMODE_BLOB || mode == GIT_FILEMODE_BLOB_EXECUTABLE) {
+    tar_entry(w, name, mode == GIT_FILEMODE_BLOB ? 0644 : 0755, '0', data, size, NULL);
+  }
+  else {
+    tar_entry(w, name, 0755, '5', NULL, 0, NULL);
+  }
+}
+
+static int walk_cb(const char *root, const git_tree_entry *entry, void *arg) {
+  struct writer *w = arg;
+  if (w->failed || w->o->failed)
+    return -1;
+  git_filemode_t mode = git_tree_entry_filemode(entry);
+  char name[4096];
+  // submodules become empty directories, like git archive does it
+  bool dir = mode == GIT_FILEMODE_TREE || mode == GIT_FILEMODE_COMMIT;
+  snprintf(name, sizeof(name), "%s%s%s", root, git_tree_entry_name(entry), dir ? "/" : "");
+  if (dir) {
+    add_entry(w, name, mode, NULL, 0);
+    return 0;
+  }
+
+  uint64_t start = metrics_now();
+  git_blob *blob;
+  if (git_blob_lookup(&blob, w->repo, git_tree_entry_id(entry)) != 0) {
+    w->failed = true;
+    return -1;
+  }
+  metrics_git(METRICS_GIT_BLOB, start);
+  add_entry(w, name, mode, git_blob_rawcontent(blob), git_blob_rawsize(blob));
+  git_blob_free(blob);
+  return 0;
+}
+
+// the cached file as the response body
+static void send_cached(struct out *o, const char *path, const char *headers) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    out_reply(o, 404, NULL, "Archive not found :(\n");
+    return;
+  }
+  fseek(fp, 0, SEEK_END);
+  out_begin_sized(o, 200, headers, ftell(fp));
+  rewind(fp);
+  char buf[64*1024];
+  size_t n;
+  while (! o->failed && (n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    out_write(o, buf, n);
+  fclose(fp);
+  out_end(o);
+}
+
+void archive_serve(struct out *o, struct mg_http_message *hm, const char *root) {
+  struct request r;
+  git_repository *repo;
+  if (! parse_url(hm, &r)) {
+    out_reply(o, 404, NULL, "Not found :(\n");
+    return;
+  }
+  git_commit *commit = resolve(root, &r, &repo);
+  git_tree *tree = NULL;
+  if (commit == NULL || git_commit_tree(&tree, commit) != 0) {
+    out_reply(o, 404, NULL, "Commit not found :(\n");
+    git_commit_free(commit);
+    return;
+  }
+
+  char name[64], path[4096], headers[512 + 64];
+  cache_name(name, sizeof(name), commit, r.format);
+  int n = snprintf(headers, sizeof(headers), "Content-Type: %s\r\n", formats[r.format].type);
+  disposition(headers + n, sizeof(headers) - n, &r, commit);
+
+  // built by another request meanwhile
+  if (disk_cache_lookup(cache, name, path, sizeof(path))) {
+    send_cached(o, path, headers);
+    git_tree_free(tree);
+    git_commit_free(commit);
+    return;
+  }
+
+  struct writer w;
+  memset(&w, 0, sizeof(w));
+  w.o = o;
+  w.format = r.format;
+  w.repo = repo;
+  w.mtime = git_commit_time(commit);
+  struct disk_cache_file f;
+  bool caching = disk_cache_create(cache, name, &f);
+  w.cache = caching ? f.fp : NULL;
+  if (r.format == FORMAT_TAR_GZ)
+    w.z = compressor_new(ENCODING_GZIP, ARCHIVE_LEVEL);
+  else
+    deflateInit2(&w.zs, ARCHIVE_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+
+  // out_begin sends the type itself, only the disposition goes in headers
+  out_set_content_type(o, formats[r.format].type);
+  out_begin(o, 200, headers + n);
+  git_tree_walk(tree, GIT_TREEWALK_PRE, walk_cb, &w);
+  if (! w.failed && ! o->failed) {
+    if (r.format == FORMAT_TAR_GZ)
+      tar_finish(&w);
+    else
+      zip_finish(&w);
+  }
+
+  f.fp = w.cache;
+  if (w.failed || o->failed) {
+    out_abort(o);
+    if (caching)
+      disk_cache_abort(&f);
+  }
+  else {
+    out_end(o);
+    if (caching && w.cache != NULL)
+      disk_cache_commit(cache, &f);
+    else if (caching)
+      disk_cache_abort(&f);
+  }
+
+  compressor_free(w.z);
+  if (r.format == FORMAT_ZIP)
+    deflateEnd(&w.zs);
+  for (size_t i = 0; i < w.len; i++)
+    free(w.entries[i].name);
+  free(w.entries);
+  git_tree_free(tree);
+  git_commit_free(commit);
+}
@@ -0,0 +1,30 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdbool.h>
+#include <mongoose.h>
+
+#include "out.h"
+
+// archives on disk above this are evicted, least recently used first
+#define ARCHIVE_CACHE_MAX_BYTES (2048L*1024*1024)
+// deflate level of .tar.gz and .zip downloads
+#define ARCHIVE_LEVEL (6)
+
+// Snapshots of a commit, /archive/<repo>/<commit>.tar.gz or .zip (a
+// branch or tag name works too). The tree is walked and the archive
+// compressed while it is sent, and kept in cache_dir under the tree oid.
+// Cached archives are sent with sendfile by media_serve_file. Commits
+// with the same tree share an archive, timestamps included.
+void archive_init(const char *cache_dir);
+void archive_free(void);
+
+// Sends the archive if it is cached, false if it has to be built.
+// Event loop only.
+bool archive_serve_cached(struct mg_connection *c, struct mg_http_message *hm, const char *root);
+
+// Builds and streams the archive (or answers with an error). Runs on a
+// worker thread.
+void archive_serve(struct out *o, struct mg_http_message *hm, const char *root);
+
+#endif
@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+
+#define ALIGN (16)
+
+struct block {
+  struct block *next;
+  size_t size;
+  // keeps data aligned
+  max_align_t data[];
+};
+
+struct tracked {
+  struct tracked *next;
+  void *object;
+  arena_free_fn free_fn;
+};
+
+struct arena {
+  // the first block is the current one, a standard sized one is kept on
+  // reset
+  struct block *blocks;
+  size_t used;
+  struct tracked *tracked;
+};
+
+
+static struct block * block_new(size_t size) {
+  struct block *b = malloc(sizeof(*b) + size);
+  if (b == NULL)
+    abort();
+  b->next = NULL;
+  b->size = size;
+  return b;
+}
+
+struct arena * arena_new(void) {
+  struct arena *a = calloc(1, sizeof(*a));
+  a->blocks = block_new(ARENA_BLOCK_SIZE);
+  return a;
+}
+
+void arena_reset(struct arena *a) {
+  while (a->tracked != NULL) {
+    struct tracked *t = a->tracked;
+    a->tracked = t->next;
+    t->free_fn(t->object);
+  }
+  // one standard block is kept, never one that holds a big allocation
+  struct block *keep = NULL;
+  while (a->blocks != NULL) {
+    struct block *b = a->blocks;
+    a->blocks = b->next;
+    if (keep == NULL && b->size == ARENA_BLOCK_SIZE)
+      keep = b;
+    else
+      free(b);
+  }
+  if (keep == NULL)
+    keep = block_new(ARENA_BLOCK_SIZE);
+  keep->next = NULL;
+  a->blocks = keep;
+  a->used = 0;
+}
+
+void arena_free(struct arena *a) {
+  if (a == NULL)
+    return;
+  arena_reset(a);
+  free(a->blocks);
+  free(a);
+}
+
+void * arena_alloc(struct arena *a, size_t size) {
+  size = (size + ALIGN - 1) & ~(size_t) (ALIGN - 1);
+  if (size > ARENA_BLOCK_SIZE / 4) {
+    // own block behind the current one, so the current one stays in use
+    struct block *b = block_new(size);
+    b->next = a->blocks->next;
+    a->blocks->next = b;
+    return b->data;
+  }
+  if (a->used + size > a->blocks->size) {
+    struct block *b = block_new(ARENA_BLOCK_SIZE);
+    b->next = a->blocks;
+    a->blocks = b;
+    a->used = 0;
+  }
+  void *p = (char *) a->blocks->data + a->used;
+  a->used += size;
+  return p;
+}
+
+char * arena_strndup(struct arena *a, const char *str, size_t len) {
+  char *s = arena_alloc(a, len + 1);
+  memcpy(s, str, len);
+  s[len] = '\0';
+  return s;
+}
+
+char * arena_printf(struct arena *a, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  char *s = arena_alloc(a, len + 1);
+  va_start(ap, fmt);
+  vsnprintf(s, len + 1, fmt, ap);
+  va_end(ap);
+  return s;
+}
+
+void * arena_track(struct arena *a, void *object, arena_free_fn free_fn) {
+  if (object == NULL)
+    return NULL;
+  struct tracked *t = arena_alloc(a, sizeof(*t));
+  t->next = a->tracked;
+  t->object = object;
+  t->free_fn = free_fn;
+  a->tracked = t;
+  return object;
+}
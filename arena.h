@@ -0,0 +1,32 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// blocks are this big, larger allocations get a block of their own
+#define ARENA_BLOCK_SIZE (16*1024)
+
+// Bump allocator for everything a single request needs. Nothing is freed
+// on its own, arena_reset drops it all at once after the response and
+// keeps one ARENA_BLOCK_SIZE block for the next request. Not thread safe, every
+// worker thread has its own.
+struct arena;
+
+struct arena * arena_new(void);
+void arena_free(struct arena *a);
+void arena_reset(struct arena *a);
+
+// 16 byte aligned, never NULL
+void * arena_alloc(struct arena *a, size_t size);
+char * arena_strndup(struct arena *a, const char *str, size_t len);
+char * arena_printf(struct arena *a, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+// Calls free_fn(object) on reset, the last tracked object first. For
+// objects owned by the request, e.g. libgit2 ones:
+//   arena_track(a, commit, (arena_free_fn) git_commit_free);
+// NULL objects are ignored. Returns object.
+typedef void (*arena_free_fn)(void *object);
+void * arena_track(struct arena *a, void *object, arena_free_fn free_fn);
+
+#endif
@@ -0,0 +1,110 @@
+// Throughput of escape_html against the byte-at-a-time loop serve_git used
+// before. Run with: make bench_escape
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "../escape.h"
+
+
+#define INPUT_SIZE (64*1024*1024)
+#define ROUNDS (5)
+
+// the loop blob and diff rendering used before escape.c
+static size_t escape_reference(char *dst, const char *src, size_t len) {
+  struct { char c; const char * replacement; }
+  replacements[] = {
+    { '<', "&lt;" },
+    { '>', "&gt;" },
+    { '&', "&amp;" },
+  };
+
+  size_t dst_len = 0;
+  for (size_t i = 0; i < len; i++) {
+    char c = src[i];
+    bool replaced = false;
+    for (int j = 0; j < sizeof(replacements)/sizeof(replacements[0]); j++) {
+      if (replacements[j].c == c) {
+        size_t n = strlen(replacements[j].replacement);
+        memcpy(dst + dst_len, replacements[j].replacement, n);
+        dst_len += n;
+        replaced = true;
+        break;
+      }
+    }
+    if (! replaced)
+      dst[dst_len++] = c;
+  }
+  return dst_len;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// source code like text: mostly plain, one special character every
+// special_every bytes on average (0 = none)
+static void fill(char *buf, size_t len, unsigned special_every) {
+  static const char plain[] = "abcdefghijklmnopqrstuvwxyz (){};=+-*/ \n\t0123456789";
+  static const char special[] = "<>&";
+  unsigned seed = 12345;
+  for (size_t i = 0; i < len; i++) {
+    seed = seed * 1103515245 + 12345;
+    unsigned r = seed >> 8;
+    if (special_every != 0 && r % special_every == 0)
+      buf[i] = special[r % 3];
+    else
+      buf[i] = plain[r % (sizeof(plain) - 1)];
+  }
+}
+
+static double run(size_t (*fn)(char *, const char *, size_t), char *dst, const char *src, size_t len, size_t *out_len) {
+  double best = 1e9;
+  for (int i = 0; i < ROUNDS; i++) {
+    double t = now();
+    *out_len = fn(dst, src, len);
+    t = now() - t;
+    if (t < best)
+      best = t;
+  }
+  return len / best / (1024 * 1024);
+}
+
+int main(int argc, char *argv[]) {
+  char *src = malloc(INPUT_SIZE);
+  char *dst_ref = malloc((size_t) INPUT_SIZE * ESCAPE_MAX_GROWTH);
+  char *dst_new = malloc((size_t) INPUT_SIZE * ESCAPE_MAX_GROWTH);
+
+  unsigned densities[] = { 0, 1000, 100, 20, 4 };
+
+  printf("%-22s %12s %12s %8s\n", "input", "old MB/s", "new MB/s", "speedup");
+  for (int i = 0; i < sizeof(densities) / sizeof(densities[0]); i++) {
+    fill(src, INPUT_SIZE, densities[i]);
+
+    size_t ref_len, new_len;
+    double ref = run(escape_reference, dst_ref, src, INPUT_SIZE, &ref_len);
+    double new = run(escape_html, dst_new, src, INPUT_SIZE, &new_len);
+
+    if (ref_len != new_len || memcmp(dst_ref, dst_new, ref_len) != 0) {
+      fprintf(stderr, "output mismatch for 1/%u specials\n", densities[i]);
+      return 1;
+    }
+
+    char name[32];
+    if (densities[i] == 0)
+      snprintf(name, sizeof(name), "no specials");
+    else
+      snprintf(name, sizeof(name), "1 special per %u B", densities[i]);
+    printf("%-22s %12.0f %12.0f %7.1fx\n", name, ref, new, new / ref);
+  }
+
+  free(src);
+  free(dst_ref);
+  free(dst_new);
+  return 0;
+}
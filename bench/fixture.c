@@ -0,0 +1,196 @@
+// Writes a deterministic bare repository for the benchmarks, plus the
+// urls the load generator requests from it. Run through: make bench
+//
+//   fixture <dir> [-c commits] [-w width] [-d depth] [-b blob bytes]
+//                 [-k large diff every k commits] [-f files per large diff]
+//
+// Every directory has width files and, above depth, width subdirectories.
+// Each commit rewrites a few lines of 3 files, every k-th commit touches
+// f files at once. Same arguments, same oids.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <git2.h>
+
+
+static int commits = 2000;
+static int width = 8;
+static int depth = 2;
+static int blob_size = 8192;
+static int large_every = 100;
+static int large_files = 200;
+
+static git_repository *repo;
+static git_oid *blobs;
+static int *revisions;
+static int files_len;
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+
+static uint64_t next_random(void) {
+  // xorshift64, fixed seed
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng;
+}
+
+static void check(int error, const char *what) {
+  if (error < 0) {
+    const git_error *e = git_error_last();
+    fprintf(stderr, "%s: %s\n", what, e != NULL ? e->message : "?");
+    exit(1);
+  }
+}
+
+// Files are numbered per directory, directories in pre-order. The content
+// depends only on the file and its revision.
+static void write_blob(int file) {
+  char *data = malloc(blob_size + 128);
+  size_t len = 0;
+  for (int line = 0; len < blob_size; line++) {
+    // a few lines per revision change, the rest stays the same
+    int rev = line % 16 == revisions[file] % 16 ? revisions[file] : 0;
+    len += sprintf(data + len, "line %d of file %d <rev %d> & some text to escape\n", line, file, rev);
+  }
+  check(git_blob_create_from_buffer(&blobs[file], repo, data, len), "blob");
+  free(data);
+}
+
+static int dirs_below(int level) {
+  // directories in a subtree rooted at level, itself included
+  int n = 1;
+  for (int l = level; l < depth; l++)
+    n = n * width + 1;
+  return n;
+}
+
+// Builds the tree of the directory whose first file is *file
+static void write_tree(git_oid *out, int level, int *file) {
+  git_treebuilder *builder;
+  check(git_treebuilder_new(&builder, repo, NULL), "treebuilder");
+  char name[32];
+  for (int i = 0; i < width; i++, (*file)++) {
+    snprintf(name, sizeof(name), "f%d.txt", i);
+    check(git_treebuilder_insert(NULL, builder, name, &blobs[*file], GIT_FILEMODE_BLOB), "insert");
+  }
+  if (level < depth) {
+    for (int i = 0; i < width; i++) {
+      git_oid sub;
+      write_tree(&sub, level + 1, file);
+      snprintf(name, sizeof(name), "d%d", i);
+      check(git_treebuilder_insert(NULL, builder, name, &sub, GIT_FILEMODE_TREE), "insert");
+    }
+  }
+  check(git_treebuilder_write(out, builder), "tree");
+  git_treebuilder_free(builder);
+}
+
+static void touch(int file) {
+  revisions[file]++;
+  write_blob(file);
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "c:w:d:b:k:f:")) != -1) {
+    switch (opt) {
+      case 'c': commits = atoi(optarg); break;
+      case 'w': width = atoi(optarg); break;
+      case 'd': depth = atoi(optarg); break;
+      case 'b': blob_size = atoi(optarg); break;
+      case 'k': large_every = atoi(optarg); break;
+      case 'f': large_files = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s <dir> [-c commits] [-w width] [-d depth] [-b blob bytes] "
+                        "[-k large diff every k commits] [-f files per large diff]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s <dir> [options]\n", argv[0]);
+    return 1;
+  }
+  const char *dir = argv[optind];
+
+  git_libgit2_init();
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/bench.git", dir);
+  check(git_repository_init(&repo, path, 1), "init");
+  check(git_repository_set_head(repo, "refs/heads/main"), "head");
+
+  files_len = dirs_below(0) * width;
+  blobs = calloc(files_len, sizeof(*blobs));
+  revisions = calloc(files_len, sizeof(*revisions));
+  for (int i = 0; i < files_len; i++)
+    write_blob(i);
+
+  git_oid *history = calloc(commits, sizeof(*history));
+  int lastLarge = -1;
+  git_commit *parent = NULL;
+  for (int c = 0; c < commits; c++) {
+    if (c > 0) {
+      bool large = large_every > 0 && c % large_every == 0;
+      int n = large ? large_files : 3;
+      for (int i = 0; i < n; i++)
+        touch(next_random() % files_len);
+      if (large)
+        lastLarge = c;
+    }
+
+    git_oid treeOid;
+    int file = 0;
+    write_tree(&treeOid, 0, &file);
+    git_tree *tree;
+    check(git_tree_lookup(&tree, repo, &treeOid), "tree lookup");
+
+    git_signature *sig;
+    check(git_signature_new(&sig, "Bench", "bench@localhost", 1600000000 + (git_time_t) c * 600, 0), "signature");
+    char message[64];
+    snprintf(message, sizeof(message), "Commit %d\n", c);
+    const git_commit *parents[] = { parent };
+    check(git_commit_create(&history[c], repo, "refs/heads/main", sig, sig, NULL, message, tree,
+      parent != NULL ? 1 : 0, parents), "commit");
+    git_signature_free(sig);
+    git_tree_free(tree);
+    git_commit_free(parent);
+    check(git_commit_lookup(&parent, repo, &history[c]), "commit lookup");
+  }
+  git_commit_free(parent);
+
+  // label and url per line, the load generator cycles through them
+  snprintf(path, sizeof(path), "%s/urls.txt", dir);
+  FILE *f = fopen(path, "w");
+  char oid[GIT_OID_HEXSZ + 1];
+  for (int i = 0; i < 4; i++) {
+    // log pages deep in history
+    git_oid_tostr(oid, sizeof(oid), &history[(commits - 1) * i / 8]);
+    fprintf(f, "log /git/bench.git/main/%s/tree\n", oid);
+  }
+  fprintf(f, "tree /git/bench.git/main/HEAD/tree\n");
+  fprintf(f, "tree /git/bench.git/main/HEAD/tree/d1\n");
+  fprintf(f, "blob /git/bench.git/main/HEAD/blob/d0/f1.txt\n");
+  fprintf(f, "blob /git/bench.git/main/HEAD/blob/f2.txt\n");
+  git_oid_tostr(oid, sizeof(oid), &history[commits - 1]);
+  fprintf(f, "diff /git/bench.git/main/%s/diff\n", oid);
+  if (lastLarge > 0) {
+    git_oid_tostr(oid, sizeof(oid), &history[lastLarge]);
+    fprintf(f, "diff-large /git/bench.git/main/%s/diff\n", oid);
+    fprintf(f, "diff-large /git/bench.git/main/%s/diff?file=0\n", oid);
+  }
+  fprintf(f, "raw /git/bench.git/main/HEAD/raw/d0/f0.txt\n");
+  fprintf(f, "index /git\n");
+  fclose(f);
+
+  printf("%s/bench.git: %d commits, %d files\n", dir, commits, files_len);
+  free(history);
+  free(blobs);
+  free(revisions);
+  git_repository_free(repo);
+  git_libgit2_shutdown();
+  return 0;
+}
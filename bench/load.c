@@ -0,0 +1,369 @@
+// HTTP/1.1 load generator for the benchmarks. Keeps one keep-alive
+// connection per thread and cycles through the urls of a fixture.
+// Run through: make bench
+//
+//   load <urls.txt> [-h host] [-p port] [-c connections] [-t seconds]
+//                   [-W warmup seconds] [-P server pid]
+//
+// Prints requests/s and p50/p99 latency per url label, and the peak RSS
+// of the server if its pid is given.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+
+#define MAX_URLS (256)
+#define MAX_LABELS (32)
+
+struct url {
+  char label[32];
+  char path[1024];
+  int label_index;
+};
+
+struct sample {
+  uint32_t us;
+  uint16_t label;
+};
+
+struct thread {
+  pthread_t thread;
+  int index;
+  struct sample *samples;
+  size_t samples_len, samples_cap;
+  uint64_t bytes;
+  int errors;
+};
+
+static struct url urls[MAX_URLS];
+static int urls_len = 0;
+static char labels[MAX_LABELS][32];
+static int labels_len = 0;
+
+static const char *host = "127.0.0.1";
+static const char *port = "8089";
+static int connections = 8;
+static int seconds = 10;
+static int warmup = 2;
+static int server_pid = 0;
+
+static volatile bool recording = false;
+static volatile bool stopping = false;
+
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int connect_server(void) {
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res;
+  if (getaddrinfo(host, port, &hints, &res) != 0)
+    return -1;
+  int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd >= 0) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+// Buffered reader over the connection
+struct reader {
+  int fd;
+  char buf[64*1024];
+  size_t pos, len;
+};
+static bool fill(struct reader *r) {
+  if (r->pos < r->len)
+    return true;
+  ssize_t n = recv(r->fd, r->buf, sizeof(r->buf), 0);
+  if (n <= 0)
+    return false;
+  r->pos = 0;
+  r->len = n;
+  return true;
+}
+static bool read_line(struct reader *r, char *line, size_t cap) {
+  size_t n = 0;
+  for (;;) {
+    if (! fill(r))
+      return false;
+    char c = r->buf[r->pos++];
+    if (c == '\n')
+      break;
+    if (c != '\r' && n + 1 < cap)
+      line[n++] = c;
+  }
+  line[n] = '\0';
+  return true;
+}
+static bool skip(struct reader *r, uint64_t len) {
+  while (len > 0) {
+    if (! fill(r))
+      return false;
+    size_t n = r->len - r->pos < len ? r->len - r->pos : len;
+    r->pos += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Reads one response, returns the body size or -1 if the connection broke
+static long long read_response(struct reader *r, bool *keepAlive) {
+  char line[4096];
+  if (! read_line(r, line, sizeof(line)) || strncmp(line, "HTTP/1.", 7) != 0)
+    return -1;
+  int status = atoi(line + 9);
+  long long length = -1;
+  bool chunked = false;
+  *keepAlive = line[7] != '0';
+  for (;;) {
+    if (! read_line(r, line, sizeof(line)))
+      return -1;
+    if (line[0] == '\0')
+      break;
+    if (strncasecmp(line, "Content-Length:", 15) == 0)
+      length = atoll(line + 15);
+    else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strstr(line, "chunked") != NULL)
+      chunked = true;
+    else if (strncasecmp(line, "Connection:", 11) == 0 && strstr(line, "close") != NULL)
+      *keepAlive = false;
+  }
+  if (status == 304 || status == 204)
+    return 0;
+
+  long long total = 0;
+  if (chunked) {
+    for (;;) {
+      if (! read_line(r, line, sizeof(line)))
+        return -1;
+      long long n = strtoll(line, NULL, 16);
+      if (n == 0) {
+        read_line(r, line, sizeof(line));
+        break;
+      }
+      if (! skip(r, n) || ! read_line(r, line, sizeof(line)))
+        return -1;
+      total += n;
+    }
+  }
+  else if (length >= 0) {
+    if (! skip(r, length))
+      return -1;
+    total = length;
+  }
+  else {
+    // body until close
+    while (fill(r)) {
+      total += r->len - r->pos;
+      r->pos = r->len;
+    }
+    *keepAlive = false;
+  }
+  return status >= 400 ? -1 : total;
+}
+
+static void record(struct thread *t, uint32_t us, int label) {
+  if (t->samples_len == t->samples_cap) {
+    t->samples_cap = t->samples_cap ? t->samples_cap * 2 : 65536;
+    t->samples = realloc(t->samples, t->samples_cap * sizeof(*t->samples));
+  }
+  t->samples[t->samples_len].us = us;
+  t->samples[t->samples_len].label = label;
+  t->samples_len++;
+}
+
+static void * thread_main(void *arg) {
+  struct thread *t = arg;
+  struct reader *r = malloc(sizeof(*r));
+  r->fd = -1;
+  // threads start at different urls so the mix is spread evenly
+  int next = t->index % urls_len;
+  while (! stopping) {
+    if (r->fd < 0) {
+      r->fd = connect_server();
+      r->pos = r->len = 0;
+      if (r->fd < 0) {
+        t->errors++;
+        usleep(100000);
+        continue;
+      }
+    }
+    struct url *u = &urls[next];
+    next = (next + 1) % urls_len;
+
+    char request[2048];
+    int n = snprintf(request, sizeof(request),
+      "GET %s HTTP/1.1\r\nHost: %s\r\nAccept-Encoding: gzip\r\n\r\n", u->path, host);
+    uint64_t start = now_us();
+    bool keepAlive;
+    long long body = -1;
+    if (send(r->fd, request, n, MSG_NOSIGNAL) == n)
+      body = read_response(r, &keepAlive);
+    uint64_t end = now_us();
+
+    if (body < 0) {
+      if (recording)
+        t->errors++;
+      close(r->fd);
+      r->fd = -1;
+      continue;
+    }
+    if (recording) {
+      record(t, end - start, u->label_index);
+      t->bytes += body;
+    }
+    if (! keepAlive) {
+      close(r->fd);
+      r->fd = -1;
+    }
+  }
+  if (r->fd >= 0)
+    close(r->fd);
+  free(r);
+  return NULL;
+}
+
+static int compare_samples(const void *a, const void *b) {
+  const struct sample *x = a, *y = b;
+  if (x->label != y->label)
+    return x->label - y->label;
+  return x->us < y->us ? -1 : x->us > y->us;
+}
+
+static long peak_rss_kb(int pid) {
+  char path[64], line[256];
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  FILE *f = fopen(path, "r");
+  long kb = -1;
+  while (f != NULL && fgets(line, sizeof(line), f) != NULL)
+    if (strncmp(line, "VmHWM:", 6) == 0)
+      kb = atol(line + 6);
+  if (f != NULL)
+    fclose(f);
+  return kb;
+}
+
+static void load_urls(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    exit(1);
+  }
+  char line[1100];
+  while (urls_len < MAX_URLS && fgets(line, sizeof(line), f) != NULL) {
+    struct url *u = &urls[urls_len];
+    if (sscanf(line, "%31s %1023s", u->label, u->path) != 2)
+      continue;
+    int l;
+    for (l = 0; l < labels_len; l++)
+      if (strcmp(labels[l], u->label) == 0)
+        break;
+    if (l == labels_len) {
+      // no slot left for its stats
+      if (labels_len == MAX_LABELS) {
+        fprintf(stderr, "%s: more than %d labels, skipping %s", path, MAX_LABELS, line);
+        continue;
+      }
+      strcpy(labels[labels_len++], u->label);
+    }
+    u->label_index = l;
+    urls_len++;
+  }
+  fclose(f);
+  if (urls_len == 0) {
+    fprintf(stderr, "%s: no urls\n", path);
+    exit(1);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "h:p:c:t:W:P:")) != -1) {
+    switch (opt) {
+      case 'h': host = optarg; break;
+      case 'p': port = optarg; break;
+      case 'c': connections = atoi(optarg); break;
+      case 't': seconds = atoi(optarg); break;
+      case 'W': warmup = atoi(optarg); break;
+      case 'P': server_pid = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s <urls.txt> [-h host] [-p port] [-c connections] [-t seconds] "
+                        "[-W warmup seconds] [-P server pid]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s <urls.txt> [options]\n", argv[0]);
+    return 1;
+  }
+  load_urls(argv[optind]);
+
+  struct thread *threads = calloc(connections, sizeof(*threads));
+  for (int i = 0; i < connections; i++) {
+    threads[i].index = i;
+    pthread_create(&threads[i].thread, NULL, thread_main, &threads[i]);
+  }
+  sleep(warmup);
+  recording = true;
+  uint64_t start = now_us();
+  sleep(seconds);
+  recording = false;
+  double elapsed = (now_us() - start) / 1e6;
+  stopping = true;
+
+  size_t total = 0;
+  uint64_t bytes = 0;
+  int errors = 0;
+  for (int i = 0; i < connections; i++) {
+    pthread_join(threads[i].thread, NULL);
+    total += threads[i].samples_len;
+    bytes += threads[i].bytes;
+    errors += threads[i].errors;
+  }
+  struct sample *all = malloc((total + 1) * sizeof(*all));
+  size_t n = 0;
+  for (int i = 0; i < connections; i++) {
+    memcpy(all + n, threads[i].samples, threads[i].samples_len * sizeof(*all));
+    n += threads[i].samples_len;
+    free(threads[i].samples);
+  }
+  qsort(all, total, sizeof(*all), compare_samples);
+
+  printf("%-12s %10s %10s %10s %10s\n", "url", "requests", "req/s", "p50 ms", "p99 ms");
+  for (size_t i = 0; i < total; ) {
+    size_t j = i;
+    while (j < total && all[j].label == all[i].label)
+      j++;
+    size_t count = j - i;
+    printf("%-12s %10zu %10.1f %10.2f %10.2f\n", labels[all[i].label], count, count / elapsed,
+      all[i + count / 2].us / 1000.0, all[i + count * 99 / 100].us / 1000.0);
+    i = j;
+  }
+  printf("%-12s %10zu %10.1f\n", "total", total, total / elapsed);
+  printf("%.1f MB/s received, %d errors\n", bytes / elapsed / 1e6, errors);
+  if (server_pid > 0)
+    printf("server peak RSS %ld kB\n", peak_rss_kb(server_pid));
+
+  free(all);
+  free(threads);
+  return 0;
+}
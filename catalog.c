@@ -0,0 +1,393 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <git2.h>
+
+#include "catalog.h"
+#include "escape.h"
+#include "compress.h"
+#include "prerender.h"
+#include "repo_cache.h"
+
+
+struct catalog_repo {
+  char *name;
+  char *default_branch;
+  git_time_t last_commit;
+  char *summary;
+  // inotify watches on the repo itself (packed-refs) and refs/heads
+  int wd_repo, wd_heads;
+  bool dirty;
+};
+
+static char *root = NULL;
+static struct catalog_repo *repos = NULL;
+static size_t repos_len = 0;
+static int inotify_fd = -1;
+static int wd_root = -1;
+static bool root_dirty = false;
+
+struct catalog_page {
+  char *html;
+  size_t len;
+  // compressed once per render, indexed by enum encoding
+  char *compressed[3];
+  size_t compressed_len[3];
+};
+
+// The repos, inotify and the rendering belong to the catalog thread, the
+// event loop only swaps finished pages in
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+static bool stopping = false;
+static bool started = false;
+static pthread_t thread;
+// rendered by the thread, not yet picked up by the event loop
+static struct catalog_page *pending = NULL;
+// served, event loop only
+static struct catalog_page *page = NULL;
+
+// the page being rendered
+static char *html = NULL;
+static size_t html_len = 0, html_cap = 0;
+
+
+static void html_append(const char *data, size_t len) {
+  if (html_len + len + 1 > html_cap) {
+    while (html_len + len + 1 > html_cap)
+      html_cap = html_cap ? html_cap * 2 : 4096;
+    html = realloc(html, html_cap);
+  }
+  memcpy(html + html_len, data, len);
+  html_len += len;
+  html[html_len] = '\0';
+}
+static void html_printf(const char *fmt, ...) {
+  char buf[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  html_append(buf, n < sizeof(buf) ? n : sizeof(buf) - 1);
+}
+static void html_escaped(const char *s) {
+  size_t len = strlen(s);
+  char *buf = malloc(len * ESCAPE_MAX_GROWTH + 1);
+  html_append(buf, escape_html(buf, s, len));
+  free(buf);
+}
+
+static int compare_repos(const void *a, const void *b) {
+  const struct catalog_repo *ra = a, *rb = b;
+  if (ra->last_commit != rb->last_commit)
+    return ra->last_commit < rb->last_commit ? 1 : -1;
+  return strcmp(ra->name, rb->name);
+}
+
+static void page_free(struct catalog_page *p) {
+  if (p == NULL)
+    return;
+  free(p->html);
+  for (int e = ENCODING_GZIP; e <= ENCODING_BROTLI; e++)
+    free(p->compressed[e]);
+  free(p);
+}
+
+// Renders the page and hands it to the event loop, see swap_fn
+static void render(void) {
+  qsort(repos, repos_len, sizeof(*repos), compare_repos);
+
+  html_len = 0;
+  html_printf("<html>\n");
+  html_printf("<form action=\"/search\" method=\"GET\"><input type=\"text\" name=\"q\" /> "
+              "<input type=\"submit\" value=\"search\" /></form>\n");
+  for (size_t i = 0; i < repos_len; i++) {
+    struct catalog_repo *r = &repos[i];
+    char date[32] = "";
+    if (r->last_commit > 0) {
+      time_t t = r->last_commit;
+      struct tm tm;
+      strftime(date, sizeof(date), "%Y-%m-%d", gmtime_r(&t, &tm));
+    }
+    html_printf("<a href=\"/git/%s/%s/HEAD/tree\">%s</a> %s ", r->name, r->default_branch, r->name, date);
+    html_escaped(r->summary);
+    html_printf("<br />\n");
+  }
+  html_printf("</html>\n");
+
+  struct catalog_page *p = calloc(1, sizeof(*p));
+  p->html = html;
+  p->len = html_len;
+  html = NULL;
+  html_len = html_cap = 0;
+  for (int e = ENCODING_GZIP; e <= ENCODING_BROTLI; e++)
+    p->compressed[e] = compress_buffer(e, e == ENCODING_BROTLI ? 11 : 9, p->html, p->len, &p->compressed_len[e]);
+
+  pthread_mutex_lock(&lock);
+  page_free(pending);
+  pending = p;
+  pthread_mutex_unlock(&lock);
+}
+
+// Reads default branch and newest commit of a repo. Runs whenever its
+// refs changed, not per request.
+static void repo_load(struct catalog_repo *r) {
+  free(r->default_branch);
+  free(r->summary);
+  r->default_branch = strdup("main");
+  r->summary = strdup("");
+  r->last_commit = 0;
+  r->dirty = false;
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", root, r->name);
+  // the handles of the worker threads as well
+  repo_cache_invalidate(path);
+
+  if (r->wd_repo < 0)
+    r->wd_repo = inotify_add_watch(inotify_fd, path, IN_MOVED_TO | IN_CREATE | IN_DELETE);
+  if (r->wd_heads < 0) {
+    char heads[4096 + 16];
+    snprintf(heads, sizeof(heads), "%s/refs/heads", path);
+    r->wd_heads = inotify_add_watch(inotify_fd, heads, IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MODIFY);
+  }
+
+  git_repository *repo;
+  if (git_repository_open_bare(&repo, path) != 0)
+    return;
+
+  git_reference *head;
+  if (git_reference_lookup(&head, repo, "HEAD") == 0) {
+    const char *target = git_reference_symbolic_target(head);
+    if (target != NULL && strncmp(target, "refs/heads/", 11) == 0) {
+      free(r->default_branch);
+      r->default_branch = strdup(target + 11);
+    }
+    git_reference_free(head);
+  }
+
+  // last commit over all branches, summary from the default branch
+  git_branch_iterator *it;
+  if (git_branch_iterator_new(&it, repo, GIT_BRANCH_LOCAL) == 0) {
+    git_reference *ref;
+    git_branch_t branchType;
+    while (git_branch_next(&ref, &branchType, it) == 0) {
+      git_commit *commit;
+      const git_oid *target = git_reference_target(ref);
+      const char *name;
+      if (target != NULL && git_branch_name(&name, ref) == 0)
+        prerender_submit(path, name, target);
+      if (target != NULL && git_commit_lookup(&commit, repo, target) == 0) {
+        if (git_commit_time(commit) > r->last_commit)
+          r->last_commit = git_commit_time(commit);
+        if (git_branch_name(&name, ref) == 0 && strcmp(name, r->default_branch) == 0) {
+          const char *summary = git_commit_summary(commit);
+          free(r->summary);
+          r->summary = strdup(summary != NULL ? summary : "");
+        }
+        git_commit_free(commit);
+      }
+      git_reference_free(ref);
+    }
+    git_branch_iterator_free(it);
+  }
+
+  git_repository_free(repo);
+}
+
+static bool heads_exist(struct catalog_repo *r) {
+  char heads[4096];
+  snprintf(heads, sizeof(heads), "%s/%s/refs/heads", root, r->name);
+  return access(heads, F_OK) == 0;
+}
+
+static void repo_clear(struct catalog_repo *r) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", root, r->name);
+  repo_cache_invalidate(path);
+  if (r->wd_repo >= 0) inotify_rm_watch(inotify_fd, r->wd_repo);
+  if (r->wd_heads >= 0) inotify_rm_watch(inotify_fd, r->wd_heads);
+  free(r->name);
+  free(r->default_branch);
+  free(r->summary);
+}
+
+static bool is_repo_name(const char *name) {
+  size_t len = strlen(name);
+  return len > 4 && strcmp(name + len - 4, ".git") == 0;
+}
+
+// Picks up added and removed repos, keeps the ones we already know.
+static void scan_root(void) {
+  root_dirty = false;
+  DIR *dir = opendir(root);
+  if (dir == NULL)
+    return;
+
+  struct catalog_repo *found = NULL;
+  size_t found_len = 0;
+  struct dirent *d;
+  while ((d = readdir(dir)) != NULL) {
+    if (! is_repo_name(d->d_name))
+      continue;
+    found = realloc(found, (found_len + 1) * sizeof(*found));
+    struct catalog_repo *r = &found[found_len++];
+
+    size_t i;
+    for (i = 0; i < repos_len; i++)
+      if (repos[i].name != NULL && strcmp(repos[i].name, d->d_name) == 0)
+        break;
+    if (i < repos_len) {
+      *r = repos[i];
+      repos[i].name = NULL;
+    }
+    else {
+      memset(r, 0, sizeof(*r));
+      r->name = strdup(d->d_name);
+      r->wd_repo = r->wd_heads = -1;
+      repo_load(r);
+    }
+  }
+  closedir(dir);
+
+  // whatever is left was removed
+  for (size_t i = 0; i < repos_len; i++)
+    if (repos[i].name != NULL)
+      repo_clear(&repos[i]);
+  free(repos);
+  repos = found;
+  repos_len = found_len;
+}
+
+// Reloads what inotify says changed since the last call
+static void refresh(void) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+  bool changed = false;
+  while ((n = read(inotify_fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + n; ) {
+      struct inotify_event *ev = (struct inotify_event *) p;
+      if (ev->wd == wd_root) {
+        root_dirty = true;
+      }
+      else {
+        for (size_t i = 0; i < repos_len; i++)
+          if (repos[i].wd_repo == ev->wd || repos[i].wd_heads == ev->wd)
+            repos[i].dirty = true;
+      }
+      if (ev->mask & IN_IGNORED) {
+        // watched directory went away, re-add the watch on the next load
+        for (size_t i = 0; i < repos_len; i++) {
+          if (repos[i].wd_repo == ev->wd) repos[i].wd_repo = -1;
+          if (repos[i].wd_heads == ev->wd) repos[i].wd_heads = -1;
+        }
+      }
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+
+  if (root_dirty) {
+    scan_root();
+    changed = true;
+  }
+  for (size_t i = 0; i < repos_len; i++) {
+    // a freshly created repo has no refs/heads yet when we first see it
+    if (repos[i].dirty || (repos[i].wd_heads < 0 && heads_exist(&repos[i]))) {
+      repo_load(&repos[i]);
+      changed = true;
+    }
+  }
+  if (changed)
+    render();
+}
+
+// Refreshes every CATALOG_POLL_MS, so the events of a push come in as one
+// batch, until catalog_free
+static void * catalog_main(void *arg) {
+  pthread_mutex_lock(&lock);
+  while (! stopping) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += CATALOG_POLL_MS / 1000;
+    ts.tv_nsec += (CATALOG_POLL_MS % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&stop_cond, &lock, &ts);
+    if (stopping)
+      break;
+    pthread_mutex_unlock(&lock);
+    refresh();
+    pthread_mutex_lock(&lock);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+static void swap_fn(void *arg) {
+  pthread_mutex_lock(&lock);
+  if (pending != NULL) {
+    page_free(page);
+    page = pending;
+    pending = NULL;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void catalog_init(struct mg_mgr *mgr, const char *dir) {
+  root = strdup(dir);
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  wd_root = inotify_add_watch(inotify_fd, root, IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM | IN_ONLYDIR);
+
+  // the first page is there before anything is served
+  scan_root();
+  render();
+  swap_fn(NULL);
+
+  mg_timer_add(mgr, CATALOG_POLL_MS, MG_TIMER_REPEAT, swap_fn, NULL);
+  started = pthread_create(&thread, NULL, catalog_main, NULL) == 0;
+}
+
+void catalog_free(void) {
+  if (started) {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&stop_cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    started = false;
+  }
+  for (size_t i = 0; i < repos_len; i++)
+    repo_clear(&repos[i]);
+  free(repos);
+  repos = NULL;
+  repos_len = 0;
+  if (inotify_fd >= 0)
+    close(inotify_fd);
+  inotify_fd = -1;
+  free(root);
+  free(html);
+  html = NULL;
+  html_len = html_cap = 0;
+  page_free(pending);
+  page_free(page);
+  pending = page = NULL;
+}
+
+const char * catalog_html(enum encoding *encoding, size_t *len) {
+  if (*encoding != ENCODING_IDENTITY && page->compressed[*encoding] != NULL) {
+    *len = page->compressed_len[*encoding];
+    return page->compressed[*encoding];
+  }
+  *encoding = ENCODING_IDENTITY;
+  *len = page->len;
+  return page->html;
+}
@@ -0,0 +1,23 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stddef.h>
+#include <mongoose.h>
+
+#include "compress.h"
+
+#define CATALOG_POLL_MS (1000)
+
+// In-memory list of the bare repositories (*.git) under root with their
+// default branch, last commit time and summary. A background thread keeps
+// it up to date with inotify and renders the page, which a mongoose timer
+// swaps in on the event loop, so libgit2 never runs there after startup.
+void catalog_init(struct mg_mgr *mgr, const char *root);
+void catalog_free(void);
+
+// The rendered /git index page, newest commit first. Compressed variants
+// are prepared on render, encoding is reset to identity if there is none.
+// Event loop only, the page stays valid until the next timer tick.
+const char * catalog_html(enum encoding *encoding, size_t *len);
+
+#endif
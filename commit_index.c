@@ -0,0 +1,604 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "commit_index.h"
+#include "metrics.h"
+
+
+struct commit_index {
+  char *repo_path;
+  char *branch;
+  git_oid tip;
+  unsigned long last_used;
+
+  // refs is guarded by table_lock, everything else by lock
+  int refs;
+  pthread_mutex_t lock;
+
+  // oldest commit first, so fast-forwards only append
+  git_oid *oids;
+  size_t count, cap;
+
+  // open addressing, stores index into oids + 1, 0 is empty
+  uint32_t *slots;
+  size_t slots_cap;
+
+  // path -> commits (indexes into oids, ascending) that changed it, filled
+  // lazily up to paths_done, see commit_index_last_change
+  struct path_touches **paths;
+  size_t paths_count, paths_cap;
+  size_t paths_done;
+  // the file was read, see paths_load
+  bool paths_loaded;
+  // touches were added out of order, see paths_sort
+  bool paths_unsorted;
+  // somebody is diffing commits without the lock, see
+  // commit_index_update_paths; paths_cond is signalled when they're done
+  bool paths_building;
+  pthread_cond_t paths_cond;
+  // callers waiting for paths_building, a capped build stops early for them
+  int paths_waiting;
+  // bumped whenever positions change (rebuild, eviction), so a build that
+  // ran without the lock knows its results are for a different list
+  unsigned long generation;
+};
+
+// on disk, followed by the key (repo path, newline, branch), the commits
+// whose paths are recorded and then per path its length, its number of
+// touches, the path and the touches as indexes into the commits
+struct paths_header {
+  char magic[4];
+  uint32_t commits, paths, key_len;
+};
+
+struct path_touches {
+  char *path;
+  uint32_t *touches;
+  size_t len, cap;
+};
+
+static struct commit_index indexes[COMMIT_INDEX_SIZE];
+static unsigned long use_counter = 0;
+// guards which slot belongs to which (repo, branch)
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static char *paths_dir = NULL;
+
+static void init_locks(void) {
+  for (int i = 0; i < COMMIT_INDEX_SIZE; i++) {
+    pthread_mutex_init(&indexes[i].lock, NULL);
+    pthread_cond_init(&indexes[i].paths_cond, NULL);
+  }
+}
+
+
+static size_t oid_hash(const git_oid *oid) {
+  // oids are already uniformly distributed
+  uint32_t h;
+  memcpy(&h, oid->id, sizeof(h));
+  return h;
+}
+static void map_insert(struct commit_index *index, size_t i) {
+  size_t mask = index->slots_cap - 1;
+  size_t s = oid_hash(&index->oids[i]) & mask;
+  while (index->slots[s] != 0)
+    s = (s + 1) & mask;
+  index->slots[s] = i + 1;
+}
+static bool map_grow(struct commit_index *index, size_t count) {
+  // keep load factor below 1/2
+  if (count * 2 < index->slots_cap)
+    return true;
+  size_t cap = index->slots_cap ? index->slots_cap : 1024;
+  while (count * 2 >= cap)
+    cap *= 2;
+  uint32_t *slots = calloc(cap, sizeof(*slots));
+  if (slots == NULL)
+    return false;
+  free(index->slots);
+  index->slots = slots;
+  index->slots_cap = cap;
+  for (size_t i = 0; i < index->count; i++)
+    map_insert(index, i);
+  return true;
+}
+static bool push_oid(struct commit_index *index, const git_oid *oid) {
+  if (index->count == index->cap) {
+    size_t cap = index->cap ? index->cap * 2 : 1024;
+    git_oid *oids = realloc(index->oids, cap * sizeof(*oids));
+    if (oids == NULL)
+      return false;
+    index->oids = oids;
+    index->cap = cap;
+  }
+  if (! map_grow(index, index->count + 1))
+    return false;
+  index->oids[index->count] = *oid;
+  map_insert(index, index->count);
+  index->count++;
+  return true;
+}
+static size_t path_hash(const char *path, size_t len) {
+  size_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char) path[i]) * 0x100000001b3ULL;
+  return h;
+}
+static struct path_touches ** path_slot(struct commit_index *index, const char *path, size_t len) {
+  size_t mask = index->paths_cap - 1;
+  size_t s = path_hash(path, len) & mask;
+  while (index->paths[s] != NULL &&
+         (strncmp(index->paths[s]->path, path, len) != 0 || index->paths[s]->path[len] != '\0'))
+    s = (s + 1) & mask;
+  return &index->paths[s];
+}
+static bool paths_grow(struct commit_index *index) {
+  // same load factor as the oid map
+  if ((index->paths_count + 1) * 2 < index->paths_cap)
+    return true;
+  size_t cap = index->paths_cap ? index->paths_cap * 2 : 1024;
+  struct path_touches **old = index->paths;
+  size_t oldCap = index->paths_cap;
+  index->paths = calloc(cap, sizeof(*index->paths));
+  if (index->paths == NULL) {
+    index->paths = old;
+    return false;
+  }
+  index->paths_cap = cap;
+  for (size_t i = 0; i < oldCap; i++)
+    if (old[i] != NULL)
+      *path_slot(index, old[i]->path, strlen(old[i]->path)) = old[i];
+  free(old);
+  return true;
+}
+// Records that commit i changed path[0..len)
+static bool path_touch(struct commit_index *index, const char *path, size_t len, uint32_t i) {
+  if (! paths_grow(index))
+    return false;
+  struct path_touches **slot = path_slot(index, path, len);
+  if (*slot == NULL) {
+    *slot = calloc(1, sizeof(**slot));
+    (*slot)->path = strndup(path, len);
+    index->paths_count++;
+  }
+  struct path_touches *p = *slot;
+  // several files of one directory changed in the same commit
+  if (p->len > 0 && p->touches[p->len - 1] == i)
+    return true;
+  if (p->len > 0 && p->touches[p->len - 1] > i)
+    index->paths_unsorted = true;
+  if (p->len == p->cap) {
+    p->cap = p->cap ? p->cap * 2 : 4;
+    p->touches = realloc(p->touches, p->cap * sizeof(*p->touches));
+  }
+  p->touches[p->len++] = i;
+  return true;
+}
+static void paths_clear(struct commit_index *index) {
+  for (size_t i = 0; i < index->paths_cap; i++) {
+    if (index->paths[i] == NULL)
+      continue;
+    free(index->paths[i]->path);
+    free(index->paths[i]->touches);
+    free(index->paths[i]);
+  }
+  free(index->paths);
+  index->paths = NULL;
+  index->paths_count = index->paths_cap = index->paths_done = 0;
+  index->paths_loaded = index->paths_unsorted = false;
+}
+
+static int compare_touches(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+  return x < y ? -1 : x > y;
+}
+// Sorts and dedups the touches of every path after paths_load
+static void paths_sort(struct commit_index *index) {
+  for (size_t i = 0; i < index->paths_cap; i++) {
+    struct path_touches *p = index->paths[i];
+    if (p == NULL || p->len < 2)
+      continue;
+    qsort(p->touches, p->len, sizeof(*p->touches), compare_touches);
+    size_t len = 1;
+    for (size_t j = 1; j < p->len; j++)
+      if (p->touches[j] != p->touches[len - 1])
+        p->touches[len++] = p->touches[j];
+    p->len = len;
+  }
+  index->paths_unsorted = false;
+}
+
+void commit_index_init(const char *dir) {
+  if (dir == NULL)
+    return;
+  paths_dir = strdup(dir);
+  mkdir(paths_dir, 0755);
+}
+
+static void index_clear(struct commit_index *index) {
+  paths_clear(index);
+  free(index->repo_path);
+  free(index->branch);
+  free(index->oids);
+  free(index->slots);
+  index->repo_path = index->branch = NULL;
+  index->oids = NULL;
+  index->slots = NULL;
+  index->count = index->cap = index->slots_cap = 0;
+  memset(&index->tip, 0, sizeof(index->tip));
+  index->generation++;
+}
+
+// Walks tip, hiding from (may be NULL), and appends the new commits oldest first.
+static bool index_extend(struct commit_index *index, git_repository *repo,
+  const git_oid *tip, const git_oid *from)
+{
+  uint64_t start = metrics_now();
+  git_revwalk *walk;
+  if (git_revwalk_new(&walk, repo) != 0)
+    return false;
+  git_revwalk_sorting(walk, GIT_SORT_TOPOLOGICAL | GIT_SORT_TIME | GIT_SORT_REVERSE);
+  git_revwalk_push(walk, tip);
+  if (from != NULL)
+    git_revwalk_hide(walk, from);
+
+  // commits that are new relative to from can only have parents that are
+  // either new themselves or already in the index, so appending them in
+  // reverse topological order keeps the whole list topologically sorted
+  bool ok = true;
+  git_oid oid;
+  while (ok && git_revwalk_next(&oid, walk) == 0)
+    ok = push_oid(index, &oid);
+
+  git_revwalk_free(walk);
+  metrics_git(METRICS_GIT_REVWALK, start);
+  return ok;
+}
+
+struct commit_index * commit_index_get(git_repository *repo, const char *repo_path,
+  const char *branch, const git_oid *tip)
+{
+  pthread_once(&init_once, init_locks);
+
+  // find the slot, or claim the least recently used one nobody is reading
+  pthread_mutex_lock(&table_lock);
+  struct commit_index *index = NULL;
+  struct commit_index *victim = NULL;
+  for (int i = 0; i < COMMIT_INDEX_SIZE; i++) {
+    struct commit_index *e = &indexes[i];
+    if (e->repo_path != NULL && strcmp(e->repo_path, repo_path) == 0 && strcmp(e->branch, branch) == 0) {
+      index = e;
+      break;
+    }
+    if (e->refs == 0 && (victim == NULL || (victim->repo_path != NULL &&
+        (e->repo_path == NULL || e->last_used < victim->last_used))))
+      victim = e;
+  }
+  if (index == NULL) {
+    if (victim == NULL) {
+      pthread_mutex_unlock(&table_lock);
+      return NULL;
+    }
+    index = victim;
+    pthread_mutex_lock(&index->lock);
+    index_clear(index);
+    index->repo_path = strdup(repo_path);
+    index->branch = strdup(branch);
+    pthread_mutex_unlock(&index->lock);
+  }
+  index->refs++;
+  index->last_used = ++use_counter;
+  pthread_mutex_unlock(&table_lock);
+
+  pthread_mutex_lock(&index->lock);
+
+  bool fresh = index->count == 0;
+  if (! fresh && ! git_oid_equal(&index->tip, tip)) {
+    if (git_graph_descendant_of(repo, tip, &index->tip) == 1) {
+      if (index_extend(index, repo, tip, &index->tip))
+        index->tip = *tip;
+      else
+        fresh = true;
+    }
+    else if (git_graph_descendant_of(repo, &index->tip, tip) == 1) {
+      // a caller that resolved the branch before a push we already
+      // indexed, the newer history serves it as well
+    }
+    else {
+      // history was rewritten, start over
+      fresh = true;
+    }
+  }
+
+  if (fresh) {
+    paths_clear(index);
+    index->generation++;
+    free(index->oids);
+    free(index->slots);
+    index->oids = NULL;
+    index->slots = NULL;
+    index->count = index->cap = index->slots_cap = 0;
+    index->tip = *tip;
+    if (! index_extend(index, repo, tip, NULL)) {
+      index->count = 0;
+      commit_index_put(index);
+      return NULL;
+    }
+  }
+
+  return index;
+}
+
+void commit_index_put(struct commit_index *index) {
+  pthread_mutex_unlock(&index->lock);
+  pthread_mutex_lock(&table_lock);
+  index->refs--;
+  pthread_mutex_unlock(&table_lock);
+}
+
+size_t commit_index_count(const struct commit_index *index) {
+  return index->count;
+}
+const git_oid * commit_index_at(const struct commit_index *index, size_t position) {
+  if (position >= index->count)
+    return NULL;
+  return &index->oids[index->count - 1 - position];
+}
+long commit_index_position(const struct commit_index *index, const git_oid *oid) {
+  if (index->slots_cap == 0)
+    return -1;
+  size_t mask = index->slots_cap - 1;
+  for (size_t s = oid_hash(oid) & mask; index->slots[s] != 0; s = (s + 1) & mask) {
+    size_t i = index->slots[s] - 1;
+    if (git_oid_equal(&index->oids[i], oid))
+      return index->count - 1 - i;
+  }
+  return -1;
+}
+
+static void paths_file(struct commit_index *index, char *buf, size_t len) {
+  snprintf(buf, len, "%s/%016zx%016zx.paths", paths_dir,
+    path_hash(index->repo_path, strlen(index->repo_path)), path_hash(index->branch, strlen(index->branch)));
+}
+
+// Writes the paths of the commits indexed so far
+static void paths_save(struct commit_index *index) {
+  if (paths_dir == NULL)
+    return;
+  char path[4096], tmp[4096 + 8];
+  paths_file(index, path, sizeof(path));
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *f = fopen(tmp, "wb");
+  if (f == NULL)
+    return;
+
+  struct paths_header h = { .magic = "CIP1", .commits = index->paths_done, .paths = index->paths_count,
+    .key_len = strlen(index->repo_path) + 1 + strlen(index->branch) };
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+  ok = ok && fprintf(f, "%s\n%s", index->repo_path, index->branch) == h.key_len;
+  ok = ok && fwrite(index->oids, sizeof(git_oid), index->paths_done, f) == index->paths_done;
+  for (size_t i = 0; ok && i < index->paths_cap; i++) {
+    struct path_touches *p = index->paths[i];
+    if (p == NULL)
+      continue;
+    uint32_t lens[2] = { strlen(p->path), p->len };
+    ok = fwrite(lens, sizeof(lens), 1, f) == 1 && fwrite(p->path, 1, lens[0], f) == lens[0] &&
+      fwrite(p->touches, sizeof(*p->touches), p->len, f) == p->len;
+  }
+  ok = fclose(f) == 0 && ok;
+  if (! ok || rename(tmp, path) != 0)
+    remove(tmp);
+}
+
+// Reads back the paths a previous run (or this index before it was evicted
+// or rebuilt) recorded. Commits are stored by oid, so ones that are no
+// longer on the branch are dropped and the others land at their current
+// position. Sets loaded[i] for every commit i that needs no diffing.
+static void paths_load(struct commit_index *index, uint8_t *loaded) {
+  if (paths_dir == NULL)
+    return;
+  char path[4096];
+  paths_file(index, path, sizeof(path));
+  FILE *f = fopen(path, "rb");
+  if (f == NULL)
+    return;
+
+  struct paths_header h;
+  char *key = NULL, *name = NULL;
+  long *positions = NULL;
+  uint32_t *touches = NULL;
+  bool ok = fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, "CIP1", 4) == 0 &&
+    h.key_len == strlen(index->repo_path) + 1 + strlen(index->branch);
+  if (ok) {
+    key = malloc(h.key_len + 1);
+    ok = fread(key, 1, h.key_len, f) == h.key_len;
+    key[h.key_len] = '\0';
+    // the file name is only a hash
+    ok = ok && strncmp(key, index->repo_path, strlen(index->repo_path)) == 0 &&
+      strcmp(key + strlen(index->repo_path) + 1, index->branch) == 0;
+  }
+  if (ok) {
+    positions = malloc((h.commits > 0 ? h.commits : 1) * sizeof(*positions));
+    for (uint32_t k = 0; ok && k < h.commits; k++) {
+      git_oid oid;
+      ok = fread(&oid, sizeof(oid), 1, f) == 1;
+      long position = commit_index_position(index, &oid);
+      positions[k] = position >= 0 ? (long) index->count - 1 - position : -1;
+      if (positions[k] >= 0)
+        loaded[positions[k]] = 1;
+    }
+  }
+  for (uint32_t i = 0; ok && i < h.paths; i++) {
+    uint32_t lens[2];
+    ok = fread(lens, sizeof(lens), 1, f) == 1 && lens[0] < 4096 && lens[1] <= h.commits;
+    if (! ok)
+      break;
+    name = realloc(name, lens[0] + 1);
+    touches = realloc(touches, (lens[1] > 0 ? lens[1] : 1) * sizeof(*touches));
+    ok = fread(name, 1, lens[0], f) == lens[0] && fread(touches, sizeof(*touches), lens[1], f) == lens[1];
+    for (uint32_t j = 0; ok && j < lens[1]; j++)
+      if (touches[j] < h.commits && positions[touches[j]] >= 0)
+        ok = path_touch(index, name, lens[0], positions[touches[j]]);
+  }
+  // a damaged file counts as no file, the commits are diffed again
+  if (! ok)
+    memset(loaded, 0, index->count);
+  index->paths_unsorted = true;
+  free(key);
+  free(name);
+  free(positions);
+  free(touches);
+  fclose(f);
+}
+
+// Diffs commit oid (at i) against its first parent and records every
+// changed path and the directories above it in paths, which is only used
+// for its path fields. Only trees are compared, no blobs loaded.
+static bool index_paths(struct commit_index *paths, git_repository *repo, const git_oid *oid, uint32_t i) {
+  uint64_t start = metrics_now();
+  git_commit *commit;
+  if (git_commit_lookup(&commit, repo, oid) != 0)
+    return false;
+  git_tree *tree = NULL, *parentTree = NULL;
+  git_commit *parent = NULL;
+  git_diff *diff = NULL;
+  bool ok = git_commit_tree(&tree, commit) == 0;
+  if (ok && git_commit_parentcount(commit) > 0)
+    ok = git_commit_parent(&parent, commit, 0) == 0 && git_commit_tree(&parentTree, parent) == 0;
+  if (ok)
+    ok = git_diff_tree_to_tree(&diff, repo, parentTree, tree, NULL) == 0;
+
+  for (size_t d = 0; ok && d < git_diff_num_deltas(diff); d++) {
+    const char *path = git_diff_get_delta(diff, d)->new_file.path;
+    size_t len = strlen(path);
+    ok = path_touch(paths, "", 0, i) && path_touch(paths, path, len, i);
+    for (size_t j = 0; ok && j < len; j++)
+      if (path[j] == '/')
+        ok = path_touch(paths, path, j, i);
+  }
+
+  git_diff_free(diff);
+  git_tree_free(parentTree);
+  git_commit_free(parent);
+  git_tree_free(tree);
+  git_commit_free(commit);
+  metrics_git(METRICS_GIT_DIFF, start);
+  return ok;
+}
+
+bool commit_index_update_paths(git_repository *repo, const char *repo_path,
+  const char *branch, const git_oid *tip, size_t max_commits)
+{
+  struct commit_index *index = commit_index_get(repo, repo_path, branch, tip);
+  if (index == NULL)
+    return false;
+  // one build at a time, the others wait for it without the lock
+  if (index->paths_building) {
+    __atomic_add_fetch(&index->paths_waiting, 1, __ATOMIC_RELAXED);
+    while (index->paths_building)
+      pthread_cond_wait(&index->paths_cond, &index->lock);
+    __atomic_sub_fetch(&index->paths_waiting, 1, __ATOMIC_RELAXED);
+  }
+  if (index->paths_done == index->count) {
+    commit_index_put(index);
+    return true;
+  }
+
+  if (! index->paths_loaded) {
+    index->paths_loaded = true;
+    uint8_t *loaded = calloc(index->count, 1);
+    paths_load(index, loaded);
+    // commits read back from disk need no diffing
+    while (index->paths_done < index->count && loaded[index->paths_done])
+      index->paths_done++;
+    if (index->paths_unsorted)
+      paths_sort(index);
+    free(loaded);
+  }
+
+  // the commits to diff, copied so the list may grow meanwhile
+  size_t from = index->paths_done;
+  size_t n = index->count - from;
+  if (max_commits > 0 && n > max_commits)
+    n = max_commits;
+  git_oid *oids = malloc((n > 0 ? n : 1) * sizeof(*oids));
+  memcpy(oids, index->oids + from, n * sizeof(*oids));
+  unsigned long generation = index->generation;
+  index->paths_building = true;
+  pthread_mutex_unlock(&index->lock);
+
+  // paths of the new commits only, merged in below
+  struct commit_index found;
+  memset(&found, 0, sizeof(found));
+  bool ok = true;
+  for (size_t k = 0; ok && k < n; k++) {
+    ok = index_paths(&found, repo, &oids[k], from + k);
+    // a capped build is the background one, possibly at idle priority: it
+    // keeps what it has and lets a waiting page take over
+    if (ok && max_commits > 0 && __atomic_load_n(&index->paths_waiting, __ATOMIC_RELAXED) > 0)
+      n = k + 1;
+  }
+  free(oids);
+
+  pthread_mutex_lock(&index->lock);
+  index->paths_building = false;
+  pthread_cond_broadcast(&index->paths_cond);
+  // a rebuild moved the commits, whoever asks next starts over
+  if (ok && index->generation == generation) {
+    for (size_t i = 0; ok && i < found.paths_cap; i++) {
+      struct path_touches *p = found.paths[i];
+      for (size_t t = 0; p != NULL && ok && t < p->len; t++)
+        ok = path_touch(index, p->path, strlen(p->path), p->touches[t]);
+    }
+    if (ok)
+      index->paths_done = from + n;
+    if (index->paths_unsorted)
+      paths_sort(index);
+    if (ok && index->paths_done == index->count)
+      paths_save(index);
+  }
+  paths_clear(&found);
+  bool done = ok && index->paths_done == index->count;
+  commit_index_put(index);
+  return done;
+}
+
+size_t commit_index_last_change(const struct commit_index *index, const char *path, size_t position,
+  git_oid *out, size_t max)
+{
+  if (position >= index->count || index->paths_cap == 0)
+    return 0;
+  // touches are complete for the commits below paths_done only
+  uint32_t limit = index->count - 1 - position;
+  if (limit >= index->paths_done)
+    return 0;
+  struct path_touches *p = *path_slot((struct commit_index *) index, path, strlen(path));
+  if (p == NULL)
+    return 0;
+
+  // newest touches at or before the commit
+  size_t lo = 0, hi = p->len;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (p->touches[mid] <= limit)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  size_t n = 0;
+  while (lo > 0 && n < max)
+    out[n++] = index->oids[p->touches[--lo]];
+  return n;
+}
+
+void commit_index_free(void) {
+  pthread_mutex_lock(&table_lock);
+  for (int i = 0; i < COMMIT_INDEX_SIZE; i++)
+    index_clear(&indexes[i]);
+  pthread_mutex_unlock(&table_lock);
+}
@@ -0,0 +1,57 @@
+#ifndef COMMIT_INDEX_H
+#define COMMIT_INDEX_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <git2.h>
+
+#define COMMIT_INDEX_SIZE (32)
+
+// Keeps the paths indexed by commit_index_last_change in dir, one file
+// per (repo, branch), so they survive restarts, eviction and rebuilds. NULL
+// keeps them in memory only.
+void commit_index_init(const char *dir);
+
+// Topologically ordered list of all commits reachable from a branch tip,
+// plus an oid -> position map. Positions count from the tip (0 = tip).
+struct commit_index;
+
+// Returns the index for (repo_path, branch) brought up to date with tip.
+// If the branch was fast-forwarded only the new commits are walked,
+// otherwise (first use, force push) the index is rebuilt. A tip the index
+// is already past is served from the newer index, whose positions count
+// from its own tip, so callers racing a push don't rebuild it back and
+// forth. NULL on error.
+// The index is locked for the caller until commit_index_put.
+struct commit_index * commit_index_get(git_repository *repo, const char *repo_path,
+  const char *branch, const git_oid *tip);
+void commit_index_put(struct commit_index *index);
+
+size_t commit_index_count(const struct commit_index *index);
+const git_oid * commit_index_at(const struct commit_index *index, size_t position);
+// -1 if oid is not reachable from the tip
+long commit_index_position(const struct commit_index *index, const git_oid *oid);
+
+// Indexes the paths each commit of (repo_path, branch) at tip changed, by
+// diffing it against its first parent, for commit_index_last_change. Only
+// commits not indexed yet are diffed, those an earlier run recorded are
+// read back from disk instead. The diffing runs without the index lock,
+// so log pages etc. don't wait for it; a second caller waits for the
+// first. At most max_commits are diffed per call (0 = no limit); such a
+// capped call also stops after the current commit when somebody starts
+// waiting for it. True once all are indexed.
+bool commit_index_update_paths(git_repository *repo, const char *repo_path,
+  const char *branch, const git_oid *tip, size_t max_commits);
+
+// Up to max commits at or before position that changed path ("" is the
+// root, no leading or trailing slash), newest first, by binary search.
+// 0 if none or the paths aren't indexed that far. The list is in walk
+// order, so for a commit other than the tip with merges in its history a
+// candidate may be on a side branch that isn't its ancestor; callers
+// check with git_graph_descendant_of.
+size_t commit_index_last_change(const struct commit_index *index, const char *path, size_t position,
+  git_oid *out, size_t max);
+
+void commit_index_free(void);
+
+#endif
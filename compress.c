@@ -0,0 +1,189 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <zlib.h>
+#ifdef ENABLE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include "compress.h"
+
+
+#define MIN(a,b) (a<b?a:b)
+
+struct compressor {
+  enum encoding encoding;
+  z_stream zs;
+#ifdef ENABLE_BROTLI
+  BrotliEncoderState *br;
+#endif
+};
+
+static int level = 6;
+
+
+void compress_init(int l) {
+  level = l;
+}
+int compress_level(void) {
+  return level;
+}
+
+const char * compress_encoding_name(enum encoding encoding) {
+  switch (encoding) {
+    case ENCODING_GZIP: return "gzip";
+    case ENCODING_BROTLI: return "br";
+    default: return "identity";
+  }
+}
+
+static bool compressible(const char *mime) {
+  static const char *skip[] = {
+    "video/", "audio/", "image/png", "image/jpeg", "image/gif", "image/webp",
+    "application/pdf", "application/zip", "application/gzip", "application/x-",
+    "application/octet-stream",
+  };
+  for (int i = 0; i < sizeof(skip) / sizeof(skip[0]); i++)
+    if (strncmp(mime, skip[i], strlen(skip[i])) == 0)
+      return false;
+  return true;
+}
+
+// q value of coding in an Accept-Encoding header, -1 if not listed
+static double accept_q(struct mg_str *header, const char *coding) {
+  size_t coding_len = strlen(coding);
+  const char *p = header->ptr, *end = header->ptr + header->len;
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == ','))
+      p++;
+    const char *item = p;
+    while (p < end && *p != ',')
+      p++;
+    const char *name_end = item;
+    while (name_end < p && *name_end != ';' && *name_end != ' ')
+      name_end++;
+    if (name_end - item != coding_len || mg_ncasecmp(item, coding, coding_len) != 0)
+      continue;
+    const char *q = item;
+    while (q < p && strncmp(q, "q=", 2) != 0)
+      q++;
+    return q < p ? strtod(q + 2, NULL) : 1.0;
+  }
+  return -1;
+}
+
+enum encoding compress_negotiate(struct mg_http_message *hm, const char *mime) {
+  struct mg_str *header = mg_http_get_header(hm, "Accept-Encoding");
+  if (header == NULL || level == 0 || ! compressible(mime))
+    return ENCODING_IDENTITY;
+#ifdef ENABLE_BROTLI
+  if (accept_q(header, "br") > 0)
+    return ENCODING_BROTLI;
+#endif
+  if (accept_q(header, "gzip") > 0)
+    return ENCODING_GZIP;
+  return ENCODING_IDENTITY;
+}
+
+struct compressor * compressor_new(enum encoding encoding, int l) {
+  struct compressor *z = calloc(1, sizeof(*z));
+  z->encoding = encoding;
+  if (encoding == ENCODING_GZIP) {
+    // 15 + 16 asks zlib for a gzip header
+    if (deflateInit2(&z->zs, l, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      free(z);
+      return NULL;
+    }
+  }
+#ifdef ENABLE_BROTLI
+  else if (encoding == ENCODING_BROTLI) {
+    z->br = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+    // brotli goes to 11, but anything above ~5 is too slow to do on the fly
+    BrotliEncoderSetParameter(z->br, BROTLI_PARAM_QUALITY, l);
+    BrotliEncoderSetParameter(z->br, BROTLI_PARAM_LGWIN, 20);
+  }
+#endif
+  else {
+    free(z);
+    return NULL;
+  }
+  return z;
+}
+
+void compressor_write(struct compressor *z, const void *data, size_t len, enum compress_flush flush,
+  compress_emit_fn emit, void *arg)
+{
+  unsigned char buf[16*1024];
+
+  if (z->encoding == ENCODING_GZIP) {
+    int mode = flush == COMPRESS_FINISH ? Z_FINISH : flush == COMPRESS_SYNC_FLUSH ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+    z->zs.next_in = (unsigned char *) data;
+    z->zs.avail_in = len;
+    do {
+      z->zs.next_out = buf;
+      z->zs.avail_out = sizeof(buf);
+      int res = deflate(&z->zs, mode);
+      size_t n = sizeof(buf) - z->zs.avail_out;
+      if (n > 0)
+        emit(arg, buf, n);
+      if (res == Z_STREAM_END || res == Z_STREAM_ERROR)
+        break;
+    } while (z->zs.avail_in > 0 || z->zs.avail_out == 0 || (mode == Z_FINISH));
+  }
+#ifdef ENABLE_BROTLI
+  else if (z->encoding == ENCODING_BROTLI) {
+    BrotliEncoderOperation op = flush == COMPRESS_FINISH ? BROTLI_OPERATION_FINISH
+      : flush == COMPRESS_SYNC_FLUSH ? BROTLI_OPERATION_FLUSH : BROTLI_OPERATION_PROCESS;
+    size_t avail_in = len;
+    const uint8_t *next_in = data;
+    do {
+      size_t avail_out = sizeof(buf);
+      uint8_t *next_out = buf;
+      if (! BrotliEncoderCompressStream(z->br, op, &avail_in, &next_in, &avail_out, &next_out, NULL))
+        break;
+      size_t n = sizeof(buf) - avail_out;
+      if (n > 0)
+        emit(arg, buf, n);
+    } while (avail_in > 0 || BrotliEncoderHasMoreOutput(z->br) ||
+             (op == BROTLI_OPERATION_FINISH && ! BrotliEncoderIsFinished(z->br)));
+  }
+#endif
+}
+
+void compressor_free(struct compressor *z) {
+  if (z == NULL)
+    return;
+  if (z->encoding == ENCODING_GZIP)
+    deflateEnd(&z->zs);
+#ifdef ENABLE_BROTLI
+  if (z->encoding == ENCODING_BROTLI)
+    BrotliEncoderDestroyInstance(z->br);
+#endif
+  free(z);
+}
+
+struct buffer {
+  char *data;
+  size_t len, cap;
+};
+static void buffer_emit(void *arg, const void *data, size_t len) {
+  struct buffer *b = arg;
+  if (b->len + len > b->cap) {
+    while (b->len + len > b->cap)
+      b->cap = b->cap ? b->cap * 2 : 4096;
+    b->data = realloc(b->data, b->cap);
+  }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+char * compress_buffer(enum encoding encoding, int l, const void *data, size_t len, size_t *out_len) {
+  struct compressor *z = compressor_new(encoding, l);
+  if (z == NULL)
+    return NULL;
+  struct buffer b = { NULL, 0, 0 };
+  compressor_write(z, data, len, COMPRESS_FINISH, buffer_emit, &b);
+  compressor_free(z);
+  *out_len = b.len;
+  return b.data;
+}
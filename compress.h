@@ -0,0 +1,41 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <mongoose.h>
+
+// Brotli is used when built with ENABLE_BROTLI (see Makefile), gzip always.
+enum encoding {
+  ENCODING_IDENTITY,
+  ENCODING_GZIP,
+  ENCODING_BROTLI,
+};
+
+// Level (0-9) for responses compressed on the fly, 0 disables compression.
+// Static files are always compressed once at the best level.
+void compress_init(int level);
+int compress_level(void);
+
+// Best encoding the client accepts for a response of the given MIME type.
+// Video, audio, images, PDFs and archives are never compressed.
+enum encoding compress_negotiate(struct mg_http_message *hm, const char *mime);
+const char * compress_encoding_name(enum encoding encoding);
+
+// Streaming compressor. emit is called with compressed output.
+typedef void (*compress_emit_fn)(void *arg, const void *data, size_t len);
+enum compress_flush {
+  COMPRESS_NO_FLUSH,
+  COMPRESS_SYNC_FLUSH, // everything written so far can be decoded
+  COMPRESS_FINISH,
+};
+struct compressor;
+struct compressor * compressor_new(enum encoding encoding, int level);
+void compressor_write(struct compressor *z, const void *data, size_t len, enum compress_flush flush,
+  compress_emit_fn emit, void *arg);
+void compressor_free(struct compressor *z);
+
+// Whole buffer at once, malloc'ed result.
+char * compress_buffer(enum encoding encoding, int level, const void *data, size_t len, size_t *out_len);
+
+#endif
@@ -0,0 +1,208 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "diff_cache.h"
+#include "metrics.h"
+
+
+struct diff_entry {
+  git_oid old_tree, new_tree;
+  bool renames;
+  uint64_t last_used;
+  struct summary_data *data;
+};
+
+// refcounted so a summary can be rendered while it is evicted
+struct summary_data {
+  int refs;
+  struct diff_summary summary;
+};
+
+// guards the entries and refcounts, diffs are computed outside of it
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct diff_entry entries[DIFF_CACHE_SIZE];
+static uint64_t tick = 0;
+
+
+static void data_release(struct summary_data *d) {
+  if (--d->refs > 0)
+    return;
+  for (size_t i = 0; i < d->summary.files_len; i++) {
+    free(d->summary.files[i].old_path);
+    free(d->summary.files[i].new_path);
+  }
+  free(d->summary.files);
+  free(d);
+}
+
+static bool entry_matches(struct diff_entry *e, const git_oid *old_tree, const git_oid *new_tree, bool renames) {
+  return e->data != NULL && e->renames == renames &&
+    git_oid_equal(&e->old_tree, old_tree) && git_oid_equal(&e->new_tree, new_tree);
+}
+
+static int diff_trees(git_diff **diff, git_repository *repo, git_tree *old_tree, git_tree *new_tree,
+  bool renames, const git_diff_options *opts)
+{
+  if (git_diff_tree_to_tree(diff, repo, old_tree, new_tree, opts) != 0)
+    return -1;
+  if (renames && git_diff_find_similar(*diff, NULL) != 0) {
+    git_diff_free(*diff);
+    return -1;
+  }
+  return 0;
+}
+
+// 0 for a missing side
+static size_t blob_size(git_odb *odb, const git_oid *oid) {
+  size_t size;
+  git_object_t type;
+  if (git_oid_is_zero(oid) || git_odb_read_header(&size, &type, odb, oid) != 0)
+    return 0;
+  return size;
+}
+
+static struct summary_data * compute(git_repository *repo, git_tree *old_tree, git_tree *new_tree, bool renames) {
+  git_diff *diff;
+  if (diff_trees(&diff, repo, old_tree, new_tree, renames, NULL) != 0)
+    return NULL;
+
+  git_odb *odb = NULL;
+  git_repository_odb(&odb, repo);
+  size_t diffed = 0;
+
+  struct summary_data *d = calloc(1, sizeof(*d));
+  d->refs = 1;
+  size_t count = git_diff_num_deltas(diff);
+  d->summary.files = calloc(count > 0 ? count : 1, sizeof(struct diff_file));
+
+  for (size_t i = 0; i < count; i++) {
+    const git_diff_delta *delta = git_diff_get_delta(diff, i);
+    struct diff_file *f = &d->summary.files[d->summary.files_len++];
+    f->old_path = strdup(delta->old_file.path);
+    f->new_path = strdup(delta->new_file.path);
+    f->status = delta->status;
+
+    // line counts need the blobs diffed, but only once per tree pair and
+    // not for huge blobs, their patch is only made when it is shown
+    size_t size = odb != NULL ? blob_size(odb, &delta->old_file.id) + blob_size(odb, &delta->new_file.id) : 0;
+    if (odb == NULL || size > DIFF_STATS_MAX_BYTES || diffed + size > DIFF_STATS_TOTAL_BYTES) {
+      f->large = true;
+      continue;
+    }
+    diffed += size;
+    git_patch *patch;
+    if (git_patch_from_diff(&patch, diff, i) == 0 && patch != NULL) {
+      git_patch_line_stats(NULL, &f->additions, &f->deletions, patch);
+      git_patch_free(patch);
+    }
+    f->binary = (git_diff_get_delta(diff, i)->flags & GIT_DIFF_FLAG_BINARY) != 0;
+    d->summary.additions += f->additions;
+    d->summary.deletions += f->deletions;
+  }
+
+  git_odb_free(odb);
+  git_diff_free(diff);
+  return d;
+}
+
+const struct diff_summary * diff_cache_get(git_repository *repo, git_tree *old_tree, git_tree *new_tree,
+  bool renames)
+{
+  git_oid oldOid, newOid;
+  memset(&oldOid, 0, sizeof(oldOid));
+  if (old_tree != NULL)
+    git_oid_cpy(&oldOid, git_tree_id(old_tree));
+  git_oid_cpy(&newOid, git_tree_id(new_tree));
+
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < DIFF_CACHE_SIZE; i++) {
+    if (entry_matches(&entries[i], &oldOid, &newOid, renames)) {
+      entries[i].last_used = ++tick;
+      entries[i].data->refs++;
+      pthread_mutex_unlock(&lock);
+      metrics_cache(METRICS_CACHE_DIFF, true);
+      return &entries[i].data->summary;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  metrics_cache(METRICS_CACHE_DIFF, false);
+
+  // two threads may compute the same diff, the second one just wins
+  uint64_t start = metrics_now();
+  struct summary_data *d = compute(repo, old_tree, new_tree, renames);
+  metrics_git(METRICS_GIT_DIFF, start);
+  if (d == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&lock);
+  struct diff_entry *victim = &entries[0];
+  for (int i = 0; i < DIFF_CACHE_SIZE; i++) {
+    if (entries[i].data == NULL || entry_matches(&entries[i], &oldOid, &newOid, renames)) {
+      victim = &entries[i];
+      break;
+    }
+    if (entries[i].last_used < victim->last_used)
+      victim = &entries[i];
+  }
+  if (victim->data != NULL)
+    data_release(victim->data);
+  victim->old_tree = oldOid;
+  victim->new_tree = newOid;
+  victim->renames = renames;
+  victim->last_used = ++tick;
+  victim->data = d;
+  d->refs++;
+  pthread_mutex_unlock(&lock);
+
+  return &d->summary;
+}
+
+void diff_cache_release(const struct diff_summary *summary) {
+  struct summary_data *d = (struct summary_data *) ((char *) summary - offsetof(struct summary_data, summary));
+  pthread_mutex_lock(&lock);
+  data_release(d);
+  pthread_mutex_unlock(&lock);
+}
+
+int diff_cache_patch(git_patch **out, git_repository *repo, git_tree *old_tree, git_tree *new_tree,
+  bool renames, const struct diff_file *file)
+{
+  // restricting the diff to the file's paths skips every other blob
+  char *paths[] = { file->old_path, file->new_path };
+  git_diff_options opts = GIT_DIFF_OPTIONS_INIT;
+  opts.pathspec.strings = paths;
+  opts.pathspec.count = strcmp(file->old_path, file->new_path) != 0 ? 2 : 1;
+  opts.flags |= GIT_DIFF_DISABLE_PATHSPEC_MATCH;
+
+  uint64_t start = metrics_now();
+  git_diff *diff;
+  if (diff_trees(&diff, repo, old_tree, new_tree, renames, &opts) != 0)
+    return -1;
+
+  int res = -1;
+  *out = NULL;
+  for (size_t i = 0; i < git_diff_num_deltas(diff); i++) {
+    const git_diff_delta *delta = git_diff_get_delta(diff, i);
+    if (strcmp(delta->new_file.path, file->new_path) == 0 && strcmp(delta->old_file.path, file->old_path) == 0) {
+      res = git_patch_from_diff(out, diff, i);
+      break;
+    }
+  }
+  git_diff_free(diff);
+  metrics_git(METRICS_GIT_DIFF, start);
+  return res;
+}
+
+void diff_cache_free(void) {
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < DIFF_CACHE_SIZE; i++) {
+    if (entries[i].data != NULL)
+      data_release(entries[i].data);
+    entries[i].data = NULL;
+  }
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,49 @@
+#ifndef DIFF_CACHE_H
+#define DIFF_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <git2.h>
+
+#define DIFF_CACHE_SIZE (64)
+// a single file's hunks stop after this many lines or bytes, the rest is
+// behind a "load more" link
+#define DIFF_FILE_MAX_LINES (1000)
+#define DIFF_FILE_MAX_BYTES (256*1024)
+// the summary only counts lines of blobs up to this size, and stops
+// counting once it diffed this much in total
+#define DIFF_STATS_MAX_BYTES (1024*1024)
+#define DIFF_STATS_TOTAL_BYTES (32*1024*1024)
+
+struct diff_file {
+  char *old_path, *new_path;
+  git_delta_t status;
+  size_t additions, deletions;
+  bool binary;
+  // too big to count lines in the summary, additions/deletions are 0
+  bool large;
+};
+
+// Per-file stats of the diff between two trees, without any hunks.
+struct diff_summary {
+  struct diff_file *files;
+  size_t files_len;
+  size_t additions, deletions;
+};
+
+// Summary of the diff from old_tree (NULL for a root commit) to new_tree,
+// computed once per (old tree, new tree, renames) and shared between
+// threads. Since the trees are the subtrees of the viewed path, their oids
+// already identify the path. Returns NULL on error, otherwise the summary
+// must be handed back with diff_cache_release.
+const struct diff_summary * diff_cache_get(git_repository *repo, git_tree *old_tree, git_tree *new_tree,
+  bool renames);
+void diff_cache_release(const struct diff_summary *summary);
+
+// Patch of a single file of a summary, only this file is diffed.
+int diff_cache_patch(git_patch **out, git_repository *repo, git_tree *old_tree, git_tree *new_tree,
+  bool renames, const struct diff_file *file);
+
+void diff_cache_free(void);
+
+#endif
@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "dir_cache.h"
+#include "out.h"
+#include "compress.h"
+#include "metrics.h"
+
+
+#define MIN(a,b) (a<b?a:b)
+
+enum sort_key {
+  SORT_NAME,
+  SORT_SIZE,
+  SORT_MTIME,
+  SORT_KEYS
+};
+static const char * sort_names[SORT_KEYS] = { "name", "size", "mtime" };
+
+struct entry {
+  const char *name;
+  ino_t ino;
+  bool is_dir;
+  off_t size;
+  time_t mtime;
+};
+
+struct dir {
+  char *path;
+  int wd;
+  // set by inotify, the entries are reread on the next request
+  bool stale;
+  unsigned long last_used;
+  // changes with every scan, part of the ETag
+  unsigned long generation;
+  struct entry *entries;
+  size_t len;
+  char *names;
+  // entry indexes per sort key and direction, built on first use
+  uint32_t *order[SORT_KEYS][2];
+};
+
+static struct dir dirs[DIR_CACHE_SIZE];
+static int inotify_fd = -1;
+static unsigned long use_counter = 0;
+static unsigned long generation = 0;
+
+
+static void dir_clear(struct dir *d) {
+  free(d->entries);
+  free(d->names);
+  for (int k = 0; k < SORT_KEYS; k++)
+    for (int desc = 0; desc < 2; desc++)
+      free(d->order[k][desc]);
+  d->entries = NULL;
+  d->names = NULL;
+  d->len = 0;
+  memset(d->order, 0, sizeof(d->order));
+}
+
+static void dir_free(struct dir *d) {
+  dir_clear(d);
+  // another entry may be the same directory under a different path
+  bool shared = false;
+  for (int i = 0; i < DIR_CACHE_SIZE; i++)
+    if (&dirs[i] != d && dirs[i].path != NULL && dirs[i].wd == d->wd)
+      shared = true;
+  if (d->wd >= 0 && ! shared)
+    inotify_rm_watch(inotify_fd, d->wd);
+  free(d->path);
+  memset(d, 0, sizeof(*d));
+  d->wd = -1;
+}
+
+static int compare_ino(const void *a, const void *b) {
+  const struct entry *x = a, *y = b;
+  return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+// Reads the directory and stats every entry, in inode order so a spinning
+// disk reads the inode table front to back instead of seeking around.
+static bool scan(struct dir *d) {
+  dir_clear(d);
+  // watched before reading, a change while we read marks it stale again
+  if (d->wd < 0)
+    d->wd = inotify_add_watch(inotify_fd, d->path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+      IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+  DIR *dp = opendir(d->path);
+  if (dp == NULL)
+    return false;
+
+  size_t cap = 0, namesLen = 0, namesCap = 0;
+  struct dirent *de;
+  while ((de = readdir(dp)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+      continue;
+    size_t len = strlen(de->d_name) + 1;
+    if (namesLen + len > namesCap) {
+      while (namesLen + len > namesCap)
+        namesCap = namesCap ? namesCap * 2 : 4096;
+      d->names = realloc(d->names, namesCap);
+    }
+    if (d->len == cap) {
+      cap = cap ? cap * 2 : 256;
+      d->entries = realloc(d->entries, cap * sizeof(*d->entries));
+    }
+    memcpy(d->names + namesLen, de->d_name, len);
+    // an offset until names stopped moving
+    d->entries[d->len] = (struct entry) {
+      .name = (const char *) (uintptr_t) namesLen,
+      .ino = de->d_ino,
+      .is_dir = de->d_type == DT_DIR,
+    };
+    d->len++;
+    namesLen += len;
+  }
+
+  qsort(d->entries, d->len, sizeof(*d->entries), compare_ino);
+  for (size_t i = 0; i < d->len; i++) {
+    struct entry *e = &d->entries[i];
+    e->name = d->names + (uintptr_t) e->name;
+    struct stat st;
+    if (fstatat(dirfd(dp), e->name, &st, 0) == 0) {
+      e->is_dir = S_ISDIR(st.st_mode);
+      e->size = st.st_size;
+      e->mtime = st.st_mtime;
+    }
+  }
+  closedir(dp);
+
+  d->stale = false;
+  d->generation = ++generation;
+  return true;
+}
+
+struct sort_arg {
+  const struct entry *entries;
+  enum sort_key key;
+  bool desc;
+};
+// directories first, then by key, then by name with numbers in order
+static int compare_entries(const void *a, const void *b, void *arg) {
+  const struct sort_arg *s = arg;
+  const struct entry *x = &s->entries[*(const uint32_t *) a], *y = &s->entries[*(const uint32_t *) b];
+  if (x->is_dir != y->is_dir)
+    return x->is_dir ? -1 : 1;
+  int r = 0;
+  if (s->key == SORT_SIZE)
+    r = x->size < y->size ? -1 : x->size > y->size;
+  else if (s->key == SORT_MTIME)
+    r = x->mtime < y->mtime ? -1 : x->mtime > y->mtime;
+  if (r == 0)
+    r = strverscmp(x->name, y->name);
+  return s->desc ? -r : r;
+}
+
+static const uint32_t * dir_order(struct dir *d, enum sort_key key, bool desc) {
+  if (d->order[key][desc] == NULL) {
+    uint32_t *order = malloc((d->len + 1) * sizeof(*order));
+    for (size_t i = 0; i < d->len; i++)
+      order[i] = i;
+    struct sort_arg arg = { d->entries, key, desc };
+    qsort_r(order, d->len, sizeof(*order), compare_entries, &arg);
+    d->order[key][desc] = order;
+  }
+  return d->order[key][desc];
+}
+
+static struct dir * dir_lookup(const char *path) {
+  for (int i = 0; i < DIR_CACHE_SIZE; i++)
+    if (dirs[i].path != NULL && strcmp(dirs[i].path, path) == 0)
+      return &dirs[i];
+  return NULL;
+}
+
+static struct dir * dir_new(const char *path) {
+  struct dir *victim = &dirs[0];
+  for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+    if (dirs[i].path == NULL) {
+      victim = &dirs[i];
+      break;
+    }
+    if (dirs[i].last_used < victim->last_used)
+      victim = &dirs[i];
+  }
+  if (victim->path != NULL)
+    dir_free(victim);
+  victim->path = strdup(path);
+  return victim;
+}
+
+static void poll_fn(void *arg) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+  while ((n = read(inotify_fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + n; ) {
+      struct inotify_event *ev = (struct inotify_event *) p;
+      for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (dirs[i].path == NULL)
+          continue;
+        // lost events, anything may have changed
+        if ((ev->mask & IN_Q_OVERFLOW) || dirs[i].wd == ev->wd)
+          dirs[i].stale = true;
+        // the kernel dropped the watch (directory gone), added again on rescan
+        if ((ev->mask & IN_IGNORED) && dirs[i].wd == ev->wd)
+          dirs[i].wd = -1;
+      }
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+}
+
+void dir_cache_init(struct mg_mgr *mgr) {
+  for (int i = 0; i < DIR_CACHE_SIZE; i++)
+    dirs[i].wd = -1;
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  // from the clock, so a restarted server doesn't reuse the ETags of the
+  // previous run for different listings
+  generation = (unsigned long) time(NULL) << 20;
+  mg_timer_add(mgr, DIR_CACHE_POLL_MS, MG_TIMER_REPEAT, poll_fn, NULL);
+}
+
+void dir_cache_free(void) {
+  for (int i = 0; i < DIR_CACHE_SIZE; i++)
+    if (dirs[i].path != NULL)
+      dir_free(&dirs[i]);
+  if (inotify_fd >= 0)
+    close(inotify_fd);
+  inotify_fd = -1;
+}
+
+static void format_size(char *buf, size_t size, off_t bytes) {
+  static const char *units[] = { "B", "K", "M", "G", "T" };
+  double value = bytes;
+  int unit = 0;
+  while (value >= 1024 && unit < 4) {
+    value /= 1024;
+    unit++;
+  }
+  if (unit == 0)
+    snprintf(buf, size, "%lld %s", (long long) bytes, units[unit]);
+  else
+    snprintf(buf, size, "%.1f %s", value, units[unit]);
+}
+
+bool dir_cache_serve(struct mg_connection *c, struct mg_http_message *hm, const char *path, bool cached_only) {
+  // dir and dir/ are the same entry
+  char trimmed[4096 + 256];
+  snprintf(trimmed, sizeof(trimmed), "%s", path);
+  for (size_t len = strlen(trimmed); len > 1 && trimmed[len - 1] == '/'; len--)
+    trimmed[len - 1] = '\0';
+  path = trimmed;
+
+  struct dir *d = dir_lookup(path);
+  bool hit = d != NULL && ! d->stale;
+  if (! hit) {
+    if (cached_only)
+      return false;
+    if (d == NULL)
+      d = dir_new(path);
+    if (! scan(d)) {
+      dir_free(d);
+      return false;
+    }
+  }
+  metrics_cache(METRICS_CACHE_DIR, hit);
+  d->last_used = ++use_counter;
+
+  // links are relative to the directory
+  if (hm->uri.len == 0 || hm->uri.ptr[hm->uri.len - 1] != '/') {
+    mg_printf(c, "HTTP/1.1 301 Moved Permanently\r\nLocation: %.*s/\r\nContent-Length: 0\r\n\r\n",
+      (int) hm->uri.len, hm->uri.ptr);
+    return true;
+  }
+
+  char var[16];
+  enum sort_key key = SORT_NAME;
+  if (mg_http_get_var(&hm->query, "sort", var, sizeof(var)) > 0)
+    for (int k = 0; k < SORT_KEYS; k++)
+      if (strcmp(var, sort_names[k]) == 0)
+        key = k;
+  bool desc = mg_http_var(hm->query, mg_str("desc")).len > 0;
+  size_t pages = d->len > 0 ? (d->len + DIR_PAGE_SIZE - 1) / DIR_PAGE_SIZE : 1;
+  size_t page = 1;
+  if (mg_http_get_var(&hm->query, "page", var, sizeof(var)) > 0)
+    page = atol(var);
+  if (page < 1 || page > pages)
+    page = 1;
+
+  enum encoding encoding = compress_negotiate(hm, "text/html");
+  char etag[64], headers[128];
+  snprintf(etag, sizeof(etag), "\"dir-%lx-%s%s-%zu-%s\"", d->generation, sort_names[key], desc ? "-desc" : "", page,
+    compress_encoding_name(encoding));
+  snprintf(headers, sizeof(headers), "ETag: %s\r\nCache-Control: no-cache\r\n", etag);
+  struct mg_str *inm = mg_http_get_header(hm, "If-None-Match");
+  if (inm != NULL && mg_vcmp(inm, etag) == 0) {
+    mg_printf(c, "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nVary: Accept-Encoding\r\nContent-Length: 0\r\n\r\n", etag);
+    return true;
+  }
+
+  const uint32_t *order = dir_order(d, key, desc);
+
+  // queued whole, a page of a big directory is a few 10 KB, and waiting for
+  // a slow client here would stall the event loop
+  struct out o;
+  out_init_queued(&o, c);
+  out_set_encoding(&o, encoding);
+  out_begin(&o, 200, headers);
+
+  #define HTML(...) out_printf(&o, __VA_ARGS__)
+
+  HTML(
+    "<html>\n"
+    "<head>\n"
+    "<style>"
+    "body { font-family: monospace; margin: 10px; }"
+    "</style>\n"
+    "</head>\n"
+    "<body>\n"
+    "<b>");
+  out_escape(&o, hm->uri.ptr, hm->uri.len);
+  HTML("</b> %zu entries\n<pre>", d->len);
+
+  // clicking the current order flips it
+  const char *titles[SORT_KEYS] = { "name", "size", "modified" };
+  for (int k = 0; k < SORT_KEYS; k++)
+    HTML("<a href=\"?sort=%s%s\">%s%s</a>  ", sort_names[k], k == key && ! desc ? "&desc=1" : "", titles[k],
+      k != key ? "" : desc ? " v" : " ^");
+  HTML("\n\n<a href=\"../\">../</a>\n");
+
+  for (size_t i = (page - 1) * DIR_PAGE_SIZE; i < MIN(page * DIR_PAGE_SIZE, d->len) && ! o.failed; i++) {
+    const struct entry *e = &d->entries[order[i]];
+    size_t nameLen = strlen(e->name);
+    char href[3 * 256 + 1];
+    mg_url_encode(e->name, nameLen, href, sizeof(href));
+
+    char size[32] = "-", date[32] = "";
+    if (! e->is_dir)
+      format_size(size, sizeof(size), e->size);
+    struct tm tm;
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M", gmtime_r(&e->mtime, &tm));
+
+    HTML("<a href=\"%s%s\">", href, e->is_dir ? "/" : "");
+    out_escape(&o, e->name, nameLen);
+    HTML("%s</a>%*s %10s  %s\n", e->is_dir ? "/" : "", (int) (nameLen < 60 ? 60 - nameLen - e->is_dir : 0), "",
+      size, date);
+  }
+
+  HTML("</pre>\n");
+  if (pages > 1) {
+    const char *descArg = desc ? "&desc=1" : "";
+    if (page > 1)
+      HTML("<a href=\"?sort=%s%s&page=%zu\">&lt;</a> ", sort_names[key], descArg, page - 1);
+    HTML("Page %zu/%zu", page, pages);
+    if (page < pages)
+      HTML(" <a href=\"?sort=%s%s&page=%zu\">&gt;</a>", sort_names[key], descArg, page + 1);
+    HTML("\n");
+  }
+  HTML("</body>\n</html>");
+
+  #undef HTML
+
+  out_end(&o);
+  return true;
+}
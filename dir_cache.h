@@ -0,0 +1,26 @@
+#ifndef DIR_CACHE_H
+#define DIR_CACHE_H
+
+#include <stdbool.h>
+#include <mongoose.h>
+
+// directories whose listing is kept
+#define DIR_CACHE_SIZE (64)
+#define DIR_PAGE_SIZE (200)
+// how often inotify events are picked up
+#define DIR_CACHE_POLL_MS (1000)
+
+// Directory listings for the media mounts. A directory is read once and
+// all its entries are stat'ed in inode order, the result stays cached
+// until inotify reports a change in it, so browsing again doesn't touch
+// the disk. ?sort=name|size|mtime, &desc=1 and &page=N pick the order
+// and the DIR_PAGE_SIZE entries shown. Only used from the event loop.
+void dir_cache_init(struct mg_mgr *mgr);
+void dir_cache_free(void);
+
+// Renders the listing of the directory at path. With cached_only nothing
+// is read from disk and false means path isn't a cached directory,
+// otherwise false means it isn't a directory.
+bool dir_cache_serve(struct mg_connection *c, struct mg_http_message *hm, const char *path, bool cached_only);
+
+#endif
@@ -0,0 +1,134 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "disk_cache.h"
+
+
+struct disk_cache {
+  char *dir;
+  off_t max_bytes;
+  // serializes trimming, files themselves are written under temporary names
+  pthread_mutex_t lock;
+};
+
+struct cached_file {
+  char name[NAME_MAX + 1];
+  off_t size;
+  time_t atime;
+};
+
+
+struct disk_cache * disk_cache_new(const char *dir, off_t max_bytes) {
+  struct disk_cache *d = calloc(1, sizeof(*d));
+  d->dir = strdup(dir);
+  d->max_bytes = max_bytes;
+  pthread_mutex_init(&d->lock, NULL);
+  mkdir(dir, 0755);
+  return d;
+}
+
+void disk_cache_free(struct disk_cache *d) {
+  if (d == NULL)
+    return;
+  pthread_mutex_destroy(&d->lock);
+  free(d->dir);
+  free(d);
+}
+
+bool disk_cache_lookup(struct disk_cache *d, const char *name, char *path, size_t len) {
+  snprintf(path, len, "%s/%s", d->dir, name);
+  // the atime is the last use, see trim. The mtime stays put, it is the
+  // Last-Modified and part of the ETag of the file when it is served.
+  struct timespec times[2] = { { .tv_nsec = UTIME_NOW }, { .tv_nsec = UTIME_OMIT } };
+  return utimensat(AT_FDCWD, path, times, 0) == 0;
+}
+
+bool disk_cache_create(struct disk_cache *d, const char *name, struct disk_cache_file *f) {
+  snprintf(f->path, sizeof(f->path), "%s/%s", d->dir, name);
+  // hidden, so trim doesn't count it
+  snprintf(f->tmp, sizeof(f->tmp), "%s/.%s.XXXXXX", d->dir, name);
+  f->fp = NULL;
+  int fd = mkstemp(f->tmp);
+  if (fd < 0)
+    return false;
+  f->fp = fdopen(fd, "wb");
+  if (f->fp == NULL) {
+    close(fd);
+    unlink(f->tmp);
+    return false;
+  }
+  return true;
+}
+
+static int cached_file_compare(const void *a, const void *b) {
+  const struct cached_file *x = a, *y = b;
+  return x->atime < y->atime ? -1 : x->atime > y->atime;
+}
+
+// removes the least recently used files until they fit max_bytes
+static void trim(struct disk_cache *d) {
+  pthread_mutex_lock(&d->lock);
+  DIR *dir = opendir(d->dir);
+  if (dir == NULL) {
+    pthread_mutex_unlock(&d->lock);
+    return;
+  }
+  struct cached_file *files = NULL;
+  size_t len = 0, cap = 0;
+  off_t total = 0;
+  struct dirent *e;
+  while ((e = readdir(dir)) != NULL) {
+    if (e->d_name[0] == '.')
+      continue;
+    char path[4096 + NAME_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", d->dir, e->d_name);
+    if (stat(path, &st) != 0 || ! S_ISREG(st.st_mode))
+      continue;
+    if (len == cap) {
+      cap = cap ? cap * 2 : 64;
+      files = realloc(files, cap * sizeof(*files));
+    }
+    snprintf(files[len].name, sizeof(files[len].name), "%s", e->d_name);
+    files[len].size = st.st_size;
+    files[len].atime = st.st_atime;
+    total += st.st_size;
+    len++;
+  }
+  closedir(dir);
+
+  qsort(files, len, sizeof(*files), cached_file_compare);
+  for (size_t i = 0; i < len && total > d->max_bytes; i++) {
+    char path[4096 + NAME_MAX];
+    snprintf(path, sizeof(path), "%s/%s", d->dir, files[i].name);
+    if (unlink(path) == 0)
+      total -= files[i].size;
+  }
+  free(files);
+  pthread_mutex_unlock(&d->lock);
+}
+
+void disk_cache_commit(struct disk_cache *d, struct disk_cache_file *f) {
+  bool ok = fflush(f->fp) == 0;
+  fclose(f->fp);
+  f->fp = NULL;
+  if (! ok || rename(f->tmp, f->path) != 0) {
+    unlink(f->tmp);
+    return;
+  }
+  trim(d);
+}
+
+void disk_cache_abort(struct disk_cache_file *f) {
+  if (f->fp != NULL)
+    fclose(f->fp);
+  f->fp = NULL;
+  unlink(f->tmp);
+}
@@ -0,0 +1,33 @@
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// Directory of generated files (clone packs, archives) that is trimmed to
+// max_bytes, least recently used first. Files are written under a hidden
+// temporary name and only appear under their real name once complete, so
+// readers never see half a file. Safe to use from several threads.
+struct disk_cache;
+
+struct disk_cache * disk_cache_new(const char *dir, off_t max_bytes);
+void disk_cache_free(struct disk_cache *d);
+
+// Writes dir/name into path. True if the file is there, which counts as
+// a use for eviction.
+bool disk_cache_lookup(struct disk_cache *d, const char *name, char *path, size_t len);
+
+struct disk_cache_file {
+  FILE *fp;
+  char path[4096];
+  char tmp[4096 + 16];
+};
+// Starts writing dir/name to f->fp, false if it can't be created.
+bool disk_cache_create(struct disk_cache *d, const char *name, struct disk_cache_file *f);
+// Publishes the file and trims the directory. Closes f->fp.
+void disk_cache_commit(struct disk_cache *d, struct disk_cache_file *f);
+// Drops an unfinished file, f->fp may already be closed (NULL).
+void disk_cache_abort(struct disk_cache_file *f);
+
+#endif
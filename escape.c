@@ -0,0 +1,172 @@
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define USE_NEON
+#endif
+
+#include "escape.h"
+
+
+// '<' is 0x3c and '>' is 0x3e, so (c | 2) == '>' matches exactly those two
+// and the vector loops get away with two compares instead of three
+
+#if defined(__AVX2__)
+static bool span_avx2(const char *s, size_t len, size_t *pos) {
+  size_t i = *pos;
+  const __m256i gt = _mm256_set1_epi8('>');
+  const __m256i amp = _mm256_set1_epi8('&');
+  const __m256i two = _mm256_set1_epi8(2);
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+    __m256i m = _mm256_or_si256(
+      _mm256_cmpeq_epi8(_mm256_or_si256(v, two), gt),
+      _mm256_cmpeq_epi8(v, amp));
+    unsigned mask = _mm256_movemask_epi8(m);
+    if (mask != 0) {
+      *pos = i + __builtin_ctz(mask);
+      return true;
+    }
+  }
+  *pos = i;
+  return false;
+}
+#endif
+
+#if defined(__SSE2__)
+static bool span_sse2(const char *s, size_t len, size_t *pos) {
+  size_t i = *pos;
+  const __m128i gt = _mm_set1_epi8('>');
+  const __m128i amp = _mm_set1_epi8('&');
+  const __m128i two = _mm_set1_epi8(2);
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+    __m128i m = _mm_or_si128(
+      _mm_cmpeq_epi8(_mm_or_si128(v, two), gt),
+      _mm_cmpeq_epi8(v, amp));
+    unsigned mask = _mm_movemask_epi8(m);
+    if (mask != 0) {
+      *pos = i + __builtin_ctz(mask);
+      return true;
+    }
+  }
+  *pos = i;
+  return false;
+}
+#endif
+
+#if defined(USE_NEON)
+static bool span_neon(const char *s, size_t len, size_t *pos) {
+  size_t i = *pos;
+  const uint8x16_t gt = vdupq_n_u8('>');
+  const uint8x16_t amp = vdupq_n_u8('&');
+  const uint8x16_t two = vdupq_n_u8(2);
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t v = vld1q_u8((const uint8_t *) (s + i));
+    uint8x16_t m = vorrq_u8(vceqq_u8(vorrq_u8(v, two), gt), vceqq_u8(v, amp));
+    // no movemask on NEON, look at the two 64 bit halves instead
+    uint64x2_t m64 = vreinterpretq_u64_u8(m);
+    uint64_t lo = vgetq_lane_u64(m64, 0);
+    uint64_t hi = vgetq_lane_u64(m64, 1);
+    if (lo != 0) {
+      *pos = i + __builtin_ctzll(lo) / 8;
+      return true;
+    }
+    if (hi != 0) {
+      *pos = i + 8 + __builtin_ctzll(hi) / 8;
+      return true;
+    }
+  }
+  *pos = i;
+  return false;
+}
+#endif
+
+static size_t span_scalar(const char *s, size_t len, size_t i) {
+  for (; i < len; i++)
+    if (s[i] == '<' || s[i] == '>' || s[i] == '&')
+      return i;
+  return len;
+}
+
+size_t escape_span(const char *s, size_t len) {
+  size_t i = 0;
+  // each loop leaves the tail it could not fill a vector with to the next
+#if defined(__AVX2__)
+  if (span_avx2(s, len, &i))
+    return i;
+#endif
+#if defined(__SSE2__)
+  if (span_sse2(s, len, &i))
+    return i;
+#endif
+#if defined(USE_NEON)
+  if (span_neon(s, len, &i))
+    return i;
+#endif
+  return span_scalar(s, len, i);
+}
+
+const char * escape_entity(char c) {
+  switch (c) {
+    case '<': return "&lt;";
+    case '>': return "&gt;";
+    case '&': return "&amp;";
+  }
+  return NULL;
+}
+
+size_t escape_attribute(char *dst, const char *src, size_t len) {
+  char *d = dst;
+  for (size_t i = 0; i < len; i++) {
+    const char *entity = src[i] == '"' ? "&quot;" : src[i] == '\'' ? "&#39;" : escape_entity(src[i]);
+    if (entity == NULL) {
+      *d++ = src[i];
+      continue;
+    }
+    size_t n = strlen(entity);
+    memcpy(d, entity, n);
+    d += n;
+  }
+  return d - dst;
+}
+
+// Scanning and copying in blocks that stay in L1 is faster than scanning
+// a multi-MB blob in one go and then copying it.
+#define BLOCK_SIZE (4096)
+#define BURST_SIZE (32)
+
+size_t escape_html(char *dst, const char *src, size_t len) {
+  char *d = dst;
+  while (len > 0) {
+    size_t block = len < BLOCK_SIZE ? len : BLOCK_SIZE;
+    size_t n = escape_span(src, block);
+    memcpy(d, src, n);
+    d += n;
+    src += n;
+    len -= n;
+    if (n == block)
+      continue;
+
+    // specials tend to come in clusters, so handle the next few bytes one
+    // at a time instead of going back to the vector loop for each of them
+    size_t burst = len < BURST_SIZE ? len : BURST_SIZE;
+    for (size_t i = 0; i < burst; i++) {
+      char c = src[i];
+      if ((c | 2) != '>' && c != '&') {
+        *d++ = c;
+        continue;
+      }
+      const char *entity = c == '<' ? "&lt;" : c == '>' ? "&gt;" : "&amp;";
+      memcpy(d, entity, 5);
+      d += c == '&' ? 5 : 4;
+    }
+    src += burst;
+    len -= burst;
+  }
+  return d - dst;
+}
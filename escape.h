@@ -0,0 +1,27 @@
+#ifndef ESCAPE_H
+#define ESCAPE_H
+
+#include <stddef.h>
+
+// Characters replaced by escape_html. Text ends up inside <pre>, never in
+// attributes, so quotes can stay as they are.
+#define ESCAPE_MAX_GROWTH (5) // "&amp;"
+
+// Length of the prefix of s that needs no escaping. This is the hot loop,
+// it scans 16 or 32 bytes at a time where SSE2, AVX2 or NEON are available.
+size_t escape_span(const char *s, size_t len);
+
+// Entity for a character escape_span stopped at.
+const char * escape_entity(char c);
+
+// Escapes src into dst, which must have room for ESCAPE_MAX_GROWTH * len
+// bytes. Returns the number of bytes written.
+size_t escape_html(char *dst, const char *src, size_t len);
+
+// For text that goes into a quoted attribute value, e.g. a form field
+// filled in from the query: quotes are escaped as well. Short strings
+// only, there is no fast path.
+#define ESCAPE_ATTRIBUTE_MAX_GROWTH (6) // "&quot;"
+size_t escape_attribute(char *dst, const char *src, size_t len);
+
+#endif
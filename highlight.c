@@ -0,0 +1,512 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "highlight.h"
+#include "escape.h"
+#include "page_cache.h"
+
+
+#define MIN(a,b) (a<b?a:b)
+
+enum token {
+  TOKEN_PLAIN,
+  TOKEN_KEYWORD,
+  TOKEN_STRING,
+  TOKEN_COMMENT,
+  TOKEN_NUMBER,
+  TOKEN_PREPROCESSOR,
+  TOKEN_VARIABLE,
+  TOKEN_HEADING,
+};
+
+// the classes are styled by the blob page
+static const char * token_tags[] = {
+  [TOKEN_KEYWORD]      = "<span class=\"hl-k\">",
+  [TOKEN_STRING]       = "<span class=\"hl-s\">",
+  [TOKEN_COMMENT]      = "<span class=\"hl-c\">",
+  [TOKEN_NUMBER]       = "<span class=\"hl-n\">",
+  [TOKEN_PREPROCESSOR] = "<span class=\"hl-p\">",
+  [TOKEN_VARIABLE]     = "<span class=\"hl-v\">",
+  [TOKEN_HEADING]      = "<span class=\"hl-h\">",
+};
+
+enum {
+  CHAR_OTHER,
+  CHAR_SPACE,
+  CHAR_IDENT,
+  CHAR_DIGIT,
+};
+
+static const uint8_t char_class[256] = {
+  [' '] = CHAR_SPACE, ['\t'] = CHAR_SPACE, ['\r'] = CHAR_SPACE, ['\f'] = CHAR_SPACE, ['\v'] = CHAR_SPACE,
+  ['a' ... 'z'] = CHAR_IDENT, ['A' ... 'Z'] = CHAR_IDENT, ['_'] = CHAR_IDENT,
+  ['0' ... '9'] = CHAR_DIGIT,
+  // UTF-8, good enough for identifiers
+  [0x80 ... 0xff] = CHAR_IDENT,
+};
+#define CLASS(c) (char_class[(unsigned char) (c)])
+
+// sorted, they are binary searched
+static const char * c_keywords[] = {
+  "alignas", "alignof", "auto", "bool", "break", "case", "catch", "char",
+  "class", "const", "constexpr", "continue", "default", "delete", "do",
+  "double", "else", "enum", "explicit", "extern", "false", "float", "for",
+  "friend", "goto", "if", "inline", "int", "long", "namespace", "new",
+  "noexcept", "nullptr", "operator", "private", "protected", "public",
+  "register", "return", "short", "signed", "sizeof", "static",
+  "static_assert", "struct", "switch", "template", "this", "throw", "true",
+  "try", "typedef", "typename", "union", "unsigned", "using", "virtual",
+  "void", "volatile", "while",
+};
+static const char * python_keywords[] = {
+  "False", "None", "True", "and", "as", "assert", "async", "await", "break",
+  "class", "continue", "def", "del", "elif", "else", "except", "finally",
+  "for", "from", "global", "if", "import", "in", "is", "lambda", "nonlocal",
+  "not", "or", "pass", "raise", "return", "try", "while", "with", "yield",
+};
+static const char * js_keywords[] = {
+  "async", "await", "break", "case", "catch", "class", "const", "continue",
+  "debugger", "default", "delete", "do", "else", "export", "extends",
+  "false", "finally", "for", "function", "if", "import", "in", "instanceof",
+  "let", "new", "null", "of", "return", "static", "super", "switch", "this",
+  "throw", "true", "try", "typeof", "undefined", "var", "void", "while",
+  "with", "yield",
+};
+static const char * shell_keywords[] = {
+  "case", "do", "done", "elif", "else", "esac", "exit", "export", "fi",
+  "for", "function", "if", "in", "local", "readonly", "return", "select",
+  "shift", "then", "until", "while",
+};
+#define KEYWORDS(k) .keywords = k, .keywords_len = sizeof(k) / sizeof(*k)
+
+struct language {
+  // NULL if there are none
+  const char *line_comment;
+  const char *block_open, *block_close;
+  // line comments only start a word (shell)
+  bool comment_at_word;
+  // string delimiters, for strings ending at the line end, strings that
+  // don't and strings without backslash escapes
+  const char *quotes, *long_quotes, *raw_quotes;
+  // """ and ''' (python)
+  bool triple_quotes;
+  // # lines (C)
+  bool preprocessor;
+  // $x and ${x} (shell)
+  bool variables;
+  // line based, see lex_markdown
+  bool markdown;
+  const char **keywords;
+  size_t keywords_len;
+};
+
+enum {
+  LANGUAGE_C,
+  LANGUAGE_PYTHON,
+  LANGUAGE_JS,
+  LANGUAGE_SHELL,
+  LANGUAGE_MARKDOWN,
+};
+
+static const struct language languages[] = {
+  [LANGUAGE_C] = {
+    .line_comment = "//", .block_open = "/*", .block_close = "*/",
+    .quotes = "\"'", .preprocessor = true, KEYWORDS(c_keywords),
+  },
+  [LANGUAGE_PYTHON] = {
+    .line_comment = "#",
+    .quotes = "\"'", .triple_quotes = true, KEYWORDS(python_keywords),
+  },
+  [LANGUAGE_JS] = {
+    .line_comment = "//", .block_open = "/*", .block_close = "*/",
+    .quotes = "\"'", .long_quotes = "`", KEYWORDS(js_keywords),
+  },
+  [LANGUAGE_SHELL] = {
+    .line_comment = "#", .comment_at_word = true,
+    .long_quotes = "\"'`", .raw_quotes = "'", .variables = true, KEYWORDS(shell_keywords),
+  },
+  [LANGUAGE_MARKDOWN] = {
+    .markdown = true,
+  },
+};
+
+// file extensions, and the names after a markdown code fence
+static const struct {
+  const char *name;
+  int language;
+} language_names[] = {
+  { "c", LANGUAGE_C }, { "h", LANGUAGE_C }, { "cc", LANGUAGE_C }, { "cpp", LANGUAGE_C },
+  { "cxx", LANGUAGE_C }, { "c++", LANGUAGE_C }, { "hh", LANGUAGE_C }, { "hpp", LANGUAGE_C },
+  { "hxx", LANGUAGE_C },
+  { "py", LANGUAGE_PYTHON }, { "pyw", LANGUAGE_PYTHON }, { "python", LANGUAGE_PYTHON },
+  { "js", LANGUAGE_JS }, { "mjs", LANGUAGE_JS }, { "cjs", LANGUAGE_JS }, { "jsx", LANGUAGE_JS },
+  { "ts", LANGUAGE_JS }, { "tsx", LANGUAGE_JS }, { "javascript", LANGUAGE_JS }, { "typescript", LANGUAGE_JS },
+  { "sh", LANGUAGE_SHELL }, { "bash", LANGUAGE_SHELL }, { "zsh", LANGUAGE_SHELL }, { "shell", LANGUAGE_SHELL },
+  { "md", LANGUAGE_MARKDOWN }, { "markdown", LANGUAGE_MARKDOWN },
+};
+
+struct highlight_key {
+  // keeps these apart from the page fragments, whose keys start with a url
+  char tag[4];
+  uint32_t version;
+  uint32_t language;
+  git_oid oid;
+};
+
+struct buf {
+  char *data;
+  size_t len, cap;
+};
+
+
+static const struct language * language_by_name(const char *name, size_t len) {
+  for (size_t i = 0; i < sizeof(language_names) / sizeof(*language_names); i++)
+    if (strlen(language_names[i].name) == len && strncasecmp(language_names[i].name, name, len) == 0)
+      return &languages[language_names[i].language];
+  return NULL;
+}
+
+static const struct language * language_for(const char *filename, const char *content, size_t len) {
+  const char *dot = strrchr(filename, '.');
+  if (dot != NULL && dot != filename)
+    return language_by_name(dot + 1, strlen(dot + 1));
+  // scripts without an extension
+  if (len < 2 || content[0] != '#' || content[1] != '!')
+    return NULL;
+  const char *nl = memchr(content, '\n', len);
+  size_t lineLen = nl != NULL ? nl - content : len;
+  if (memmem(content, lineLen, "python", 6) != NULL)
+    return &languages[LANGUAGE_PYTHON];
+  if (memmem(content, lineLen, "node", 4) != NULL)
+    return &languages[LANGUAGE_JS];
+  if (memmem(content, lineLen, "sh", 2) != NULL)
+    return &languages[LANGUAGE_SHELL];
+  return NULL;
+}
+
+static void buf_reserve(struct buf *b, size_t n) {
+  if (b->len + n <= b->cap)
+    return;
+  size_t cap = b->cap > 0 ? b->cap * 2 : 4096;
+  while (cap < b->len + n)
+    cap *= 2;
+  b->data = realloc(b->data, cap);
+  b->cap = cap;
+}
+
+static void buf_append(struct buf *b, const char *s, size_t len) {
+  buf_reserve(b, len);
+  memcpy(b->data + b->len, s, len);
+  b->len += len;
+}
+
+// the same escaping out_escape does, into the buffer
+static void emit(struct buf *b, enum token t, const char *s, size_t len) {
+  if (len == 0)
+    return;
+  if (t != TOKEN_PLAIN)
+    buf_append(b, token_tags[t], strlen(token_tags[t]));
+  buf_reserve(b, len * ESCAPE_MAX_GROWTH);
+  b->len += escape_html(b->data + b->len, s, len);
+  if (t != TOKEN_PLAIN)
+    buf_append(b, "</span>", 7);
+}
+
+static bool starts_with(const char *s, size_t len, size_t i, const char *prefix) {
+  if (prefix == NULL)
+    return false;
+  size_t n = strlen(prefix);
+  return len - i >= n && memcmp(s + i, prefix, n) == 0;
+}
+
+static bool in_set(const char *set, char c) {
+  return set != NULL && c != 0 && strchr(set, c) != NULL;
+}
+
+static size_t line_end(const char *s, size_t len, size_t i) {
+  const char *nl = memchr(s + i, '\n', len - i);
+  return nl != NULL ? (size_t) (nl - s) : len;
+}
+
+// Where a string or comment whose body starts at i ends, just past close.
+// Never looks back, an unterminated one runs to the end (or the line end).
+static size_t token_end(const char *s, size_t len, size_t i, const char *close, bool escapes, bool multiline) {
+  while (i < len) {
+    if (escapes && s[i] == '\\') {
+      i += 2;
+      continue;
+    }
+    if (s[i] == '\n' && ! multiline)
+      return i;
+    if (starts_with(s, len, i, close))
+      return i + strlen(close);
+    i++;
+  }
+  return len;
+}
+
+// a preprocessor line, continued by a trailing backslash
+static size_t directive_end(const char *s, size_t len, size_t i) {
+  for (;;) {
+    size_t end = line_end(s, len, i);
+    if (end == len || end == i || s[end - 1] != '\\')
+      return end;
+    i = end + 1;
+  }
+}
+
+// after the $ of a shell variable
+static size_t variable_end(const char *s, size_t len, size_t i) {
+  if (i >= len)
+    return i;
+  if (s[i] == '{')
+    return token_end(s, len, i + 1, "}", false, false);
+  if (in_set("@*#?$!-", s[i]))
+    return i + 1;
+  while (i < len && CLASS(s[i]) >= CHAR_IDENT)
+    i++;
+  return i;
+}
+
+static bool is_keyword(const struct language *l, const char *word, size_t len) {
+  size_t lo = 0, hi = l->keywords_len;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    const char *k = l->keywords[mid];
+    int cmp = strncmp(word, k, len);
+    if (cmp == 0 && k[len] != 0)
+      cmp = -1;
+    if (cmp == 0)
+      return true;
+    if (cmp < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return false;
+}
+
+static void lex(struct buf *b, const struct language *l, const char *s, size_t len) {
+  size_t i = 0, plain = 0;
+  // nothing but whitespace since the last newline
+  bool lineStart = true;
+  while (i < len) {
+    char c = s[i];
+    size_t start = i;
+    enum token t = TOKEN_PLAIN;
+
+    if (c == '\n') {
+      lineStart = true;
+      i++;
+      continue;
+    }
+    if (CLASS(c) == CHAR_SPACE) {
+      i++;
+      continue;
+    }
+
+    if (l->preprocessor && lineStart && c == '#') {
+      i = directive_end(s, len, i);
+      t = TOKEN_PREPROCESSOR;
+    }
+    else if (l->variables && c == '$') {
+      i = variable_end(s, len, i + 1);
+      t = i > start + 1 ? TOKEN_VARIABLE : TOKEN_PLAIN;
+    }
+    else if (starts_with(s, len, i, l->line_comment)
+        && (! l->comment_at_word || i == 0 || CLASS(s[i - 1]) == CHAR_SPACE || in_set("\n;(", s[i - 1]))) {
+      i = line_end(s, len, i);
+      t = TOKEN_COMMENT;
+    }
+    else if (starts_with(s, len, i, l->block_open)) {
+      i = token_end(s, len, i + strlen(l->block_open), l->block_close, false, true);
+      t = TOKEN_COMMENT;
+    }
+    else if (l->triple_quotes && (c == '"' || c == '\'') && len - i >= 3 && s[i + 1] == c && s[i + 2] == c) {
+      char close[] = { c, c, c, 0 };
+      i = token_end(s, len, i + 3, close, true, true);
+      t = TOKEN_STRING;
+    }
+    else if (in_set(l->quotes, c) || in_set(l->long_quotes, c)) {
+      char close[] = { c, 0 };
+      i = token_end(s, len, i + 1, close, ! in_set(l->raw_quotes, c), in_set(l->long_quotes, c));
+      t = TOKEN_STRING;
+    }
+    else if (CLASS(c) == CHAR_DIGIT) {
+      // 0x1f, 1.5e3, 10UL and the like
+      while (i < len && (CLASS(s[i]) >= CHAR_IDENT || s[i] == '.'))
+        i++;
+      t = TOKEN_NUMBER;
+    }
+    else if (CLASS(c) == CHAR_IDENT) {
+      while (i < len && CLASS(s[i]) >= CHAR_IDENT)
+        i++;
+      if (is_keyword(l, s + start, i - start))
+        t = TOKEN_KEYWORD;
+    }
+    else {
+      i++;
+    }
+    lineStart = false;
+
+    if (t != TOKEN_PLAIN) {
+      emit(b, TOKEN_PLAIN, s + plain, start - plain);
+      emit(b, t, s + start, i - start);
+      plain = i;
+    }
+  }
+  emit(b, TOKEN_PLAIN, s + plain, len - plain);
+}
+
+// `code` spans of a markdown line
+static void lex_markdown_inline(struct buf *b, const char *s, size_t len) {
+  size_t i = 0, plain = 0;
+  // backtick run lengths known to have no closing run, so a line full of
+  // unmatched ones isn't searched again for each of them
+  uint64_t unmatched = 0;
+  while (i < len) {
+    if (s[i] != '`') {
+      i++;
+      continue;
+    }
+    size_t start = i;
+    while (i < len && s[i] == '`')
+      i++;
+    size_t n = i - start;
+    if (n >= 64 || (unmatched & 1ULL << n))
+      continue;
+
+    size_t j = i, close = len;
+    while (j < len) {
+      const char *tick = memchr(s + j, '`', len - j);
+      if (tick == NULL)
+        break;
+      size_t run = tick - s;
+      j = run;
+      while (j < len && s[j] == '`')
+        j++;
+      if (j - run == n) {
+        close = j;
+        break;
+      }
+    }
+    if (close == len) {
+      unmatched |= 1ULL << n;
+      continue;
+    }
+    emit(b, TOKEN_PLAIN, s + plain, start - plain);
+    emit(b, TOKEN_STRING, s + start, close - start);
+    i = plain = close;
+  }
+  emit(b, TOKEN_PLAIN, s + plain, len - plain);
+}
+
+// A code fence opened on the line from i to end, the marker at fence. The
+// block is highlighted in the language named after the marker. Returns
+// the end of the closing line.
+static size_t lex_markdown_fence(struct buf *b, const char *s, size_t len, size_t i, size_t fence, size_t end) {
+  char marker = s[fence];
+  size_t info = fence;
+  while (info < end && s[info] == marker)
+    info++;
+  size_t fenceLen = info - fence;
+  while (info < end && CLASS(s[info]) == CHAR_SPACE)
+    info++;
+  size_t infoEnd = info;
+  while (infoEnd < end && CLASS(s[infoEnd]) != CHAR_SPACE)
+    infoEnd++;
+  const struct language *l = language_by_name(s + info, infoEnd - info);
+
+  emit(b, TOKEN_COMMENT, s + i, end - i);
+  if (end == len)
+    return len;
+  emit(b, TOKEN_PLAIN, "\n", 1);
+
+  // the block ends at a line with at least as many markers
+  size_t body = end + 1, close = body;
+  while (close < len) {
+    size_t lineEnd = line_end(s, len, close);
+    size_t p = close;
+    while (p < lineEnd && p - close < 3 && s[p] == ' ')
+      p++;
+    size_t q = p;
+    while (q < lineEnd && s[q] == marker)
+      q++;
+    if (q - p >= fenceLen)
+      break;
+    close = lineEnd + 1;
+  }
+  close = MIN(close, len);
+
+  if (l != NULL && ! l->markdown)
+    lex(b, l, s + body, close - body);
+  else
+    emit(b, TOKEN_PLAIN, s + body, close - body);
+  if (close == len)
+    return len;
+  size_t closeEnd = line_end(s, len, close);
+  emit(b, TOKEN_COMMENT, s + close, closeEnd - close);
+  return closeEnd;
+}
+
+static void lex_markdown(struct buf *b, const char *s, size_t len) {
+  size_t i = 0;
+  while (i < len) {
+    size_t end = line_end(s, len, i);
+    // up to three spaces of indentation, more is an indented code block
+    size_t p = i;
+    while (p < end && p - i < 3 && s[p] == ' ')
+      p++;
+    char c = p < end ? s[p] : 0;
+
+    if ((c == '`' || c == '~') && end - p >= 3 && s[p + 1] == c && s[p + 2] == c)
+      end = lex_markdown_fence(b, s, len, i, p, end);
+    else if (c == '#')
+      emit(b, TOKEN_HEADING, s + i, end - i);
+    else if (c == '>')
+      emit(b, TOKEN_COMMENT, s + i, end - i);
+    else
+      lex_markdown_inline(b, s + i, end - i);
+
+    if (end == len)
+      break;
+    emit(b, TOKEN_PLAIN, "\n", 1);
+    i = end + 1;
+  }
+}
+
+void highlight_blob(struct out *o, const git_oid *oid, const char *filename, const char *content, size_t len) {
+  const struct language *l = language_for(filename, content, len);
+  if (l == NULL || len == 0 || len > HIGHLIGHT_MAX_BYTES) {
+    out_escape(o, content, len);
+    return;
+  }
+
+  struct highlight_key key;
+  memset(&key, 0, sizeof(key));
+  memcpy(key.tag, "hl", 2);
+  key.version = HIGHLIGHT_VERSION;
+  key.language = l - languages;
+  git_oid_cpy(&key.oid, oid);
+
+  size_t cachedLen;
+  const char *cached = page_cache_get(&key, sizeof(key), &cachedLen);
+  if (cached != NULL) {
+    out_write(o, cached, cachedLen);
+    page_cache_release(cached);
+    return;
+  }
+
+  struct buf b = { NULL, 0, 0 };
+  if (l->markdown)
+    lex_markdown(&b, content, len);
+  else
+    lex(&b, l, content, len);
+  page_cache_put(&key, sizeof(key), b.data, b.len);
+  out_write(o, b.data, b.len);
+  free(b.data);
+}
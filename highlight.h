@@ -0,0 +1,23 @@
+#ifndef HIGHLIGHT_H
+#define HIGHLIGHT_H
+
+#include <stddef.h>
+#include <git2.h>
+
+#include "out.h"
+
+// part of the cache key, bump it when the markup changes so pages
+// persisted by the page cache aren't served in the old form
+#define HIGHLIGHT_VERSION (1)
+// bigger blobs are only escaped
+#define HIGHLIGHT_MAX_BYTES (1024*1024)
+
+// Writes the text of a blob escaped, with <span class="hl-*"> around
+// keywords, strings, comments etc. if the language is known (C/C++,
+// Python, JS, shell and Markdown by extension, scripts by #!). Tokenizing
+// is one pass over a table per language. The markup is kept in the page
+// cache under (blob oid, language, HIGHLIGHT_VERSION), so a file is
+// tokenized once however many commits and branches contain it.
+void highlight_blob(struct out *o, const git_oid *oid, const char *filename, const char *content, size_t len);
+
+#endif
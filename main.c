@@ -1,72 +1,108 @@
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <git2.h>
 
 #include <mongoose.h>
 
+#include "repo_cache.h"
+#include "commit_index.h"
+#include "page_cache.h"
+#include "out.h"
+#include "workers.h"
+#include "catalog.h"
+#include "media.h"
+#include "compress.h"
+#include "diff_cache.h"
+#include "search.h"
+#include "metrics.h"
+#include "arena.h"
+#include "routes.h"
+#include "static_cache.h"
+#include "tls.h"
+#include "dir_cache.h"
+#include "smart_http.h"
+#include "archive.h"
+#include "admission.h"
+#include "highlight.h"
+#include "prerender.h"
 
 #define MIN(a,b) (a<b?a:b)
 #define MAX(a,b) (a>b?a:b)
 
-#define HTML_SIZE (8*1024*1024)
 #define OID_SIZE (8)
 #define COMMITS_PER_PAGE (10)
-
-
-
+// commits checked per tree entry for the last change column, newest first
+#define LAST_CHANGE_CANDIDATES (4)
+// mounts, see routes.h and -c
+#define ROUTES_FILE "routes.conf"
+// no scheme or https:// means TLS, see -l
+#define LISTEN_URL "[::]:443"
+// reloaded when they change or on SIGHUP
+#define TLS_CERT "./certs/cert1.pem"
+#define TLS_KEY "./certs/privkey1.pem"
+// idle keep-alive connections are closed after this long
+#define KEEPALIVE_IDLE_MS (30*1000)
+#define PAGE_CACHE_SIZE (32*1024*1024)
+// set to a directory to keep rendered pages across restarts
+#define PAGE_CACHE_DIR NULL
+// git pages are rendered off the event loop, see -w and -q
+#define WORKER_THREADS (3)
+#define WORKER_QUEUE_DEPTH (32)
+// paths changed by each commit, for the last change column of tree pages
+#define COMMIT_INDEX_DIR "commits"
+// trigram indexes for /search, one file per repository
+#define SEARCH_INDEX_DIR "search"
+// clone packs, see smart_http.h
+#define PACK_CACHE_DIR "packs"
+// .tar.gz and .zip snapshots, see archive.h
+#define ARCHIVE_CACHE_DIR "archives"
+// gzip/brotli level for git pages, see -z
+#define COMPRESS_LEVEL (5)
+
+// per client token bucket, see admission.h for what requests cost
+#define RATE_LIMIT (5)
+#define RATE_BURST (100)
+// git renders queued or running at once
+#define GIT_RENDER_LIMIT (16)
+
+
+
+// dir routes serve the files below a directory, never a listing of it
 static void serve_dir(struct mg_connection *c, struct mg_http_message *hm, const char *dirname) {
+    char uri[4096], path[4096 + 512];
+    struct stat st;
+    int uriLen = mg_url_decode(hm->uri.ptr, hm->uri.len, uri, sizeof(uri), 0);
+    snprintf(path, sizeof(path), "%s%s", dirname, uriLen >= 0 ? uri : "");
+    if (uriLen < 0 || (stat(path, &st) == 0 && S_ISDIR(st.st_mode))) {
+      mg_http_reply(c, 404, NULL, "Not found :(\n");
+      return;
+    }
     struct mg_http_serve_opts opts;
     memset(&opts, 0, sizeof(opts));
     opts.root_dir = dirname;
     mg_http_serve_dir(c, hm, &opts);
 }
-static void serve_css(struct mg_connection *c, struct mg_http_message *hm, const char *filename) {
-  struct mg_http_serve_opts opts = { .mime_types = "css=text/css" };
-  mg_http_serve_file(c, hm, filename, &opts);
-}
-static void serve_html(struct mg_connection *c, struct mg_http_message *hm, const char *filename) {
-  struct mg_http_serve_opts opts = { .mime_types = "html=text/html" };
-  mg_http_serve_file(c, hm, filename, &opts);
-}
 static int gitDiffPrintCb(const git_diff_delta *delta, const git_diff_hunk *hunk, const git_diff_line *line, void *payload) {
-  struct {
-      char *html;
-      int *html_len;
-    } *userdata = payload;
+  struct out *o = payload;
   //printf("hunk: %s\n", hunk->header);
 
   if (line->origin == '+' || line->origin == '-' || line->origin == 'H') {
 
-    #define HTML(...) *userdata->html_len += snprintf(userdata->html + *userdata->html_len, HTML_SIZE - *userdata->html_len, __VA_ARGS__)
+    #define HTML(...) out_printf(o, __VA_ARGS__)
 
     /**/ if (line->origin == '+') HTML("<span style=\"color: green;\">%c %*d ", line->origin, 6, line->new_lineno);
     else if (line->origin == '-') HTML("<span style=\"color: red;\">%c %*d ", line->origin, 6, line->old_lineno);
     else if (line->origin == 'H') HTML("<span>");
     //else                          HTML("<span>%c ", line->origin);
 
-    struct { char c; const char * replacement; }
-    replacements[] = {
-      { '<', "&lt;" },
-      { '>', "&gt;" },
-      { '&', "&amp;" },
-    };
-
-    for (int i = 0; i < line->content_len; i++) {
-      char c = ((char*)line->content)[i];
-      bool replaced = false;
-      for (int j = 0; j < sizeof(replacements)/sizeof(replacements[0]); j++) {
-        if (replacements[j].c == c) {
-          size_t len = strlen(replacements[j].replacement);
-          memcpy(userdata->html + *userdata->html_len, replacements[j].replacement, len);
-          (*userdata->html_len) += len;
-
-          replaced = true;
-          break;
-        }
-      }
-      if (! replaced)
-        userdata->html[(*userdata->html_len)++] = c;
-    }
+    out_escape(o, line->content, line->content_len);
 
     HTML("</span>");
   
@@ -74,20 +110,218 @@ static int gitDiffPrintCb(const git_diff_delta *delta, const git_diff_hunk *hunk
 
   }
 
-  return 0;
+  // stop diffing once the client is gone
+  return o->failed ? -1 : 0;
 }
-static void serve_pdf(struct mg_connection *c, struct mg_http_message *hm, const char *filename) {
-  struct mg_http_serve_opts opts =
-    { .mime_types = "pdf=application/pdf",
-      .extra_headers = "Content-Disposition: inline\r\n"
-    };
-  mg_http_serve_file(c, hm, filename, &opts);
+// Prints the hunks of a single file, returns false if it stopped at
+// maxLines lines or maxBytes bytes with more left.
+static bool print_patch(struct out *o, git_patch *patch, size_t maxLines, size_t maxBytes) {
+  const git_diff_delta *delta = git_patch_get_delta(patch);
+  size_t lines = 0, bytes = 0;
+  for (size_t h = 0; h < git_patch_num_hunks(patch); h++) {
+    const git_diff_hunk *hunk;
+    size_t hunkLines;
+    if (git_patch_get_hunk(&hunk, &hunkLines, patch, h) != 0)
+      break;
+    git_diff_line header = { .origin = 'H', .content = hunk->header, .content_len = hunk->header_len };
+    gitDiffPrintCb(delta, hunk, &header, o);
+
+    for (size_t l = 0; l < hunkLines; l++) {
+      const git_diff_line *line;
+      if (git_patch_get_line_in_hunk(&line, patch, h, l) != 0)
+        break;
+      if (lines >= maxLines || bytes >= maxBytes)
+        return false;
+      if (gitDiffPrintCb(delta, hunk, line, o) != 0)
+        return true;
+      lines++;
+      bytes += line->content_len;
+    }
+  }
+  return true;
 }
-static void serve_git(struct mg_connection *c, struct mg_http_message *hm,
-  const char *repo_prefix)
+// hash of all branch names and tips, i.e. everything the branch list shows
+static uint64_t hash_branches(uint64_t hash, git_repository *gitrepo) {
+  git_branch_iterator *it;
+  if (git_branch_iterator_new(&it, gitrepo, GIT_BRANCH_LOCAL) != 0)
+    return hash;
+  git_reference *ref;
+  git_branch_t branchType;
+  while (!git_branch_next(&ref, &branchType, it)) {
+    const char *name = git_reference_name(ref);
+    const git_oid *target = git_reference_target(ref);
+    hash = page_cache_hash(hash, name, strlen(name) + 1);
+    if (target != NULL)
+      hash = page_cache_hash(hash, target, sizeof(*target));
+    git_reference_free(ref);
+  }
+  git_branch_iterator_free(it);
+  return hash;
+}
+static bool etag_matches(struct mg_http_message *hm, const char *etag) {
+  struct mg_str *inm = mg_http_get_header(hm, "If-None-Match");
+  if (inm == NULL)
+    return false;
+  size_t len = strlen(etag);
+  for (size_t i = 0; i + len <= inm->len; i++)
+    if (memcmp(inm->ptr + i, etag, len) == 0)
+      return true;
+  return false;
+}
+// /git/<repo>/<branch>/<commit>/raw/<path>: the blob itself, streamed
+// from the object database when the backend can (loose objects), else
+// read in one go. The blob oid is the ETag.
+static void serve_raw(struct out *o, struct mg_http_message *hm, git_repository *gitrepo, git_commit *gitcommit,
+  const char *commitStr, const char *pathStr)
 {
+  git_tree *tree;
+  git_tree_entry *entry;
+  if (git_commit_tree(&tree, gitcommit) != 0) {
+    out_reply(o, 404, NULL, "File not found :{\n");
+    return;
+  }
+  if (git_tree_entry_bypath(&entry, tree, pathStr) != 0) {
+    git_tree_free(tree);
+    out_reply(o, 404, NULL, "File not found :{\n");
+    return;
+  }
+  git_oid blobOid = *git_tree_entry_id(entry);
+  bool isBlob = git_tree_entry_type(entry) == GIT_OBJECT_BLOB;
+  git_tree_entry_free(entry);
+  git_tree_free(tree);
+  if (! isBlob) {
+    out_reply(o, 404, NULL, "Not a file :{\n");
+    return;
+  }
+
+  git_odb *odb;
+  size_t size;
+  git_object_t objectType;
+  if (git_repository_odb(&odb, gitrepo) != 0) {
+    out_reply(o, 500, NULL, "Error reading object :(\n");
+    return;
+  }
+  if (git_odb_read_header(&size, &objectType, odb, &blobOid) != 0) {
+    git_odb_free(odb);
+    out_reply(o, 500, NULL, "Error reading object :(\n");
+    return;
+  }
+
+  // a blob never changes, but a url with a branch name or HEAD does
+  bool immutable = strlen(commitStr) == GIT_OID_HEXSZ;
+  char headers[512];
+  int headersLen = snprintf(headers, sizeof(headers),
+    "Content-Type: %s\r\n"
+    "ETag: \"%s\"\r\n"
+    "Cache-Control: %s\r\n"
+    "Accept-Ranges: bytes\r\n"
+    // repo html must not run as part of this site
+    "Content-Security-Policy: sandbox\r\n"
+    "X-Content-Type-Options: nosniff\r\n",
+    media_mime_type(pathStr), git_oid_tostr_s(&blobOid),
+    immutable ? "public, max-age=31536000, immutable" : "no-cache");
+
+  char etag[GIT_OID_HEXSZ + 3];
+  snprintf(etag, sizeof(etag), "\"%s\"", git_oid_tostr_s(&blobOid));
+  if (etag_matches(hm, etag)) {
+    git_odb_free(odb);
+    out_reply(o, 304, headers, "");
+    return;
+  }
+
+  // only single ranges, multiple ones get the whole blob
+  off_t starts[MEDIA_MAX_RANGES], ends[MEDIA_MAX_RANGES];
+  struct mg_str *range = mg_http_get_header(hm, "Range");
+  int ranges = media_parse_ranges(range, size, starts, ends);
+  if (ranges < 0) {
+    git_odb_free(odb);
+    snprintf(headers + headersLen, sizeof(headers) - headersLen, "Content-Range: bytes */%zu\r\n", size);
+    out_reply(o, 416, headers, "");
+    return;
+  }
+  size_t from = 0, to = size;
+  if (ranges == 1) {
+    from = starts[0];
+    to = ends[0];
+    snprintf(headers + headersLen, sizeof(headers) - headersLen, "Content-Range: bytes %zu-%zu/%zu\r\n",
+      from, to - 1, size);
+  }
+
+  out_begin_sized(o, ranges == 1 ? 206 : 200, headers, to - from);
+  if (mg_vcmp(&hm->method, "HEAD") == 0) {
+    git_odb_free(odb);
+    out_end(o);
+    return;
+  }
+
+  uint64_t start = metrics_now();
+  git_odb_stream *stream;
+  if (git_odb_open_rstream(&stream, &size, &objectType, odb, &blobOid) == 0) {
+    char buf[64*1024];
+    size_t pos = 0;
+    while (pos < to && ! o->failed) {
+      int n = git_odb_stream_read(stream, buf, sizeof(buf));
+      if (n <= 0)
+        break;
+      // skip up to the range start, nothing to seek in a zlib stream
+      size_t chunkFrom = MAX(pos, from), chunkTo = MIN(pos + n, to);
+      if (chunkFrom < chunkTo)
+        out_write(o, buf + (chunkFrom - pos), chunkTo - chunkFrom);
+      pos += n;
+    }
+    // a read error or a stream shorter than its header said
+    if (pos < to)
+      o->failed = true;
+    git_odb_stream_free(stream);
+  }
+  else {
+    // packed objects can't be streamed, libgit2 has to inflate them whole
+    git_blob *blob;
+    if (git_blob_lookup(&blob, gitrepo, &blobOid) == 0) {
+      const char *content = git_blob_rawcontent(blob);
+      for (size_t pos = from; pos < to && ! o->failed; pos += 64*1024)
+        out_write(o, content + pos, MIN(to - pos, 64*1024));
+      git_blob_free(blob);
+    }
+    else {
+      o->failed = true;
+    }
+  }
+  git_odb_free(odb);
+  // includes waiting for the client, the stream is inflated as we go
+  metrics_git(METRICS_GIT_BLOB, start);
+
+  // a short body can't be fixed up anymore, just drop the connection
+  if (o->failed)
+    o->close = true;
+  out_end(o);
+}
+// Tree of path (the root if empty) in commit, NULL if there is none.
+static git_tree * commit_subtree(struct arena *a, git_repository *gitrepo, git_commit *gitcommit, const char *path) {
+  git_tree *tree;
+  if (git_commit_tree(&tree, gitcommit) != 0)
+    return NULL;
+  arena_track(a, tree, (arena_free_fn) git_tree_free);
+  if (path[0] == '\0')
+    return tree;
+
+  git_tree_entry *entry;
+  if (git_tree_entry_bypath(&entry, tree, path) != 0)
+    return NULL;
+  git_tree *subtree = NULL;
+  if (git_tree_entry_type(entry) == GIT_OBJECT_TREE)
+    git_tree_lookup(&subtree, gitrepo, git_tree_entry_id(entry));
+  git_tree_entry_free(entry);
+  return arena_track(a, subtree, (arena_free_fn) git_tree_free);
+}
+// Runs on a worker thread, everything goes out through o. Strings and
+// libgit2 objects of the request live in a and are released by the
+// caller once the response is done.
+static void serve_git(struct out *o, struct mg_http_message *hm, void *arg, struct arena *a)
+{
+  const char *repo_prefix = arg;
   typedef struct mg_str * mg_str_ptr;
-  static struct mg_str repo, branch, commit, type, path, file;
+  struct mg_str repo, branch, commit, type, path, file;
   mg_str_ptr caps[] = { &repo, &branch, &commit, &type, &path };
 
   const int caps_len = sizeof(caps) / sizeof(caps[0]);
@@ -130,48 +364,119 @@ static void serve_git(struct mg_connection *c, struct mg_http_message *hm,
   }
 
 
-  // init libgit2
-	git_libgit2_init();
-
-  static char html[HTML_SIZE];
-  int html_len = 0;
-  #define HTML(...) html_len += snprintf(html+html_len,HTML_SIZE-html_len, __VA_ARGS__)
+  #define HTML(...) out_printf(o, __VA_ARGS__)
 
-  static char repoStr[128]; snprintf(repoStr, 128, "%s/%.*s", repo_prefix, repo.len, repo.ptr);
-  static char branchStr[128]; snprintf(branchStr, 128, "%.*s", branch.len, branch.ptr);
-  static char commitStr[128]; snprintf(commitStr, 128, "%.*s", commit.len, commit.ptr);
-  static char pathStr[128]; snprintf(pathStr, 128, "%.*s", path.len, path.ptr);
+  char *repoStr = arena_printf(a, "%s/%.*s", repo_prefix, (int) repo.len, repo.ptr);
+  char *branchStr = arena_strndup(a, branch.ptr, branch.len);
+  char *commitStr = arena_strndup(a, commit.ptr, commit.len);
+  char *pathStr = arena_strndup(a, path.ptr, path.len);
+  char *fileStr = arena_strndup(a, file.ptr, file.len);
 
-	git_repository * gitrepo = NULL;
-	git_repository_open_bare(&gitrepo, repoStr);
-
-	git_revwalk *walk;
-	git_revwalk_new(&walk, gitrepo);
+	git_repository * gitrepo = repo_cache_open(repoStr);
+  if (gitrepo == NULL) {
+    out_reply(o, 404, NULL, "Repository not found :(\n");
+    return;
+  }
 
-  git_annotated_commit *annotated_commit;
+  git_annotated_commit *annotated_commit = NULL;
   {
   git_reference *ref;
-  git_branch_lookup(&ref, gitrepo, branchStr, GIT_BRANCH_LOCAL);
+  if (git_branch_lookup(&ref, gitrepo, branchStr, GIT_BRANCH_LOCAL) != 0) {
+    out_reply(o, 404, NULL, "Branch not found :(\n");
+    return;
+  }
+  arena_track(a, ref, (arena_free_fn) git_reference_free);
   git_annotated_commit_from_ref(&annotated_commit, gitrepo, ref);
+  arena_track(a, annotated_commit, (arena_free_fn) git_annotated_commit_free);
+  }
+  if (annotated_commit == NULL) {
+    out_reply(o, 500, NULL, "Error reading branch :(\n");
+    return;
   }
 
-  git_commit *gitcommit;
+  // a commit oid or anything else that names a commit, else the branch tip
+  git_commit *gitcommit = NULL;
   git_commit *gitcommitPrev = NULL;
-  git_revparse_single((git_object**)&gitcommit, gitrepo, commitStr);
+  {
+  git_object *object;
+  if (git_revparse_single(&object, gitrepo, commitStr) == 0) {
+    git_object_peel((git_object**)&gitcommit, object, GIT_OBJECT_COMMIT);
+    git_object_free(object);
+  }
+  }
   if (gitcommit == NULL)
     git_commit_lookup(&gitcommit, gitrepo, git_annotated_commit_id(annotated_commit));
+  if (arena_track(a, gitcommit, (arena_free_fn) git_commit_free) == NULL) {
+    out_reply(o, 404, NULL, "Commit not found :(\n");
+    return;
+  }
+
+  if (mg_strcmp(type, mg_str("raw")) == 0) {
+    char *rawPath = arena_printf(a, "%s%s%s", pathStr, path.len > 0 ? "/" : "", fileStr);
+    serve_raw(o, hm, gitrepo, gitcommit, commitStr, rawPath);
+    return;
+  }
+
+  // position of every commit on the branch, kept up to date incrementally
+  struct commit_index *commitIndex =
+    commit_index_get(gitrepo, repoStr, branchStr, git_annotated_commit_id(annotated_commit));
+  if (commitIndex == NULL) {
+    out_reply(o, 500, NULL, "Error walking history :(\n");
+    return;
+  }
+  long commitPosition = commit_index_position(commitIndex, git_commit_id(gitcommit));
+  if (commitPosition >= 0) {
+    const git_oid *prevOid = commit_index_at(commitIndex, commitPosition + 1);
+    if (prevOid != NULL && git_commit_lookup(&gitcommitPrev, gitrepo, prevOid) == 0)
+      arena_track(a, gitcommitPrev, (arena_free_fn) git_commit_free);
+  }
   
-  git_tree * commitTree;
-  git_tree * subtree;
-  git_commit_tree(&commitTree, gitcommit);
-  if (path.len == 0) {
-    subtree = commitTree;
+  unsigned int page = 0;
+  {
+  struct mg_str pageStr = mg_http_var(hm->query, mg_str("page"));
+  for (int i = 0; i < pageStr.len; i++) {
+    page *= 10;
+    page += pageStr.ptr[i] - '0';
   }
-  else {
-    const git_tree_entry * pathEntry = git_tree_entry_byname(commitTree, pathStr);
-    git_tree_lookup(&subtree, gitrepo, git_tree_entry_id(pathEntry));
+  }
+  if (page == 0)
+    page = commitPosition >= 0 ? commitPosition / COMMITS_PER_PAGE + 1 : 1;
+
+  // copy what this page needs so other workers can use the index meanwhile
+  unsigned int commitTotalCount = commit_index_count(commitIndex);
+  git_oid pageOids[COMMITS_PER_PAGE];
+  size_t pageFrom = (page-1)*COMMITS_PER_PAGE;
+  size_t pageOidsLen = 0;
+  for (size_t i = pageFrom; i < MIN(page*COMMITS_PER_PAGE, commitTotalCount); i++)
+    pageOids[pageOidsLen++] = *commit_index_at(commitIndex, i);
+  commit_index_put(commitIndex);
+
+  // everything on the page follows from the url, the page number and these
+  // oids, so hashing them gives a strong ETag without rendering anything
+  enum encoding encoding = compress_negotiate(hm, "text/html");
+  char etag[64];
+  {
+  uint64_t hash = PAGE_CACHE_HASH_INIT;
+  hash = page_cache_hash(hash, hm->uri.ptr, hm->uri.len);
+  hash = page_cache_hash(hash, hm->query.ptr, hm->query.len);
+  hash = page_cache_hash(hash, &page, sizeof(page));
+  hash = page_cache_hash(hash, git_commit_id(gitcommit), sizeof(git_oid));
+  hash = page_cache_hash(hash, git_annotated_commit_id(annotated_commit), sizeof(git_oid));
+  hash = hash_branches(hash, gitrepo);
+  // each encoding is a different representation and needs its own ETag
+  snprintf(etag, sizeof(etag), "\"%.12s-%016llx-%s\"", git_oid_tostr_s(git_commit_id(gitcommit)), (unsigned long long) hash,
+    compress_encoding_name(encoding));
+  }
+  char headers[128];
+  snprintf(headers, sizeof(headers), "ETag: %s\r\nCache-Control: no-cache\r\nVary: Accept-Encoding\r\n", etag);
+
+  if (etag_matches(hm, etag)) {
+    out_reply(o, 304, headers, "");
+    return;
   }
 
+  out_set_encoding(o, encoding);
+  out_begin(o, 200, headers);
 
   HTML(
     "<html>\n"
@@ -182,6 +487,8 @@ static void serve_git(struct mg_connection *c, struct mg_http_message *hm,
     "div.box { border: 1px solid rgb(118,118,118); margin: 10px; overflow: hidden; position: relative; }"
     "div.subbox { margin: 0; width; 100%%; height: 100%%; float: left; }"
     "div.diff { border: 1px solid rgb(118, 118, 118); width: 100%%; height: 100%%; font-family: monospace; overflow-y: scroll; }"
+    ".hl-k { color: #a626a4; } .hl-s { color: #50a14f; } .hl-c { color: #a0a1a7; font-style: italic; }"
+    ".hl-n { color: #986801; } .hl-p { color: #c18401; } .hl-v { color: #e45649; } .hl-h { font-weight: bold; }"
     "</style>\n"
     "</head>\n"
     "<body>\n"
@@ -205,100 +512,56 @@ static void serve_git(struct mg_connection *c, struct mg_http_message *hm,
 			git_branch_name(&branchName, ref);
       
       // get first commit
-      git_annotated_commit *annotated_commit = NULL;
-      git_annotated_commit_from_ref(&annotated_commit, gitrepo, ref);
-      // git_commit *commit;
-      // git_commit_lookup(&commit, gitrepo, git_annotated_commit_id(annotated_commit));
-
-      HTML("<a href=\"/git/%.*s/%s/%s/tree\">[branch] %s%s</a><br />\n",
-        repo.len, repo.ptr,
-        branchName,
-        git_oid_tostr_s(git_annotated_commit_id(annotated_commit)),
-        (mg_vcmp(&branch, branchName) == 0) ? "> " : "",
-        branchName);
+      const git_oid *target = git_reference_target(ref);
+
+      if (target != NULL)
+        HTML("<a href=\"/git/%.*s/%s/%s/tree\">[branch] %s%s</a><br />\n",
+          repo.len, repo.ptr,
+          branchName,
+          git_oid_tostr_s(target),
+          (mg_vcmp(&branch, branchName) == 0) ? "> " : "",
+          branchName);
+      git_reference_free(ref);
     }
+    git_branch_iterator_free(it);
   }
   
   HTML("</div>\n");
     
   // Loop over commits
 
-  unsigned int page = 0;
-  {
-  struct mg_str pageStr = mg_http_var(hm->query, mg_str("page"));
-  for (int i = 0; i < pageStr.len; i++) {
-    page *= 10;
-    page += pageStr.ptr[i] - '0';
-  }
-  }
-  if (page == 0) {
-    git_revwalk_reset(walk);
-    git_revwalk_push(walk, git_annotated_commit_id(annotated_commit));
-    git_oid oid;
-    int i = 0;
-    while (GIT_ITEROVER != git_revwalk_next(&oid, walk)) {
-      if (git_oid_equal(git_commit_id(gitcommit), &oid)) {
-        page = i / COMMITS_PER_PAGE + 1;
-        break;
-      }
-      i++;
-    }
-  }
-
   HTML("<div class=\"subbox\" style=\"width: 70%%; overflow-y: scroll;\">\n");
 
-  git_revwalk_reset(walk);
-  git_revwalk_push(walk, git_annotated_commit_id(annotated_commit));
-  
-  unsigned int curPage = 1;
-  unsigned int commitCounter = 0;
-  unsigned int commitTotalCount = 0;
+  unsigned int curPage = MAX(1, (commitTotalCount + COMMITS_PER_PAGE - 1) / COMMITS_PER_PAGE);
 
-  git_oid oid;
-  bool currentCommitFound = false;
-  while (GIT_ITEROVER != git_revwalk_next(&oid, walk))
+  for (size_t i = 0; i < pageOidsLen; i++)
   {
-    if (commitCounter >= COMMITS_PER_PAGE) {
-      commitCounter = 0;
-      curPage++;
-    }
-    commitCounter++;
-    commitTotalCount++;
-
     // get commit message
     git_commit *curCommit;
-    git_commit_lookup(&curCommit, gitrepo, &oid);
+    if (git_commit_lookup(&curCommit, gitrepo, &pageOids[i]) != 0)
+      continue;
 
-    // check found first, from last loop iteration
-    if (currentCommitFound) {
-      gitcommitPrev = curCommit;
-      currentCommitFound = false;
-    }
+    bool currentCommitFound = (pageFrom + i == commitPosition);
 
-    // set here for this iteration for HTML, and for next for setting gitcommitPrev :)
-    if (git_oid_equal(git_commit_id(gitcommit), git_commit_id(curCommit))) {
-      currentCommitFound = true;
-    }
+    HTML("<a href=\"/git/%.*s/%.*s/%.*s/%.*s%s%.*s%s%.*s\">[%.*s] %s%s</a>",
+      repo.len, repo.ptr,
+      branch.len, branch.ptr,
+      OID_SIZE, git_oid_tostr_s(git_commit_id(curCommit)),
+      type.len, type.ptr,
+      path.len > 0 ? "/" : "",
+      path.len, path.ptr,
+      file.len > 0 ? "/" : "",
+      file.len, file.ptr,
+      OID_SIZE, git_oid_tostr_s(git_commit_id(curCommit)),
+      currentCommitFound ? "> " : "",
+      git_commit_message(curCommit));
+    
+    HTML(" (<a href=\"/git/%.*s/%.*s/%.*s/diff\">diff</a>)<br />\n",
+      repo.len, repo.ptr,
+      branch.len, branch.ptr,
+      OID_SIZE, git_oid_tostr_s(git_commit_id(curCommit)));
 
-    if (page == curPage) {
-      HTML("<a href=\"/git/%.*s/%.*s/%.*s/%.*s%s%.*s%s%.*s\">[%.*s] %s%s</a>",
-        repo.len, repo.ptr,
-        branch.len, branch.ptr,
-        OID_SIZE, git_oid_tostr_s(git_commit_id(curCommit)),
-        type.len, type.ptr,
-        path.len > 0 ? "/" : "",
-        path.len, path.ptr,
-        file.len > 0 ? "/" : "",
-        file.len, file.ptr,
-        OID_SIZE, git_oid_tostr_s(git_commit_id(curCommit)),
-        currentCommitFound ? "> " : "",
-        git_commit_message(curCommit));
-      
-      HTML(" (<a href=\"/git/%.*s/%.*s/%.*s/diff\">diff</a>)<br />\n",
-        repo.len, repo.ptr,
-        branch.len, branch.ptr,
-        OID_SIZE, git_oid_tostr_s(git_commit_id(curCommit)));
-    }
+    git_commit_free(curCommit);
   }
   int commitFrom = (page-1)*COMMITS_PER_PAGE+1;
   int commitTo = MIN((page-1)*COMMITS_PER_PAGE+COMMITS_PER_PAGE, commitTotalCount);
@@ -312,310 +575,742 @@ static void serve_git(struct mg_connection *c, struct mg_http_message *hm,
 
   HTML("</div>\n");
   
-  // tree
+  // a diff shows the per-file stats, a file's hunks when it is picked
+  // with ?file=N, up to ?lines=N lines
+  bool isDiff = mg_strcmp(type, mg_str("diff")) == 0;
+  bool renames = false;
+  long fileIdx = -1;
+  size_t maxLines = DIFF_FILE_MAX_LINES;
+  if (isDiff) {
+    char var[16];
+    renames = mg_http_var(hm->query, mg_str("renames")).len > 0;
+    if (mg_http_get_var(&hm->query, "file", var, sizeof(var)) > 0)
+      fileIdx = atol(var);
+    if (mg_http_get_var(&hm->query, "lines", var, sizeof(var)) > 0)
+      maxLines = MAX(atol(var), 1);
+  }
+
+  // tree and blob/diff only depend on the url, the diff parameters above
+  // and the commit (and its predecessor for diffs), so they are cached by
+  // those; other query parameters like ?page don't split the entry
+  struct {
+    git_oid commit, prev;
+    long file;
+    size_t lines;
+    bool renames;
+  } fragmentArgs;
+  memset(&fragmentArgs, 0, sizeof(fragmentArgs));
+  fragmentArgs.commit = *git_commit_id(gitcommit);
+  if (gitcommitPrev != NULL)
+    fragmentArgs.prev = *git_commit_id(gitcommitPrev);
+  fragmentArgs.file = fileIdx;
+  fragmentArgs.lines = maxLines;
+  fragmentArgs.renames = renames;
+  size_t fragmentKeyLen = hm->uri.len + sizeof(fragmentArgs);
+  char *fragmentKey = arena_alloc(a, fragmentKeyLen);
+  memcpy(fragmentKey, hm->uri.ptr, hm->uri.len);
+  memcpy(fragmentKey + hm->uri.len, &fragmentArgs, sizeof(fragmentArgs));
+
+  size_t fragmentLen;
+  const char *fragment = page_cache_get(fragmentKey, fragmentKeyLen, &fragmentLen);
+  if (fragment != NULL) {
+    out_write(o, fragment, fragmentLen);
+    page_cache_release(fragment);
+  }
+  else {
+    out_capture_begin(o, PAGE_CACHE_SIZE / 4);
+
+    git_tree * subtree = commit_subtree(a, gitrepo, gitcommit, pathStr);
 
-  HTML("<div class=\"box\" style=\"height: 20%%; overflow-y: scroll;\">\n");
+    // tree
+
+    if (subtree == NULL) {
+      HTML("<pre>Directory not found :{</pre>\n");
+      goto fragment_done;
+    }
+
+    HTML("<div class=\"box\" style=\"height: 20%%; overflow-y: scroll;\">\n");
   
-  if (path.len > 0)
-  {
-    int lastSlash = 0;
-    for (int i = path.len - 1; i >= 0; i--) {
-      if (path.ptr[i] == '/') {
-        lastSlash = i;
-        break;
+    if (path.len > 0)
+    {
+      int lastSlash = 0;
+      for (int i = path.len - 1; i >= 0; i--) {
+        if (path.ptr[i] == '/') {
+          lastSlash = i;
+          break;
+        }
       }
-    }
 
-    HTML("<a href=\"/git/%.*s/%.*s/%.*s/tree%s%.*s\">[tree] ..</a><br />\n",
-      repo.len, repo.ptr,
-      branch.len, branch.ptr,
-      commit.len, commit.ptr,
-      lastSlash > 0 ? "/" : "",
-      lastSlash, path.ptr,
-      lastSlash);
-  }
+      HTML("<a href=\"/git/%.*s/%.*s/%.*s/tree%s%.*s\">[tree] ..</a><br />\n",
+        repo.len, repo.ptr,
+        branch.len, branch.ptr,
+        commit.len, commit.ptr,
+        lastSlash > 0 ? "/" : "",
+        lastSlash, path.ptr,
+        lastSlash);
+    }
 
-  size_t count = git_tree_entrycount(subtree);
+    size_t count = git_tree_entrycount(subtree);
+
+    // last commit that changed each entry, one index lookup per entry; the
+    // candidates are copied out so the index isn't locked while the rows
+    // are written to a client that may be slow
+    git_oid *lastOids = NULL;
+    size_t *lastLens = NULL;
+    bool lastAtTip = false;
+    const git_oid *tipOid = git_annotated_commit_id(annotated_commit);
+    if (commitPosition >= 0 && commit_index_update_paths(gitrepo, repoStr, branchStr, tipOid, 0)) {
+      struct commit_index *index = commit_index_get(gitrepo, repoStr, branchStr, tipOid);
+      long position = index != NULL ? commit_index_position(index, git_commit_id(gitcommit)) : -1;
+      if (position >= 0) {
+        lastOids = arena_alloc(a, count * LAST_CHANGE_CANDIDATES * sizeof(git_oid));
+        lastLens = arena_alloc(a, count * sizeof(size_t));
+        for (size_t i = 0; i < count; i++) {
+          const char *nameStr = git_tree_entry_name(git_tree_entry_byindex(subtree, i));
+          char *entryPath = arena_printf(a, "%s%s%s", pathStr, path.len > 0 ? "/" : "", nameStr);
+          lastLens[i] = commit_index_last_change(index, entryPath, position,
+            lastOids + i * LAST_CHANGE_CANDIDATES, LAST_CHANGE_CANDIDATES);
+        }
+        // everything in the index is an ancestor of its tip
+        lastAtTip = position == 0;
+      }
+      if (index != NULL)
+        commit_index_put(index);
+    }
 
-  for (int i = 0; i < count; i++)
-  {
-    const git_tree_entry * entry = git_tree_entry_byindex(subtree, i);
+    for (int i = 0; i < count; i++)
+    {
+      const git_tree_entry * entry = git_tree_entry_byindex(subtree, i);
 
-    static const char * tree_entry_type_strings[] = {
-      "",
-      "",
-      "tree",
-      "blob",
-    };
+      static const char * tree_entry_type_strings[] = {
+        "",
+        "",
+        "tree",
+        "blob",
+      };
 
-    const char * nameStr = git_tree_entry_name(entry);
-    const char * typeStr = tree_entry_type_strings[git_tree_entry_type(entry)];
+      const char * nameStr = git_tree_entry_name(entry);
+      const char * typeStr = tree_entry_type_strings[git_tree_entry_type(entry)];
 
-    HTML("<a href=\"/git/%.*s/%.*s/%.*s/%s%s%.*s%s%s\">%s\t%s%s</a>",
-      repo.len, repo.ptr,
-      branch.len, branch.ptr,
-      commit.len, commit.ptr,
-      typeStr,
-      path.len > 0 ? "/" : "",
-      path.len, path.ptr,
-      strlen(nameStr) > 0 ? "/" : "",
-      nameStr,
-      git_tree_entry_type(entry) == GIT_OBJECT_TREE ? "&#x1F4C1" : "&#x1F4C4",
-      (mg_vcmp(&file, nameStr) == 0) ? "> " : "",
-      nameStr);
-    
+      HTML("<a href=\"/git/%.*s/%.*s/%.*s/%s%s%.*s%s%s\">%s\t%s%s</a>",
+        repo.len, repo.ptr,
+        branch.len, branch.ptr,
+        commit.len, commit.ptr,
+        typeStr,
+        path.len > 0 ? "/" : "",
+        path.len, path.ptr,
+        strlen(nameStr) > 0 ? "/" : "",
+        nameStr,
+        git_tree_entry_type(entry) == GIT_OBJECT_TREE ? "&#x1F4C1" : "&#x1F4C4",
+        (mg_vcmp(&file, nameStr) == 0) ? "> " : "",
+        nameStr);
+
+      if (lastOids != NULL) {
+        // the index is in walk order, below the tip the newest candidate
+        // may come from a merged side branch
+        const git_oid *lastOid = NULL;
+        for (size_t k = 0; k < lastLens[i] && lastOid == NULL; k++) {
+          const git_oid *candidate = &lastOids[i * LAST_CHANGE_CANDIDATES + k];
+          if (lastAtTip || git_oid_equal(candidate, git_commit_id(gitcommit)) ||
+              git_graph_descendant_of(gitrepo, git_commit_id(gitcommit), candidate) == 1)
+            lastOid = candidate;
+        }
+        git_commit *lastCommit;
+        if (lastOid != NULL && git_commit_lookup(&lastCommit, gitrepo, lastOid) == 0) {
+          char date[32];
+          time_t t = git_commit_time(lastCommit);
+          struct tm tm;
+          strftime(date, sizeof(date), "%Y-%m-%d", gmtime_r(&t, &tm));
+          HTML(" <a href=\"/git/%.*s/%.*s/%.*s/diff\" style=\"color: grey;\">%s ",
+            repo.len, repo.ptr,
+            branch.len, branch.ptr,
+            OID_SIZE, git_oid_tostr_s(lastOid),
+            date);
+          const char *summary = git_commit_summary(lastCommit);
+          if (summary != NULL)
+            out_escape(o, summary, strlen(summary));
+          HTML("</a>");
+          git_commit_free(lastCommit);
+        }
+      }
     
-    HTML("<br />\n");
-  }
+      HTML("<br />\n");
+    }
   
-  HTML("</div>\n");
+    HTML("</div>\n");
   
-  // blob
+    // blob
 
-  if (mg_strcmp(type, mg_str("blob")) == 0)
-  {
-    static char fileStr[128]; snprintf(fileStr, 128, "%.*s", file.len, file.ptr);
-    const git_tree_entry * entry = git_tree_entry_byname(subtree, fileStr);
-
-    if (git_tree_entry_type(entry) == GIT_OBJECT_BLOB) {
-      git_blob *blob;
-      int res =
-        git_tree_entry_to_object((git_object**)&blob, gitrepo, entry);
-
-      if (res == 0) {
-        git_object_size_t rawsize = (int)git_blob_rawsize(blob);
-        const void * rawcontent = git_blob_rawcontent(blob);
-        bool isBinary = git_blob_is_binary(blob);
-
-        if (! isBinary) {
-          HTML("<pre style=\"height: calc(70%% - 46px); margin: 10px;\">"
-               "<div readonly class=\"diff\">");
-
-          struct { char c; const char *replacement; }
-          replacements[] = {
-              {'<', "&lt;"},
-              {'>', "&gt;"},
-              {'&', "&amp;"},
-          };
-
-          for (int i = 0; i < rawsize; i++)
-          {
-            char c = ((char *)rawcontent)[i];
-            bool replaced = false;
-            for (int j = 0; j < sizeof(replacements) / sizeof(replacements[0]); j++)
-            {
-              if (replacements[j].c == c)
-              {
-                size_t len = strlen(replacements[j].replacement);
-                memcpy(html + html_len, replacements[j].replacement, len);
-                html_len += len;
-
-                replaced = true;
-                break;
-              }
-            }
-            if (!replaced)
-              html[html_len++] = c;
+    if (mg_strcmp(type, mg_str("blob")) == 0)
+    {
+      const git_tree_entry * entry = git_tree_entry_byname(subtree, fileStr);
+
+      if (entry == NULL) {
+        HTML("<pre>File not found :{</pre>\n");
+      }
+      else if (git_tree_entry_type(entry) == GIT_OBJECT_BLOB) {
+        git_blob *blob = NULL;
+        uint64_t start = metrics_now();
+        int res =
+          git_tree_entry_to_object((git_object**)&blob, gitrepo, entry);
+        metrics_git(METRICS_GIT_BLOB, start);
+        arena_track(a, blob, (arena_free_fn) git_blob_free);
+
+        if (res == 0) {
+          git_object_size_t rawsize = (int)git_blob_rawsize(blob);
+          const void * rawcontent = git_blob_rawcontent(blob);
+          bool isBinary = git_blob_is_binary(blob);
+
+          if (! isBinary) {
+            HTML("<pre style=\"height: calc(70%% - 46px); margin: 10px;\">"
+                 "<div readonly class=\"diff\">");
+
+            highlight_blob(o, git_blob_id(blob), fileStr, rawcontent, rawsize);
+
+            HTML("</div></pre>\n");
+          }
+          else {
+            HTML("<pre>Binary file, <a href=\"/git/%.*s/%.*s/%.*s/raw%s%.*s/%.*s\">open raw</a></pre>\n",
+              repo.len, repo.ptr,
+              branch.len, branch.ptr,
+              commit.len, commit.ptr,
+              path.len > 0 ? "/" : "",
+              path.len, path.ptr,
+              file.len, file.ptr);
           }
-          HTML("</div></pre>\n");
         }
         else {
-          HTML("<pre>Binary file :[</pre>\n");
+          HTML("<pre>File not found :{</pre>\n");
         }
       }
       else {
-        HTML("<pre>File not found :{</pre>\n");
-      }
-    }
-    else {
-      switch (git_tree_entry_type(entry)) {
-        	case GIT_OBJECT_ANY:       HTML("<pre> Error loading GIT_OBJECT_ANY! >:( </pre>\n"); break;
-          case GIT_OBJECT_INVALID:   HTML("<pre> Error loading GIT_OBJECT_INVALID! >:( </pre>\n"); break;
-          case GIT_OBJECT_COMMIT:    HTML("<pre> Error loading GIT_OBJECT_COMMIT! >:( </pre>\n"); break;
-          case GIT_OBJECT_TREE:      HTML("<pre> Error loading GIT_OBJECT_TREE! >:( </pre>\n"); break;
-          case GIT_OBJECT_BLOB:      HTML("<pre> Error loading GIT_OBJECT_BLOB! >:( </pre>\n"); break;
-          case GIT_OBJECT_TAG:       HTML("<pre> Error loading GIT_OBJECT_TAG! >:( </pre>\n"); break;
-          case GIT_OBJECT_OFS_DELTA: HTML("<pre> Error loading GIT_OBJECT_OFS_DELTA! >:( </pre>\n"); break;
-          case GIT_OBJECT_REF_DELTA: HTML("<pre> Error loading GIT_OBJECT_REF_DELTA! >:( </pre>\n"); break;
+        switch (git_tree_entry_type(entry)) {
+          	case GIT_OBJECT_ANY:       HTML("<pre> Error loading GIT_OBJECT_ANY! >:( </pre>\n"); break;
+            case GIT_OBJECT_INVALID:   HTML("<pre> Error loading GIT_OBJECT_INVALID! >:( </pre>\n"); break;
+            case GIT_OBJECT_COMMIT:    HTML("<pre> Error loading GIT_OBJECT_COMMIT! >:( </pre>\n"); break;
+            case GIT_OBJECT_TREE:      HTML("<pre> Error loading GIT_OBJECT_TREE! >:( </pre>\n"); break;
+            case GIT_OBJECT_BLOB:      HTML("<pre> Error loading GIT_OBJECT_BLOB! >:( </pre>\n"); break;
+            case GIT_OBJECT_TAG:       HTML("<pre> Error loading GIT_OBJECT_TAG! >:( </pre>\n"); break;
+            case GIT_OBJECT_OFS_DELTA: HTML("<pre> Error loading GIT_OBJECT_OFS_DELTA! >:( </pre>\n"); break;
+            case GIT_OBJECT_REF_DELTA: HTML("<pre> Error loading GIT_OBJECT_REF_DELTA! >:( </pre>\n"); break;
+        }
       }
     }
-  }
-  else if (mg_strcmp(type, mg_str("diff")) == 0) {
-    if (gitcommitPrev != NULL) {
-      git_diff * diff;
-      git_tree * commitTreePrev;
-      git_tree * subtreePrev;
-      git_commit_tree(&commitTreePrev, gitcommitPrev);
-      if (path.len == 0) {
-        subtreePrev = commitTreePrev;
+    else if (isDiff) {
+      // a directory that didn't exist before diffs against nothing
+      git_tree * subtreePrev = NULL;
+      if (gitcommitPrev != NULL)
+        subtreePrev = commit_subtree(a, gitrepo, gitcommitPrev, pathStr);
+
+      // the byte cap grows with the line cap, otherwise files with long
+      // lines would stop at the same place on every "load more"
+      size_t bytesPerLine = DIFF_FILE_MAX_BYTES / DIFF_FILE_MAX_LINES;
+      size_t maxBytes = DIFF_FILE_MAX_BYTES;
+      if (maxLines > DIFF_FILE_MAX_LINES)
+        maxBytes = maxLines < SIZE_MAX / bytesPerLine ? maxLines * bytesPerLine : SIZE_MAX;
+      const char *renamesArg = renames ? "&renames=1" : "";
+
+      HTML("<pre style=\"height: calc(70%% - 46px); margin: 10px;\">"
+           "<div readonly class=\"diff\">");
+
+      const struct diff_summary *summary = diff_cache_get(gitrepo, subtreePrev, subtree, renames);
+      if (summary != NULL) {
+        HTML("%zu files changed, <span style=\"color: green;\">+%zu</span> <span style=\"color: red;\">-%zu</span> "
+             "(<a href=\"?%s\">%s renames</a>)\n\n",
+          summary->files_len, summary->additions, summary->deletions,
+          renames ? "" : "renames=1", renames ? "ignore" : "detect");
+
+        for (size_t i = 0; i < summary->files_len && ! o->failed; i++) {
+          const struct diff_file *f = &summary->files[i];
+          if (f->large)
+            HTML("%c <span style=\"color: grey;\">%*s</span> ", git_diff_status_char(f->status), 15, "large");
+          else
+            HTML("%c <span style=\"color: green;\">+%*zu</span> <span style=\"color: red;\">-%*zu</span> ",
+              git_diff_status_char(f->status), 6, f->additions, 6, f->deletions);
+          HTML("<a href=\"?file=%zu%s#file%zu\" id=\"file%zu\">", i, renamesArg, i, i);
+          if (f->status == GIT_DELTA_RENAMED || f->status == GIT_DELTA_COPIED) {
+            out_escape(o, f->old_path, strlen(f->old_path));
+            HTML(" -&gt; ");
+          }
+          out_escape(o, f->new_path, strlen(f->new_path));
+          HTML("</a>%s\n", f->binary ? " (binary)" : "");
+
+          if (i != fileIdx)
+            continue;
+          git_patch *patch;
+          if (diff_cache_patch(&patch, gitrepo, subtreePrev, subtree, renames, f) == 0 && patch != NULL) {
+            HTML("\n");
+            if (! print_patch(o, patch, maxLines, maxBytes))
+              HTML("<a href=\"?file=%zu&lines=%zu%s#file%zu\">load more</a>\n", i, maxLines * 2, renamesArg, i);
+            HTML("\n");
+            git_patch_free(patch);
+          }
+        }
+        diff_cache_release(summary);
       }
       else {
-        const git_tree_entry * pathEntry = git_tree_entry_byname(commitTreePrev, pathStr);
-        git_tree_lookup(&subtreePrev, gitrepo, git_tree_entry_id(pathEntry));
+        HTML("Error diffing :(\n");
       }
 
-      git_diff_tree_to_tree(&diff, gitrepo, subtreePrev, subtree, NULL);
-      struct {
-        char *html;
-        int *html_len;
-      } userdata;
-      userdata.html = html;
-      userdata.html_len = &html_len;
-
-      HTML("<pre style=\"height: calc(70%% - 46px); margin: 10px;\">"
-           "<div readonly class=\"diff\">");
-      
-      git_diff_print(diff, GIT_DIFF_FORMAT_PATCH, gitDiffPrintCb, &userdata);
-      
       HTML("</div></pre>\n");
     }
-    else {
-      git_diff * diff;
-      git_diff_tree_to_tree(&diff, gitrepo, NULL, subtree, NULL);
-      struct {
-        char *html;
-        int *html_len;
-      } userdata;
-      userdata.html = html;
-      userdata.html_len = &html_len;
 
-      HTML("<pre style=\"height: calc(70%% - 46px); margin: 10px;\">"
-           "<div readonly class=\"diff\">");
-      
-      git_diff_print(diff, GIT_DIFF_FORMAT_PATCH, gitDiffPrintCb, &userdata);
-      
-      HTML("</div></pre>\n");
-    }
+  fragment_done:
+    ;
+    // captures that grew too big for the cache or were cut short are dropped
+    size_t capturedLen;
+    char *captured = out_capture_end(o, &capturedLen);
+    if (captured != NULL && ! o->failed)
+      page_cache_put(fragmentKey, fragmentKeyLen, captured, capturedLen);
+    free(captured);
   }
-  
+
   HTML("</body>\n</html>");
 
   #undef HTML
 
-  mg_http_reply(c, 200, NULL, "%s", html);
+  out_end(o);
+}
+// mg_url_encode for each segment of a path, the slashes stay
+static void url_encode_path(const char *path, char *buf, size_t len) {
+  size_t n = 0;
+  buf[0] = '\0';
+  while (n + 1 < len) {
+    size_t segment = strcspn(path, "/");
+    n += mg_url_encode(path, segment, buf + n, len - n);
+    if (path[segment] == '\0' || n + 2 > len)
+      break;
+    buf[n++] = '/';
+    buf[n] = '\0';
+    path += segment + 1;
+  }
+}
+static bool search_hit_cb(void *arg, const char *repo, const char *branch, const git_oid *commit,
+  const char *path, size_t lineNo, const char *line, size_t lineLen)
+{
+  struct out *o = arg;
+  // names come from the repositories, anything can be in them
+  char repoHref[3 * 256 + 1], branchHref[3 * 256 + 1], pathHref[3 * 4096 + 1];
+  mg_url_encode(repo, strlen(repo), repoHref, sizeof(repoHref));
+  mg_url_encode(branch, strlen(branch), branchHref, sizeof(branchHref));
+  url_encode_path(path, pathHref, sizeof(pathHref));
+  out_printf(o, "<a href=\"/git/%s/%s/%.*s/blob/%s\">", repoHref, branchHref, OID_SIZE, git_oid_tostr_s(commit), pathHref);
+  out_escape(o, repo, strlen(repo));
+  out_write(o, ": ", 2);
+  out_escape(o, path, strlen(path));
+  out_printf(o, "</a>:%zu ", lineNo);
+  out_escape(o, line, MIN(lineLen, 512));
+  out_write(o, "\n", 1);
+  return ! o->failed;
+}
+// /search?q=...&regex=1&repo=name.git, runs on a worker thread
+static void serve_search(struct out *o, struct mg_http_message *hm, void *arg)
+{
+  const char *root = arg;
+  char query[256] = "", repo[256] = "";
+  mg_http_get_var(&hm->query, "q", query, sizeof(query));
+  mg_http_get_var(&hm->query, "repo", repo, sizeof(repo));
+  bool regex = mg_http_var(hm->query, mg_str("regex")).len > 0;
+  // no way out of root
+  if (strchr(repo, '/') != NULL || strcmp(repo, "..") == 0 || strcmp(repo, ".") == 0)
+    repo[0] = '\0';
+
+  out_set_encoding(o, compress_negotiate(hm, "text/html"));
+  out_begin(o, 200, "Cache-Control: no-cache\r\n");
+
+  #define HTML(...) out_printf(o, __VA_ARGS__)
+
+  HTML(
+    "<html>\n"
+    "<head>\n"
+    "<style>"
+    "body { font-family: monospace; margin: 10px; }"
+    "</style>\n"
+    "</head>\n"
+    "<body>\n"
+    "<a href=\"/git\">git</a> "
+    "<form method=\"GET\" style=\"display: inline-block;\">"
+    "<input type=\"text\" name=\"q\" value=\""
+  );
+  out_escape_attribute(o, query, strlen(query));
+  HTML("\" /> <input type=\"hidden\" name=\"repo\" value=\"");
+  out_escape_attribute(o, repo, strlen(repo));
+  HTML("\" /> <label><input type=\"checkbox\" name=\"regex\" value=\"1\" %s /> regex</label> "
+       "<input type=\"submit\" value=\"search\" /></form>\n"
+       "<pre>", regex ? "checked" : "");
+
+  if (query[0] != '\0') {
+    int hits = search_run(root, repo[0] != '\0' ? repo : NULL, query, regex, search_hit_cb, o);
+    if (hits == -2)
+      HTML("Query too short to search all repositories, pick one :(\n");
+    else if (hits < 0)
+      HTML("Invalid regex :(\n");
+    else if (hits == 0)
+      HTML("Nothing found :(\n");
+    else if (hits >= SEARCH_MAX_HITS)
+      HTML("\nStopped after %d hits\n", hits);
+  }
+
+  HTML("</pre>\n</body>\n</html>");
+
+  #undef HTML
+
+  out_end(o);
+}
+// route class of a /git/<repo>/<branch>/<commit>/<type>/... url
+static enum metrics_route git_route(struct mg_http_message *hm) {
+  int slashes = 0;
+  size_t i = 0;
+  while (i < hm->uri.len && slashes < 5)
+    if (hm->uri.ptr[i++] == '/')
+      slashes++;
+  struct mg_str type = mg_str_n(hm->uri.ptr + i, hm->uri.len - i);
+  /**/ if (type.len >= 4 && strncmp(type.ptr, "tree", 4) == 0) return METRICS_ROUTE_GIT_TREE;
+  else if (type.len >= 4 && strncmp(type.ptr, "blob", 4) == 0) return METRICS_ROUTE_GIT_BLOB;
+  else if (type.len >= 3 && strncmp(type.ptr, "raw", 3) == 0)  return METRICS_ROUTE_GIT_BLOB;
+  else if (type.len >= 4 && strncmp(type.ptr, "diff", 4) == 0) return METRICS_ROUTE_GIT_DIFF;
+  return METRICS_ROUTE_OTHER;
+}
+// route class of a request, for metrics and admission control
+static enum metrics_route request_route(const struct route *r, struct mg_http_message *hm) {
+  switch (r != NULL ? r->kind : -1) {
+    case ROUTE_FILE:
+    case ROUTE_DIR:     return METRICS_ROUTE_STATIC;
+    case ROUTE_MEDIA:   return METRICS_ROUTE_MEDIA;
+    case ROUTE_ARCHIVE: return METRICS_ROUTE_ARCHIVE;
+    case ROUTE_SEARCH:  return METRICS_ROUTE_SEARCH;
+    case ROUTE_GIT:
+      if (smart_http_match(hm))
+        return METRICS_ROUTE_GIT_CLONE;
+      if (mg_http_match_uri(hm, "/git/*/*/*/*#"))
+        return git_route(hm);
+      return METRICS_ROUTE_GIT_INDEX;
+    default:            return METRICS_ROUTE_OTHER;
+  }
+}
+// the worker queue is full, counted like an admission refusal since the
+// request never gets to metrics_request
+static void reply_busy(struct mg_connection *c, enum metrics_route route) {
+  metrics_refused(route, METRICS_REFUSED_OVERLOAD);
+  mg_http_reply(c, 503, "Retry-After: 5\r\n", "Too busy, try again in a bit :(\n");
+}
+// worker entry points, timed from the moment a worker picks them up
+static void serve_git_job(struct out *o, struct mg_http_message *hm, void *arg) {
+  // one per worker thread, emptied after every page
+  static __thread struct arena *arena = NULL;
+  if (arena == NULL)
+    arena = arena_new();
+  uint64_t start = metrics_now();
+  serve_git(o, hm, arg, arena);
+  arena_reset(arena);
+  metrics_request(git_route(hm), start);
+}
+static void serve_clone_job(struct out *o, struct mg_http_message *hm, void *arg) {
+  uint64_t start = metrics_now();
+  smart_http_serve(o, hm, arg);
+  metrics_request(METRICS_ROUTE_GIT_CLONE, start);
+}
+static void serve_archive_job(struct out *o, struct mg_http_message *hm, void *arg) {
+  uint64_t start = metrics_now();
+  archive_serve(o, hm, arg);
+  metrics_request(METRICS_ROUTE_ARCHIVE, start);
+}
+static void serve_search_job(struct out *o, struct mg_http_message *hm, void *arg) {
+  uint64_t start = metrics_now();
+  serve_search(o, hm, arg);
+  metrics_request(METRICS_ROUTE_SEARCH, start);
+}
+static void serve_git_index(struct mg_connection *c, struct mg_http_message *hm) {
+  size_t len;
+  enum encoding encoding = compress_negotiate(hm, "text/html");
+  const char *html = catalog_html(&encoding, &len);
+  mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=utf-8\r\n"
+    "%s%s%sVary: Accept-Encoding\r\nContent-Length: %zu\r\n\r\n",
+    encoding != ENCODING_IDENTITY ? "Content-Encoding: " : "",
+    encoding != ENCODING_IDENTITY ? compress_encoding_name(encoding) : "",
+    encoding != ENCODING_IDENTITY ? "\r\n" : "", len);
+  mg_send(c, html, len);
+}
+// 127.0.0.0/8, ::1 or an IPv4 one mapped into IPv6
+static bool is_loopback(const struct mg_addr *a) {
+  static const uint8_t mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+  static const uint8_t loopback6[16] = { [15] = 1 };
+  const uint8_t *ip4 = (const uint8_t *) &a->ip;
+  if (a->is_ip6) {
+    if (memcmp(a->ip6, loopback6, sizeof(loopback6)) == 0)
+      return true;
+    if (memcmp(a->ip6, mapped, sizeof(mapped)) != 0)
+      return false;
+    ip4 = a->ip6 + 12;
+  }
+  return ip4[0] == 127;
+}
+
+// No access control of its own, so only for scrapers on the same host
+static void serve_metrics(struct mg_connection *c) {
+  if (! is_loopback(&c->rem)) {
+    mg_http_reply(c, 404, NULL, "Not found :(\n");
+    return;
+  }
+  size_t len;
+  char *text = metrics_render(&len);
+  mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+  mg_send(c, text, len);
+  free(text);
+}
+// from -g or the git route, NULL if there is none
+static const char *git_root = NULL;
+// from -l
+static bool use_tls = true;
+// set by SIGHUP, routes and certificate are reloaded by the event loop
+static volatile sig_atomic_t reload_config = false;
+
+static void sighup_handler(int sig) {
+  reload_config = true;
 }
+
+// last activity of a connection, kept in its label
+static void touch_conn(struct mg_connection *c) {
+  uint64_t now = mg_millis();
+  memcpy(c->label, &now, sizeof(now));
+}
+static void idle_timer_fn(void *arg) {
+  struct mg_mgr *mgr = arg;
+  uint64_t now = mg_millis();
+  for (struct mg_connection *c = mgr->conns; c != NULL; c = c->next) {
+    uint64_t last;
+    memcpy(&last, c->label, sizeof(last));
+    if (c->is_accepted && c->send.len == 0 && now - last > KEEPALIVE_IDLE_MS && ! workers_busy(c) && ! media_busy(c))
+      c->is_closing = 1;
+  }
+}
+
 static void fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+  if (ev == MG_EV_WRITE || ev == MG_EV_POLL || ev == MG_EV_CLOSE) {
+    workers_conn_event(c, ev);
+    media_conn_event(c, ev);
+  }
+  if (ev == MG_EV_WRITE)
+    metrics_bytes_sent(*(long *) ev_data);
+  if (ev == MG_EV_READ || ev == MG_EV_WRITE)
+    touch_conn(c);
+  if (ev == MG_EV_CLOSE && c->is_accepted)
+    metrics_connections(-1);
   if (ev == MG_EV_ACCEPT) {
-    struct mg_tls_opts opts = {
-      .cert = "./certs/cert1.pem",
-      .certkey = "./certs/privkey1.pem",
-    };
-    mg_tls_init(c, &opts);
+    metrics_connections(1);
+    touch_conn(c);
+    // responses go out in several small sends, don't let them wait for acks
+    int one = 1;
+    setsockopt((int) (size_t) c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    // the shared context from tls_init, see tls.c
+    if (use_tls)
+      mg_tls_init(c, NULL);
   }
   if (ev == MG_EV_HTTP_MSG) {
     struct mg_http_message *hm = (struct mg_http_message *) ev_data;
-    //printf("serving %.*s\n", hm->message.len, hm->message.ptr);
 
-    /**/ if (mg_http_match_uri(hm, "/")) {
-      serve_html(c, hm, "html/index.html");
-    }
-    else if (mg_http_match_uri(hm, "/html/style.css")) {
-      serve_css(c, hm, "html/style.css");
-    }
-    else if (mg_http_match_uri(hm, "/portfolio")) {
-      serve_html(c, hm, "html/portfolio.html");
-    }
-
-    else if (mg_http_match_uri(hm, "/projects/sensor/slides")) {
-      serve_html(c, hm, "projects/sensor/Vortrag.pdf");
-    }
-    else if (strncmp(hm->uri.ptr, "/lol", 4) == 0) {
-      static struct mg_http_serve_opts opts;
-      opts.root_dir = "/lol=/mnt/hdd/obs";
-      mg_http_serve_dir(c, hm, &opts);
-    }
-    else if (strncmp(hm->uri.ptr, "/clips", 4) == 0) {
-      static struct mg_http_serve_opts opts;
-      opts.root_dir = "/clips=/mnt/hdd/clips";
-      mg_http_serve_dir(c, hm, &opts);
-    }
-    else if (strncmp(hm->uri.ptr, "/share", 6) == 0) {
-      static struct mg_http_serve_opts opts;
-      opts.root_dir = "/share=/mnt/hdd/";
-      mg_http_serve_dir(c, hm, &opts);
-    }
-    // else if (mg_http_match_uri(hm, "/git")) {
-    //   mg_http_reply(c, 307, "Location: https://patdog.de/git/HEAD\r\n", "");
-    // }
-    else if (mg_http_match_uri(hm, "/git/*/*/*/*#")) {
-      serve_git(c, hm, "/home/pi/git");
-    }
-    else if (mg_http_match_uri(hm, "/git#")) {
-      static char html[1024*10];
-      int htmlSize = 0;
-      htmlSize += snprintf(html + htmlSize, 1024*10 - htmlSize, "<html>\n");
-      FILE * f = popen("ls -t /home/pi/git | grep \\\\.git", "r");
-      char name[128];
-      while (fscanf(f, "%127[^\n]\n", name) == 1)
-        htmlSize += snprintf(html + htmlSize, 1024*10 - htmlSize, "<a href=\"/git/%s/main/HEAD/tree\">%s</a><br />\n", name, name);
-      htmlSize += snprintf(html + htmlSize, 1024*10 - htmlSize, "</html>\n");
-      pclose(f);
-
-      mg_http_reply(c, 200, NULL, "%s", html);
-    }
-    //else if (strncmp(hm->uri.ptr, "/hdd", 4) == 0) {
-    //  static struct mg_http_serve_opts opts;
-    //  opts.root_dir = "/hdd=/mnt/hdd";
-    //  mg_http_serve_dir(c, hm, &opts);
-    //}
-    else if (mg_http_match_uri(hm, "/projects/sensor/pdf")) {
-      serve_html(c, hm, "projects/sensor/AusarbeitungSensornetze.pdf");
-    }
-
-    else if (mg_http_match_uri(hm, "/projects/ba")) {
-      serve_html(c, hm, "projects/ba/Thesis.pdf");
+    // pipelined requests would interleave with a response still being sent
+    if (workers_busy(c) || media_busy(c)) {
+      c->is_closing = 1;
+      return;
     }
+    //printf("serving %.*s\n", hm->message.len, hm->message.ptr);
 
-    else if (mg_http_match_uri(hm, "/projects/bezier")) {
-      serve_html(c, hm, "projects/bezier/index.html");
+    // media only counts until the transfer is set up, workers time themselves
+    uint64_t start = metrics_now();
+    enum metrics_route route = METRICS_ROUTE_STATIC;
+
+    const struct route *r = routes_match(hm->uri);
+    enum metrics_route requestRoute = request_route(r, hm);
+    unsigned retryAfter;
+    enum admission_verdict verdict = admission_check(c, requestRoute, workers_pending(), &retryAfter);
+    if (verdict != ADMISSION_OK) {
+      char headers[64];
+      snprintf(headers, sizeof(headers), "Retry-After: %u\r\n", retryAfter);
+      if (verdict == ADMISSION_RATE)
+        mg_http_reply(c, 429, headers, "Too many requests, slow down a bit :(\n");
+      else
+        mg_http_reply(c, 503, headers, "Too busy, try again in a bit :(\n");
+      return;
     }
 
-    else if (mg_http_match_uri(hm, "/projects/ik")) {
-      serve_html(c, hm, "projects/ik/index.html");
-    }
-    
-    else if (mg_http_match_uri(hm, "/projects/sss/exposee")) {
-      serve_html(c, hm, "projects/sss/Exposee.pdf");
-    }
-    else if (mg_http_match_uri(hm, "/projects/sss/pdf")) {
-      serve_html(c, hm, "projects/sss/RealtimeSubsurfaceScattering.pdf");
-    }
-    
-    else if (mg_http_match_uri(hm, "/projects/se/slides")) {
-      serve_html(c, hm, "projects/se/Presentation_Symbolic_Execution.pdf");
-    }
-    else if (mg_http_match_uri(hm, "/projects/se/pdf")) {
-      serve_html(c, hm, "projects/se/Symbolic_Execution_Paper_Preview.pdf");
-    }
-
-    else if (mg_http_match_uri(hm, "/projects/cloth")) {
-      serve_html(c, hm, "projects/cloth/index.html");
-    }
-    else if (mg_http_match_uri(hm, "/projects/cloth/pdf")) {
-      serve_pdf(c, hm, "projects/cloth/pdf/Cloth_simulation_Paper.pdf");
-    }
-    else if (mg_http_match_uri(hm, "/projects/cloth/*/*")) {
-      serve_dir(c, hm, ".");
+    switch (r != NULL ? r->kind : -1) {
+      case ROUTE_FILE:
+        static_cache_serve(c, hm, r->file);
+        break;
+      case ROUTE_DIR:
+        serve_dir(c, hm, r->target);
+        break;
+      case ROUTE_MEDIA:
+        route = METRICS_ROUTE_MEDIA;
+        media_serve(c, hm, r->url, r->target);
+        break;
+      case ROUTE_GIT:
+        // a git line added by a reload, the directory is only read at startup
+        if (git_root == NULL) {
+          route = METRICS_ROUTE_OTHER;
+          mg_http_reply(c, 404, NULL, "Not found :(\n");
+          break;
+        }
+        if (smart_http_match(hm)) {
+          route = METRICS_ROUTES;
+          if (! workers_submit(c, hm, serve_clone_job, (void *) git_root))
+            reply_busy(c, requestRoute);
+        }
+        else if (mg_http_match_uri(hm, "/git/*/*/*/*#")) {
+          route = METRICS_ROUTES;
+          if (! workers_submit(c, hm, serve_git_job, (void *) git_root))
+            reply_busy(c, requestRoute);
+        }
+        else {
+          route = METRICS_ROUTE_GIT_INDEX;
+          serve_git_index(c, hm);
+        }
+        break;
+      case ROUTE_ARCHIVE:
+        route = METRICS_ROUTE_ARCHIVE;
+        if (git_root == NULL) {
+          mg_http_reply(c, 404, NULL, "Not found :(\n");
+          break;
+        }
+        // cached ones go out with sendfile right away
+        if (archive_serve_cached(c, hm, git_root))
+          break;
+        route = METRICS_ROUTES;
+        if (! workers_submit(c, hm, serve_archive_job, (void *) git_root))
+          reply_busy(c, requestRoute);
+        break;
+      case ROUTE_SEARCH:
+        if (git_root == NULL) {
+          route = METRICS_ROUTE_OTHER;
+          mg_http_reply(c, 404, NULL, "Not found :(\n");
+          break;
+        }
+        route = METRICS_ROUTES;
+        if (! workers_submit(c, hm, serve_search_job, (void *) git_root))
+          reply_busy(c, requestRoute);
+        break;
+      case ROUTE_METRICS:
+        route = METRICS_ROUTE_OTHER;
+        serve_metrics(c);
+        break;
+      case ROUTE_COMMAND:
+        route = METRICS_ROUTE_OTHER;
+        printf("running %s\n", r->target);
+        system(r->target);
+        mg_http_reply(c, 200, NULL, "Done\n");
+        break;
+      default:
+        route = METRICS_ROUTE_OTHER;
+        mg_http_reply(c, 404, NULL, "Not found :(\n");
+        break;
     }
 
-    else if (mg_http_match_uri(hm, "/wol")) {
-      system("/home/pi/wol.sh");
-      puts("Sending WoL");
-      mg_http_reply(c, 200, NULL, "WoL sent");
-    }
+    if (route != METRICS_ROUTES)
+      metrics_request(route, start);
   }
 }
 
 int main(int argc, char *argv[]) {
+  int workerThreads = WORKER_THREADS;
+  int workerQueueDepth = WORKER_QUEUE_DEPTH;
+  int compressLevel = COMPRESS_LEVEL;
+  const char *listenUrl = LISTEN_URL;
+  const char *routesFile = ROUTES_FILE;
+  double rateLimit = RATE_LIMIT;
+  double rateBurst = RATE_BURST;
+  int gitRenderLimit = GIT_RENDER_LIMIT;
+  int prerenderBudget = PRERENDER_BUDGET_PERCENT;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "w:q:z:l:g:c:r:b:j:p:")) != -1) {
+    switch (opt) {
+      case 'c': routesFile = optarg; break;
+      case 'l': listenUrl = optarg; break;
+      case 'g': git_root = optarg; break;
+      case 'w': workerThreads = atoi(optarg); break;
+      case 'q': workerQueueDepth = atoi(optarg); break;
+      case 'z': compressLevel = atoi(optarg); break;
+      case 'r': rateLimit = atof(optarg); break;
+      case 'b': rateBurst = atof(optarg); break;
+      case 'j': gitRenderLimit = atoi(optarg); break;
+      case 'p': prerenderBudget = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-w worker threads] [-q worker queue depth] [-z compression level] [-l listen url] [-g git root] [-c routes file] [-r requests/s per client] [-b burst] [-j git render limit] [-p prerender budget %%]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (! routes_load(routesFile))
+    return 1;
+  const struct route *gitRoute = routes_find(ROUTE_GIT);
+  if (git_root == NULL && gitRoute != NULL)
+    git_root = strdup(gitRoute->target);
+  signal(SIGHUP, sighup_handler);
+
+  git_libgit2_init();
+  compress_init(compressLevel);
+  commit_index_init(COMMIT_INDEX_DIR);
+  search_init(SEARCH_INDEX_DIR);
+  smart_http_init(PACK_CACHE_DIR);
+  archive_init(ARCHIVE_CACHE_DIR);
+  page_cache_init(PAGE_CACHE_SIZE, PAGE_CACHE_DIR);
+
   struct mg_mgr mgr;
   mg_mgr_init(&mgr);
 
-  mg_http_listen(&mgr, "[::]:443", fn, &mgr);
+  workers_init(&mgr, workerThreads, workerQueueDepth);
+  admission_init(rateLimit, rateBurst, gitRenderLimit);
+  dir_cache_init(&mgr);
+  // before the catalog, which queues every branch it loads
+  if (git_root != NULL)
+    prerender_init(&mgr, prerenderBudget);
+  if (git_root != NULL)
+    catalog_init(&mgr, git_root);
+
+  use_tls = strstr(listenUrl, "://") == NULL || strncmp(listenUrl, "https://", 8) == 0;
+  if (use_tls && ! tls_init(&mgr, TLS_CERT, TLS_KEY))
+    return 1;
+  mg_timer_add(&mgr, KEEPALIVE_IDLE_MS / 4, MG_TIMER_REPEAT, idle_timer_fn, &mgr);
+  if (mg_http_listen(&mgr, listenUrl, fn, &mgr) == NULL) {
+    fprintf(stderr, "cannot listen on %s\n", listenUrl);
+    return 1;
+  }
 
-  while (true)
+  while (true) {
     mg_mgr_poll(&mgr, 1000);
+    if (reload_config) {
+      reload_config = false;
+      if (use_tls)
+        tls_reload();
+      // a bad file keeps the old routes
+      if (routes_load(routesFile))
+        printf("reloaded %s\n", routesFile);
+      gitRoute = routes_find(ROUTE_GIT);
+      if (gitRoute != NULL && git_root != NULL && strcmp(gitRoute->target, git_root) != 0)
+        printf("git root changes need a restart, still serving %s\n", git_root);
+    }
+  }
 
+  workers_stop();
+  // the catalog thread queues branches for warming
+  catalog_free();
+  prerender_stop();
   mg_mgr_free(&mgr);
+  media_free();
+  dir_cache_free();
+  static_cache_free();
+  routes_free();
+  tls_free();
+  diff_cache_free();
+  search_free();
+  smart_http_free();
+  archive_free();
+  page_cache_free();
+  commit_index_free();
+  repo_cache_free();
+  metrics_free();
+  git_libgit2_shutdown();
   return 0;
 }
 
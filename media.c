@@ -0,0 +1,425 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#include "media.h"
+#include "metrics.h"
+#include "dir_cache.h"
+
+
+#define MIN(a,b) (a<b?a:b)
+#define FD(c) ((int) (size_t) (c)->fd)
+#define BOUNDARY "gitserve-byteranges"
+
+// Open files, so seeking around in a video doesn't reopen and stat the
+// file for every range request. Only used from the event loop.
+struct file {
+  char *path;
+  int fd;
+  struct stat st;
+  int refs;
+  uint64_t checked;
+  uint64_t last_used;
+};
+
+// A response body is a list of segments: multipart headers from memory
+// and byte ranges of the file.
+struct segment {
+  char *data;
+  off_t start, end; // file range [start, end) if data is NULL
+};
+
+struct transfer {
+  struct transfer *next;
+  struct mg_connection *c;
+  struct file *file;
+  struct segment segments[2 * MEDIA_MAX_RANGES + 1];
+  int segments_len;
+  int cur;
+  off_t pos; // offset into the current segment
+};
+
+static struct file files[MEDIA_FD_CACHE_SIZE];
+static struct transfer *transfers = NULL;
+static char read_buf[MEDIA_READ_SIZE];
+
+
+static void file_close(struct file *f) {
+  close(f->fd);
+  free(f->path);
+  memset(f, 0, sizeof(*f));
+  f->fd = -1;
+}
+
+static struct file * file_open(const char *path) {
+  uint64_t now = mg_millis();
+  struct file *victim = NULL;
+  for (int i = 0; i < MEDIA_FD_CACHE_SIZE; i++) {
+    struct file *f = &files[i];
+    if (f->path != NULL && strcmp(f->path, path) == 0) {
+      if (now - f->checked < MEDIA_FD_CACHE_TTL_MS) {
+        metrics_cache(METRICS_CACHE_MEDIA_FD, true);
+        f->refs++;
+        f->last_used = now;
+        return f;
+      }
+      // still the same file?
+      struct stat st;
+      if (stat(path, &st) == 0 && st.st_ino == f->st.st_ino && st.st_dev == f->st.st_dev &&
+          st.st_size == f->st.st_size && st.st_mtime == f->st.st_mtime) {
+        metrics_cache(METRICS_CACHE_MEDIA_FD, true);
+        f->checked = now;
+        f->refs++;
+        f->last_used = now;
+        return f;
+      }
+      // replaced or modified, transfers still using the old fd keep it
+      if (f->refs == 0)
+        file_close(f);
+      else
+        f->path[0] = '\0';
+      continue;
+    }
+    if (f->refs == 0 && (victim == NULL || (victim->path != NULL && (f->path == NULL || f->last_used < victim->last_used))))
+      victim = f;
+  }
+
+  metrics_cache(METRICS_CACHE_MEDIA_FD, false);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || ! S_ISREG(st.st_mode) || victim == NULL) {
+    close(fd);
+    return NULL;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  if (victim->path != NULL)
+    file_close(victim);
+  victim->path = strdup(path);
+  victim->fd = fd;
+  victim->st = st;
+  victim->refs = 1;
+  victim->checked = victim->last_used = now;
+  return victim;
+}
+
+static void file_release(struct file *f) {
+  f->refs--;
+  // replaced while we were sending it
+  if (f->refs == 0 && f->path != NULL && f->path[0] == '\0')
+    file_close(f);
+}
+
+const char * media_mime_type(const char *path) {
+  static const struct { const char *ext, *type; } types[] = {
+    { "mp4", "video/mp4" },
+    { "m4v", "video/mp4" },
+    { "mkv", "video/x-matroska" },
+    { "webm", "video/webm" },
+    { "mov", "video/quicktime" },
+    { "flv", "video/x-flv" },
+    { "mp3", "audio/mpeg" },
+    { "ogg", "audio/ogg" },
+    { "wav", "audio/wav" },
+    { "png", "image/png" },
+    { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "gif", "image/gif" },
+    { "webp", "image/webp" },
+    { "svg", "image/svg+xml" },
+    { "pdf", "application/pdf" },
+    { "txt", "text/plain; charset=utf-8" },
+    { "html", "text/html; charset=utf-8" },
+    { "css", "text/css" },
+    { "js", "text/javascript" },
+    { "json", "application/json" },
+    { "xml", "application/xml" },
+    { "gz", "application/gzip" },
+    { "zip", "application/zip" },
+  };
+  const char *ext = strrchr(path, '.');
+  if (ext != NULL && strchr(ext, '/') == NULL) {
+    ext++;
+    for (int i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+      if (strcasecmp(ext, types[i].ext) == 0)
+        return types[i].type;
+  }
+  return "application/octet-stream";
+}
+
+int media_parse_ranges(struct mg_str *header, off_t size, off_t *starts, off_t *ends) {
+  if (header == NULL || header->len < 6 || strncmp(header->ptr, "bytes=", 6) != 0)
+    return 0;
+
+  int count = 0;
+  const char *p = header->ptr + 6, *end = header->ptr + header->len;
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == ','))
+      p++;
+    if (p == end)
+      break;
+
+    bool hasStart = false, hasEnd = false;
+    off_t a = 0, b = 0;
+    while (p < end && *p >= '0' && *p <= '9') { a = a * 10 + (*p++ - '0'); hasStart = true; }
+    if (p == end || *p != '-')
+      return 0;
+    p++;
+    while (p < end && *p >= '0' && *p <= '9') { b = b * 10 + (*p++ - '0'); hasEnd = true; }
+    if (p < end && *p != ',' && *p != ' ')
+      return 0;
+
+    off_t s, e;
+    if (! hasStart && ! hasEnd) return 0;
+    if (! hasStart) { s = size - MIN(b, size); e = size; }   // suffix: last b bytes
+    else            { s = a; e = hasEnd ? MIN(b + 1, size) : size; }
+    if (s >= size || s >= e)
+      continue;
+    // too many ranges to bother, send the whole file
+    if (count == MEDIA_MAX_RANGES)
+      return 0;
+    starts[count] = s;
+    ends[count] = e;
+    count++;
+  }
+  return count > 0 ? count : -1;
+}
+
+static void transfer_free(struct transfer *t) {
+  struct transfer **pp = &transfers;
+  while (*pp != t)
+    pp = &(*pp)->next;
+  *pp = t->next;
+  for (int i = 0; i < t->segments_len; i++)
+    free(t->segments[i].data);
+  file_release(t->file);
+  free(t);
+}
+
+// Sends as much as the connection takes. Plain HTTP: straight from the
+// page cache with sendfile once mongoose has flushed what it has queued.
+// When the socket is full, a small piece goes through the send buffer so
+// mongoose polls for writability and calls us again with MG_EV_WRITE.
+static void transfer_pump(struct transfer *t) {
+  struct mg_connection *c = t->c;
+  size_t budget = 8 * MEDIA_SENDFILE_SIZE; // fairness towards other connections
+
+  // on plain http an exhausted budget still queues one piece below, so
+  // MG_EV_WRITE brings us back instead of the next MG_EV_POLL
+  while (t->cur < t->segments_len && (budget > 0 || (! c->is_tls && c->send.len == 0))) {
+    struct segment *s = &t->segments[t->cur];
+    if (s->data != NULL) {
+      mg_send(c, s->data, strlen(s->data));
+      t->cur++;
+      t->pos = 0;
+      continue;
+    }
+
+    off_t offset = s->start + t->pos;
+    size_t remaining = s->end - offset;
+    if (remaining == 0) {
+      t->cur++;
+      t->pos = 0;
+      continue;
+    }
+
+    if (! c->is_tls) {
+      // wait until mongoose flushed the headers or the piece queued below
+      if (c->send.len > 0)
+        return;
+      if (budget > 0) {
+        off_t off = offset;
+        ssize_t n = sendfile(FD(c), t->file->fd, &off, MIN(remaining, MEDIA_SENDFILE_SIZE));
+        if (n > 0) {
+          // bypasses mongoose, so MG_EV_WRITE doesn't count it
+          metrics_bytes_sent(n);
+          t->pos += n;
+          budget -= MIN(budget, n);
+          continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+          // error, or the file shrank underneath us
+          c->is_closing = 1;
+          return;
+        }
+      }
+      // socket is full or the budget is spent: queue a small piece to get
+      // woken up
+      remaining = MIN(remaining, 4096);
+    }
+    else if (c->send.len >= MEDIA_HIGH_WATER) {
+      return;
+    }
+
+    // reads end on MEDIA_READ_SIZE boundaries so the disk sees large
+    // aligned requests, and we tell the kernel what comes next
+    size_t want = MEDIA_READ_SIZE - (offset % MEDIA_READ_SIZE);
+    want = MIN(want, remaining);
+    ssize_t n = pread(t->file->fd, read_buf, want, offset);
+    if (n <= 0) {
+      c->is_closing = 1;
+      return;
+    }
+    if (offset % MEDIA_READ_SIZE == 0)
+      posix_fadvise(t->file->fd, offset + MEDIA_READ_SIZE, 4 * MEDIA_READ_SIZE, POSIX_FADV_WILLNEED);
+    mg_send(c, read_buf, n);
+    t->pos += n;
+    budget -= MIN(budget, n);
+    if (! c->is_tls)
+      return; // wait for MG_EV_WRITE, then go back to sendfile
+  }
+
+  if (t->cur == t->segments_len)
+    transfer_free(t);
+}
+
+static struct transfer * transfer_for(struct mg_connection *c) {
+  for (struct transfer *t = transfers; t != NULL; t = t->next)
+    if (t->c == c)
+      return t;
+  return NULL;
+}
+
+bool media_busy(struct mg_connection *c) {
+  return transfer_for(c) != NULL;
+}
+
+void media_conn_event(struct mg_connection *c, int ev) {
+  struct transfer *t = transfer_for(c);
+  if (t == NULL)
+    return;
+  if (ev == MG_EV_CLOSE)
+    transfer_free(t);
+  else if (ev == MG_EV_WRITE || ev == MG_EV_POLL)
+    transfer_pump(t);
+}
+
+static bool resolve_path(struct mg_http_message *hm, const char *prefix, const char *dir, char *path, size_t size) {
+  size_t prefix_len = strlen(prefix);
+  if (hm->uri.len < prefix_len)
+    return false;
+  char decoded[4096];
+  int n = mg_url_decode(hm->uri.ptr + prefix_len, hm->uri.len - prefix_len, decoded, sizeof(decoded), 0);
+  if (n < 0)
+    return false;
+  // no way out of dir
+  for (const char *p = decoded; (p = strstr(p, "..")) != NULL; p += 2)
+    if ((p == decoded || p[-1] == '/') && (p[2] == '\0' || p[2] == '/'))
+      return false;
+  return snprintf(path, size, "%s/%s", dir, decoded[0] == '/' ? decoded + 1 : decoded) < size;
+}
+
+void media_serve(struct mg_connection *c, struct mg_http_message *hm, const char *prefix, const char *dir) {
+  char path[4096 + 256];
+  if (! resolve_path(hm, prefix, dir, path, sizeof(path))) {
+    mg_http_reply(c, 400, NULL, "Bad path\n");
+    return;
+  }
+
+  // cached listings are served without touching the disk
+  if (dir_cache_serve(c, hm, path, true))
+    return;
+  if (! media_serve_file(c, hm, path, NULL) && ! dir_cache_serve(c, hm, path, false))
+    mg_http_reply(c, 404, NULL, "Not found :(\n");
+}
+
+bool media_serve_file(struct mg_connection *c, struct mg_http_message *hm, const char *path, const char *headers) {
+  struct file *f = file_open(path);
+  if (f == NULL)
+    return false;
+
+  off_t size = f->st.st_size;
+  char etag[64];
+  snprintf(etag, sizeof(etag), "\"%lx.%lx\"", (unsigned long) f->st.st_mtime, (unsigned long) size);
+  char lastModified[64];
+  struct tm tm;
+  strftime(lastModified, sizeof(lastModified), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&f->st.st_mtime, &tm));
+
+  struct mg_str *inm = mg_http_get_header(hm, "If-None-Match");
+  if (inm != NULL && mg_vcmp(inm, etag) == 0) {
+    mg_printf(c, "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nContent-Length: 0\r\n\r\n", etag);
+    file_release(f);
+    return true;
+  }
+
+  // If-Range with a stale validator means the client wants the whole file
+  struct mg_str *range = mg_http_get_header(hm, "Range");
+  struct mg_str *ifRange = mg_http_get_header(hm, "If-Range");
+  if (ifRange != NULL && mg_vcmp(ifRange, etag) != 0 && mg_vcmp(ifRange, lastModified) != 0)
+    range = NULL;
+
+  off_t starts[MEDIA_MAX_RANGES], ends[MEDIA_MAX_RANGES];
+  int ranges = media_parse_ranges(range, size, starts, ends);
+  if (ranges < 0) {
+    mg_printf(c, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%lld\r\nContent-Length: 0\r\n\r\n", (long long) size);
+    file_release(f);
+    return true;
+  }
+
+  struct transfer *t = calloc(1, sizeof(*t));
+  t->c = c;
+  t->file = f;
+  const char *type = media_mime_type(path);
+  char common[1024];
+  snprintf(common, sizeof(common), "Accept-Ranges: bytes\r\n%s", headers != NULL ? headers : "");
+
+  if (ranges == 0) {
+    mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %lld\r\nETag: %s\r\nLast-Modified: %s\r\n%s\r\n",
+      type, (long long) size, etag, lastModified, common);
+    t->segments[t->segments_len++] = (struct segment) { NULL, 0, size };
+  }
+  else if (ranges == 1) {
+    mg_printf(c, "HTTP/1.1 206 Partial Content\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\nContent-Length: %lld\r\nETag: %s\r\nLast-Modified: %s\r\n%s\r\n",
+      type, (long long) starts[0], (long long) ends[0] - 1, (long long) size, (long long) (ends[0] - starts[0]),
+      etag, lastModified, common);
+    t->segments[t->segments_len++] = (struct segment) { NULL, starts[0], ends[0] };
+  }
+  else {
+    // multipart/byteranges, each part gets its own little header
+    long long total = 0;
+    for (int i = 0; i < ranges; i++) {
+      char part[512];
+      snprintf(part, sizeof(part), "%s--" BOUNDARY "\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+        i > 0 ? "\r\n" : "", type, (long long) starts[i], (long long) ends[i] - 1, (long long) size);
+      t->segments[t->segments_len++] = (struct segment) { strdup(part), 0, 0 };
+      t->segments[t->segments_len++] = (struct segment) { NULL, starts[i], ends[i] };
+      total += strlen(part) + (ends[i] - starts[i]);
+    }
+    const char *closing = "\r\n--" BOUNDARY "--\r\n";
+    t->segments[t->segments_len++] = (struct segment) { strdup(closing), 0, 0 };
+    total += strlen(closing);
+    mg_printf(c, "HTTP/1.1 206 Partial Content\r\nContent-Type: multipart/byteranges; boundary=" BOUNDARY "\r\nContent-Length: %lld\r\nETag: %s\r\nLast-Modified: %s\r\n%s\r\n",
+      total, etag, lastModified, common);
+  }
+
+  if (mg_vcmp(&hm->method, "HEAD") == 0) {
+    for (int i = 0; i < t->segments_len; i++)
+      free(t->segments[i].data);
+    file_release(f);
+    free(t);
+    return true;
+  }
+
+  t->next = transfers;
+  transfers = t;
+  // headers are queued, mongoose sends them and then comes back with MG_EV_WRITE
+  return true;
+}
+
+void media_free(void) {
+  while (transfers != NULL)
+    transfer_free(transfers);
+  for (int i = 0; i < MEDIA_FD_CACHE_SIZE; i++)
+    if (files[i].path != NULL)
+      file_close(&files[i]);
+}
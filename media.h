@@ -0,0 +1,42 @@
+#ifndef MEDIA_H
+#define MEDIA_H
+
+#include <sys/types.h>
+#include <mongoose.h>
+
+#define MEDIA_FD_CACHE_SIZE (64)
+// how long a cached fd is trusted before the file is stat'ed again
+#define MEDIA_FD_CACHE_TTL_MS (2000)
+#define MEDIA_MAX_RANGES (16)
+// plain HTTP: bytes handed to sendfile per call
+#define MEDIA_SENDFILE_SIZE (1024*1024)
+// TLS: size of the aligned reads and how much we keep queued on the connection
+#define MEDIA_READ_SIZE (256*1024)
+#define MEDIA_HIGH_WATER (512*1024)
+
+// Serves the file below dir that uri maps to (uri minus prefix), with
+// single and multi range requests. Plain HTTP goes out via sendfile, TLS
+// via large reads with readahead hints. Directories are listed from
+// dir_cache.
+void media_serve(struct mg_connection *c, struct mg_http_message *hm, const char *prefix, const char *dir);
+// The same for a single file, headers (e.g. Content-Disposition) are
+// added to the response. False if path isn't a regular file.
+bool media_serve_file(struct mg_connection *c, struct mg_http_message *hm, const char *path, const char *headers);
+
+// True while a file is still being sent on c.
+bool media_busy(struct mg_connection *c);
+
+// Must see every MG_EV_WRITE, MG_EV_POLL and MG_EV_CLOSE of connections
+// that media_serve was used on.
+void media_conn_event(struct mg_connection *c, int ev);
+
+void media_free(void);
+
+// By file extension, application/octet-stream if unknown.
+const char * media_mime_type(const char *path);
+// Parses "bytes=a-b,c-,-n" into at most MEDIA_MAX_RANGES [start, end)
+// pairs. Returns the number of ranges, 0 if there is no usable Range
+// header, -1 if none is satisfiable.
+int media_parse_ranges(struct mg_str *header, off_t size, off_t *starts, off_t *ends);
+
+#endif
@@ -0,0 +1,221 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "metrics.h"
+
+
+// upper bounds in ms, the last bucket is +Inf
+static const double bucket_bounds[] = { 1, 2.5, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000 };
+#define BUCKETS (sizeof(bucket_bounds) / sizeof(bucket_bounds[0]) + 1)
+
+static const char * route_names[METRICS_ROUTES] = {
+  "static", "media", "git-tree", "git-blob", "git-diff", "git-index", "git-clone", "archive", "search", "other",
+};
+static const char * git_op_names[METRICS_GIT_OPS] = {
+  "revwalk", "diff", "blob", "pack",
+};
+static const char * refusal_names[METRICS_REFUSALS] = {
+  "rate", "overload",
+};
+static const char * cache_names[METRICS_CACHES] = {
+  "page", "diff", "repo", "static", "media-fd", "dir", "pack", "archive",
+};
+
+struct shard {
+  struct shard *next;
+  uint64_t requests[METRICS_ROUTES];
+  uint64_t request_ns[METRICS_ROUTES];
+  uint64_t buckets[METRICS_ROUTES][BUCKETS];
+  uint64_t git_calls[METRICS_GIT_OPS];
+  uint64_t git_ns[METRICS_GIT_OPS];
+  uint64_t cache_hits[METRICS_CACHES];
+  uint64_t cache_misses[METRICS_CACHES];
+  uint64_t refused[METRICS_ROUTES][METRICS_REFUSALS];
+  uint64_t bytes_sent;
+  int64_t connections;
+  int64_t git_renders;
+};
+
+// Only the owning thread writes a shard, the relaxed store just keeps the
+// reader from seeing torn values.
+#define ADD(field, value) __atomic_store_n(&(field), (field) + (value), __ATOMIC_RELAXED)
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+// guards the list of shards, not their contents
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct shard *shards = NULL;
+static __thread struct shard *own = NULL;
+
+
+static struct shard * shard(void) {
+  if (own == NULL) {
+    own = calloc(1, sizeof(*own));
+    pthread_mutex_lock(&lock);
+    own->next = shards;
+    shards = own;
+    pthread_mutex_unlock(&lock);
+  }
+  return own;
+}
+
+uint64_t metrics_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_request(enum metrics_route route, uint64_t start) {
+  struct shard *s = shard();
+  uint64_t ns = metrics_now() - start;
+  size_t b = 0;
+  while (b < BUCKETS - 1 && ns > bucket_bounds[b] * 1000000)
+    b++;
+  ADD(s->requests[route], 1);
+  ADD(s->request_ns[route], ns);
+  ADD(s->buckets[route][b], 1);
+}
+
+void metrics_git(enum metrics_git_op op, uint64_t start) {
+  struct shard *s = shard();
+  ADD(s->git_calls[op], 1);
+  ADD(s->git_ns[op], metrics_now() - start);
+}
+
+void metrics_cache(enum metrics_cache cache, bool hit) {
+  struct shard *s = shard();
+  if (hit)
+    ADD(s->cache_hits[cache], 1);
+  else
+    ADD(s->cache_misses[cache], 1);
+}
+
+void metrics_bytes_sent(size_t bytes) {
+  ADD(shard()->bytes_sent, bytes);
+}
+
+void metrics_connections(int delta) {
+  ADD(shard()->connections, delta);
+}
+
+void metrics_refused(enum metrics_route route, enum metrics_refusal reason) {
+  ADD(shard()->refused[route][reason], 1);
+}
+
+void metrics_git_renders(int delta) {
+  ADD(shard()->git_renders, delta);
+}
+
+struct buffer {
+  char *data;
+  size_t len, cap;
+};
+static void print(struct buffer *b, const char *fmt, ...) {
+  va_list ap;
+  for (;;) {
+    va_start(ap, fmt);
+    int n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+    va_end(ap);
+    if (n >= 0 && b->len + n < b->cap) {
+      b->len += n;
+      return;
+    }
+    b->cap = b->cap ? b->cap * 2 : 16384;
+    b->data = realloc(b->data, b->cap);
+  }
+}
+
+char * metrics_render(size_t *len) {
+  struct shard sum;
+  memset(&sum, 0, sizeof(sum));
+
+  pthread_mutex_lock(&lock);
+  for (struct shard *s = shards; s != NULL; s = s->next) {
+    for (int r = 0; r < METRICS_ROUTES; r++) {
+      sum.requests[r] += LOAD(s->requests[r]);
+      sum.request_ns[r] += LOAD(s->request_ns[r]);
+      for (int b = 0; b < BUCKETS; b++)
+        sum.buckets[r][b] += LOAD(s->buckets[r][b]);
+      for (int f = 0; f < METRICS_REFUSALS; f++)
+        sum.refused[r][f] += LOAD(s->refused[r][f]);
+    }
+    for (int o = 0; o < METRICS_GIT_OPS; o++) {
+      sum.git_calls[o] += LOAD(s->git_calls[o]);
+      sum.git_ns[o] += LOAD(s->git_ns[o]);
+    }
+    for (int c = 0; c < METRICS_CACHES; c++) {
+      sum.cache_hits[c] += LOAD(s->cache_hits[c]);
+      sum.cache_misses[c] += LOAD(s->cache_misses[c]);
+    }
+    sum.bytes_sent += LOAD(s->bytes_sent);
+    sum.connections += LOAD(s->connections);
+    sum.git_renders += LOAD(s->git_renders);
+  }
+  pthread_mutex_unlock(&lock);
+
+  struct buffer b = { NULL, 0, 0 };
+  print(&b, "# TYPE gitserve_requests_total counter\n");
+  for (int r = 0; r < METRICS_ROUTES; r++)
+    print(&b, "gitserve_requests_total{route=\"%s\"} %llu\n", route_names[r], (unsigned long long) sum.requests[r]);
+
+  print(&b, "# TYPE gitserve_request_duration_seconds histogram\n");
+  for (int r = 0; r < METRICS_ROUTES; r++) {
+    uint64_t cumulative = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+      cumulative += sum.buckets[r][i];
+      if (i < BUCKETS - 1)
+        print(&b, "gitserve_request_duration_seconds_bucket{route=\"%s\",le=\"%g\"} %llu\n",
+          route_names[r], bucket_bounds[i] / 1000, (unsigned long long) cumulative);
+      else
+        print(&b, "gitserve_request_duration_seconds_bucket{route=\"%s\",le=\"+Inf\"} %llu\n",
+          route_names[r], (unsigned long long) cumulative);
+    }
+    print(&b, "gitserve_request_duration_seconds_sum{route=\"%s\"} %.6f\n", route_names[r], sum.request_ns[r] / 1e9);
+    print(&b, "gitserve_request_duration_seconds_count{route=\"%s\"} %llu\n", route_names[r],
+      (unsigned long long) sum.requests[r]);
+  }
+
+  print(&b, "# TYPE gitserve_requests_refused_total counter\n");
+  for (int r = 0; r < METRICS_ROUTES; r++)
+    for (int f = 0; f < METRICS_REFUSALS; f++)
+      print(&b, "gitserve_requests_refused_total{route=\"%s\",reason=\"%s\"} %llu\n", route_names[r], refusal_names[f],
+        (unsigned long long) sum.refused[r][f]);
+
+  print(&b, "# TYPE gitserve_bytes_sent_total counter\n");
+  print(&b, "gitserve_bytes_sent_total %llu\n", (unsigned long long) sum.bytes_sent);
+  print(&b, "# TYPE gitserve_connections_active gauge\n");
+  print(&b, "gitserve_connections_active %lld\n", (long long) sum.connections);
+  print(&b, "# TYPE gitserve_git_renders_active gauge\n");
+  print(&b, "gitserve_git_renders_active %lld\n", (long long) sum.git_renders);
+
+  print(&b, "# TYPE gitserve_libgit2_calls_total counter\n");
+  for (int o = 0; o < METRICS_GIT_OPS; o++)
+    print(&b, "gitserve_libgit2_calls_total{op=\"%s\"} %llu\n", git_op_names[o], (unsigned long long) sum.git_calls[o]);
+  print(&b, "# TYPE gitserve_libgit2_seconds_total counter\n");
+  for (int o = 0; o < METRICS_GIT_OPS; o++)
+    print(&b, "gitserve_libgit2_seconds_total{op=\"%s\"} %.6f\n", git_op_names[o], sum.git_ns[o] / 1e9);
+
+  print(&b, "# TYPE gitserve_cache_hits_total counter\n");
+  for (int c = 0; c < METRICS_CACHES; c++)
+    print(&b, "gitserve_cache_hits_total{cache=\"%s\"} %llu\n", cache_names[c], (unsigned long long) sum.cache_hits[c]);
+  print(&b, "# TYPE gitserve_cache_misses_total counter\n");
+  for (int c = 0; c < METRICS_CACHES; c++)
+    print(&b, "gitserve_cache_misses_total{cache=\"%s\"} %llu\n", cache_names[c], (unsigned long long) sum.cache_misses[c]);
+
+  *len = b.len;
+  return b.data;
+}
+
+void metrics_free(void) {
+  pthread_mutex_lock(&lock);
+  while (shards != NULL) {
+    struct shard *s = shards;
+    shards = s->next;
+    free(s);
+  }
+  pthread_mutex_unlock(&lock);
+  own = NULL;
+}
@@ -0,0 +1,69 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum metrics_route {
+  METRICS_ROUTE_STATIC,
+  METRICS_ROUTE_MEDIA,
+  METRICS_ROUTE_GIT_TREE,
+  METRICS_ROUTE_GIT_BLOB,
+  METRICS_ROUTE_GIT_DIFF,
+  METRICS_ROUTE_GIT_INDEX,
+  METRICS_ROUTE_GIT_CLONE,
+  METRICS_ROUTE_ARCHIVE,
+  METRICS_ROUTE_SEARCH,
+  METRICS_ROUTE_OTHER,
+  METRICS_ROUTES
+};
+enum metrics_git_op {
+  METRICS_GIT_REVWALK,
+  METRICS_GIT_DIFF,
+  METRICS_GIT_BLOB,
+  METRICS_GIT_PACK,
+  METRICS_GIT_OPS
+};
+enum metrics_cache {
+  METRICS_CACHE_PAGE,
+  METRICS_CACHE_DIFF,
+  METRICS_CACHE_REPO,
+  METRICS_CACHE_STATIC,
+  METRICS_CACHE_MEDIA_FD,
+  METRICS_CACHE_DIR,
+  METRICS_CACHE_PACK,
+  METRICS_CACHE_ARCHIVE,
+  METRICS_CACHES
+};
+enum metrics_refusal {
+  METRICS_REFUSED_RATE,
+  METRICS_REFUSED_OVERLOAD,
+  METRICS_REFUSALS
+};
+
+// Counters live in per-thread shards that only their own thread writes,
+// so recording is a plain add without locks or atomic read-modify-write.
+// metrics_render sums the shards up.
+
+// monotonic nanoseconds
+uint64_t metrics_now(void);
+
+// A finished request, duration is the time spent producing the response.
+void metrics_request(enum metrics_route route, uint64_t start);
+// libgit2 call(s) that started at start
+void metrics_git(enum metrics_git_op op, uint64_t start);
+void metrics_cache(enum metrics_cache cache, bool hit);
+void metrics_bytes_sent(size_t bytes);
+// a request turned away by admission control
+void metrics_refused(enum metrics_route route, enum metrics_refusal reason);
+// +1 when a git render is handed to the workers, -1 once it is sent
+void metrics_git_renders(int delta);
+// +1 on accept, -1 on close
+void metrics_connections(int delta);
+
+// Prometheus text format, malloc'ed
+char * metrics_render(size_t *len);
+void metrics_free(void);
+
+#endif
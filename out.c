@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "out.h"
+#include "escape.h"
+#include "metrics.h"
+
+
+#define MIN(a,b) (a<b?a:b)
+#define FD(c) ((int) (size_t) (c)->fd)
+
+// Writes queued data straight to the socket. mongoose only drains the send
+// buffer after the event handler returns, so without this a big page
+// would pile up in memory first.
+static void drain(struct out *o, size_t target) {
+  struct mg_connection *c = o->c;
+  while (! o->failed && c->send.len > target) {
+    long n = c->is_tls
+      ? mg_tls_send(c, c->send.buf, c->send.len)
+      : send(FD(c), c->send.buf, c->send.len, MSG_NOSIGNAL);
+
+    if (n > 0) {
+      // bypasses mongoose, so MG_EV_WRITE doesn't count it
+      metrics_bytes_sent(n);
+      mg_iobuf_del(&c->send, 0, n);
+    }
+    else if (n < 0 && ! c->is_tls && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      o->failed = true;
+    }
+    else if (n < 0 && c->is_tls) {
+      o->failed = true;
+    }
+    else {
+      struct pollfd pfd = { .fd = FD(c), .events = POLLOUT };
+      if (poll(&pfd, 1, OUT_SEND_TIMEOUT_MS) <= 0 || (pfd.revents & (POLLERR | POLLHUP)))
+        o->failed = true;
+    }
+  }
+  if (o->failed)
+    c->is_closing = 1;
+}
+static void capture_append(struct out *o, const void *data, size_t len) {
+  if (o->capture == NULL)
+    return;
+  if (o->capture_len + len > o->capture_max) {
+    free(o->capture);
+    o->capture = NULL;
+    return;
+  }
+  if (o->capture_len + len > o->capture_cap) {
+    size_t cap = o->capture_cap * 2;
+    while (cap < o->capture_len + len)
+      cap *= 2;
+    char *capture = realloc(o->capture, cap);
+    if (capture == NULL) {
+      free(o->capture);
+      o->capture = NULL;
+      return;
+    }
+    o->capture = capture;
+    o->capture_cap = cap;
+  }
+  memcpy(o->capture + o->capture_len, data, len);
+  o->capture_len += len;
+}
+
+// sink for out_init_conn
+static void conn_sink(struct out *o, const void *data, size_t len) {
+  if (o->failed)
+    return;
+  mg_send(o->c, data, len);
+  if (o->c->send.len > OUT_HIGH_WATER)
+    drain(o, OUT_LOW_WATER);
+}
+
+// sink for out_init_queued
+static void queue_sink(struct out *o, const void *data, size_t len) {
+  mg_send(o->c, data, len);
+}
+
+static const char * status_text(int status) {
+  switch (status) {
+    case 200: return "OK";
+    case 206: return "Partial Content";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 416: return "Range Not Satisfiable";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+  }
+  return "Error";
+}
+
+void out_init(struct out *o, out_sink_fn sink, void *sink_data) {
+  o->sink = sink;
+  o->sink_data = sink_data;
+  o->c = NULL;
+  o->len = 0;
+  o->chunked = false;
+  o->failed = false;
+  o->close = false;
+  o->capture = NULL;
+  o->encoding = ENCODING_IDENTITY;
+  o->content_type = "text/html; charset=utf-8";
+  o->z = NULL;
+}
+void out_init_conn(struct out *o, struct mg_connection *c) {
+  out_init(o, conn_sink, NULL);
+  o->c = c;
+}
+void out_init_queued(struct out *o, struct mg_connection *c) {
+  out_init(o, queue_sink, NULL);
+  o->c = c;
+}
+
+void out_set_encoding(struct out *o, enum encoding encoding) {
+  o->encoding = encoding;
+}
+void out_set_content_type(struct out *o, const char *type) {
+  o->content_type = type;
+}
+
+void out_begin(struct out *o, int status, const char *headers) {
+  char head[1024], encoding[64] = "";
+  if (o->encoding != ENCODING_IDENTITY)
+    o->z = compressor_new(o->encoding, compress_level());
+  if (o->z != NULL)
+    snprintf(encoding, sizeof(encoding), "Content-Encoding: %s\r\n", compress_encoding_name(o->encoding));
+  int n = snprintf(head, sizeof(head),
+    "HTTP/1.1 %d %s\r\n"
+    "Content-Type: %s\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "%s"
+    "%s\r\n",
+    status, status_text(status), o->content_type, encoding, headers != NULL ? headers : "");
+  o->sink(o, head, MIN(n, sizeof(head) - 1));
+  o->chunked = true;
+}
+
+void out_begin_sized(struct out *o, int status, const char *headers, size_t len) {
+  char head[1024];
+  int n = snprintf(head, sizeof(head),
+    "HTTP/1.1 %d %s\r\n"
+    "%s"
+    "Content-Length: %zu\r\n\r\n",
+    status, status_text(status), headers != NULL ? headers : "", len);
+  o->sink(o, head, MIN(n, sizeof(head) - 1));
+  o->chunked = false;
+}
+
+void out_reply(struct out *o, int status, const char *headers, const char *fmt, ...) {
+  char body[1024], head[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  int body_len = vsnprintf(body, sizeof(body), fmt, ap);
+  va_end(ap);
+  body_len = MIN(body_len, sizeof(body) - 1);
+  int n = snprintf(head, sizeof(head),
+    "HTTP/1.1 %d %s\r\n"
+    "%s"
+    "Content-Length: %d\r\n\r\n",
+    status, status_text(status), headers != NULL ? headers : "", body_len);
+  o->sink(o, head, MIN(n, sizeof(head) - 1));
+  o->sink(o, body, body_len);
+}
+
+// sends data as one chunk of the response body
+static void emit_chunk(void *arg, const void *data, size_t len) {
+  struct out *o = arg;
+  if (! o->chunked) {
+    if (! o->failed) o->sink(o, data, len);
+    return;
+  }
+  char size[16];
+  int n = snprintf(size, sizeof(size), "%zx\r\n", len);
+  if (! o->failed) o->sink(o, size, n);
+  if (! o->failed) o->sink(o, data, len);
+  if (! o->failed) o->sink(o, "\r\n", 2);
+}
+static void emit(struct out *o, const void *data, size_t len, enum compress_flush flush) {
+  if (o->failed)
+    return;
+  if (o->z != NULL)
+    compressor_write(o->z, data, len, flush, emit_chunk, o);
+  else if (len > 0)
+    emit_chunk(o, data, len);
+}
+
+void out_flush(struct out *o) {
+  if (o->len > 0)
+    emit(o, o->buf, o->len, COMPRESS_SYNC_FLUSH);
+  o->len = 0;
+}
+
+void out_write(struct out *o, const void *data, size_t len) {
+  capture_append(o, data, len);
+  if (o->len + len > OUT_BUF_SIZE) {
+    // a full buffer doesn't need to be decodable yet, so no sync flush
+    emit(o, o->buf, o->len, COMPRESS_NO_FLUSH);
+    o->len = 0;
+  }
+  if (len >= OUT_BUF_SIZE) {
+    // big blocks go out as their own chunk
+    emit(o, data, len, COMPRESS_NO_FLUSH);
+    return;
+  }
+  memcpy(o->buf + o->len, data, len);
+  o->len += len;
+}
+
+void out_printf(struct out *o, const char *fmt, ...) {
+  char tmp[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+  va_end(ap);
+  if (n < 0)
+    return;
+  if (n < sizeof(tmp)) {
+    out_write(o, tmp, n);
+    return;
+  }
+  // commit messages and the like can be longer than tmp
+  char *big = malloc(n + 1);
+  va_start(ap, fmt);
+  vsnprintf(big, n + 1, fmt, ap);
+  va_end(ap);
+  out_write(o, big, n);
+  free(big);
+}
+
+void out_escape(struct out *o, const void *data, size_t len) {
+  const char *p = data;
+  while (len > 0) {
+    // escape straight into the output buffer, worst case every byte grows
+    size_t room = (OUT_BUF_SIZE - o->len) / ESCAPE_MAX_GROWTH;
+    if (room < 64) {
+      emit(o, o->buf, o->len, COMPRESS_NO_FLUSH);
+      o->len = 0;
+      continue;
+    }
+    size_t n = MIN(len, room);
+    size_t written = escape_html(o->buf + o->len, p, n);
+    capture_append(o, o->buf + o->len, written);
+    o->len += written;
+    p += n;
+    len -= n;
+  }
+}
+
+void out_escape_attribute(struct out *o, const void *data, size_t len) {
+  const char *p = data;
+  char buf[256 * ESCAPE_ATTRIBUTE_MAX_GROWTH];
+  while (len > 0) {
+    size_t n = MIN(len, 256);
+    out_write(o, buf, escape_attribute(buf, p, n));
+    p += n;
+    len -= n;
+  }
+}
+
+void out_end(struct out *o) {
+  if (o->z != NULL) {
+    emit(o, o->buf, o->len, COMPRESS_FINISH);
+    o->len = 0;
+    compressor_free(o->z);
+    o->z = NULL;
+  }
+  out_flush(o);
+  if (! o->failed && o->chunked)
+    o->sink(o, "0\r\n\r\n", 5);
+  if (o->close && o->c != NULL)
+    o->c->is_draining = 1;
+  free(o->capture);
+  o->capture = NULL;
+}
+
+void out_abort(struct out *o) {
+  out_flush(o);
+  compressor_free(o->z);
+  o->z = NULL;
+  o->close = true;
+  if (o->c != NULL)
+    o->c->is_draining = 1;
+  free(o->capture);
+  o->capture = NULL;
+}
+
+void out_capture_begin(struct out *o, size_t max) {
+  free(o->capture);
+  o->capture_cap = 4096;
+  o->capture = malloc(o->capture_cap);
+  o->capture_len = 0;
+  o->capture_max = max;
+}
+
+char * out_capture_end(struct out *o, size_t *len) {
+  char *capture = o->capture;
+  *len = o->capture_len;
+  o->capture = NULL;
+  return capture;
+}
@@ -0,0 +1,86 @@
+#ifndef OUT_H
+#define OUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <mongoose.h>
+
+#include "compress.h"
+
+#define OUT_BUF_SIZE (16*1024)
+// once this much is queued on the connection we stop generating and wait
+// for the socket, and resume when it dropped below the low water mark
+#define OUT_HIGH_WATER (64*1024)
+#define OUT_LOW_WATER (16*1024)
+#define OUT_SEND_TIMEOUT_MS (30*1000)
+
+struct out;
+// Receives raw response bytes (headers and chunk framing included).
+// Sets o->failed if the client is gone.
+typedef void (*out_sink_fn)(struct out *o, const void *data, size_t len);
+
+// HTTP response that is sent while it is generated, either straight to a
+// connection or through a sink (e.g. back from a worker thread).
+struct out {
+  out_sink_fn sink;
+  void *sink_data;
+  struct mg_connection *c;
+
+  char buf[OUT_BUF_SIZE];
+  size_t len;
+  bool chunked;
+  bool failed;
+  // close the connection once the response is sent, e.g. after a short body
+  bool close;
+
+  // body compression, chosen with out_set_encoding before out_begin
+  enum encoding encoding;
+  // of the out_begin response, HTML unless out_set_content_type
+  const char *content_type;
+  struct compressor *z;
+
+  // optional copy of everything written between capture begin/end
+  char *capture;
+  size_t capture_len, capture_cap, capture_max;
+};
+
+void out_init_conn(struct out *o, struct mg_connection *c);
+// Only queues the response in the connection's send buffer, mongoose sends
+// it once the event handler returns. Never waits for the socket, so the
+// event loop can use it for responses of bounded size.
+void out_init_queued(struct out *o, struct mg_connection *c);
+void out_init(struct out *o, out_sink_fn sink, void *sink_data);
+
+// Compresses the body of the following out_begin response. Captures still
+// see the uncompressed bytes.
+void out_set_encoding(struct out *o, enum encoding encoding);
+// type must outlive the response, e.g. a string literal.
+void out_set_content_type(struct out *o, const char *type);
+// Starts a chunked response, the body follows with out_write/printf/escape.
+void out_begin(struct out *o, int status, const char *headers);
+// Starts a response with a body of exactly len bytes, which are sent as
+// they are written (no chunking, no compression). headers must include
+// the Content-Type.
+void out_begin_sized(struct out *o, int status, const char *headers, size_t len);
+// A complete, small response instead (errors, 304s).
+void out_reply(struct out *o, int status, const char *headers, const char *fmt, ...);
+
+void out_write(struct out *o, const void *data, size_t len);
+void out_printf(struct out *o, const char *fmt, ...);
+// Writes data HTML escaped, unescaped runs are copied in bulk.
+void out_escape(struct out *o, const void *data, size_t len);
+// Same for a quoted attribute value, quotes are escaped too.
+void out_escape_attribute(struct out *o, const void *data, size_t len);
+// Sends everything written so far, compressed output is sync flushed.
+void out_flush(struct out *o);
+void out_end(struct out *o);
+// Ends a response that can't be completed: what was written is sent and
+// the connection closed without the final chunk, so the client sees the
+// body cut short instead of taking it for complete.
+void out_abort(struct out *o);
+
+// Captures are dropped (end returns NULL) if they grow beyond max bytes.
+void out_capture_begin(struct out *o, size_t max);
+char * out_capture_end(struct out *o, size_t *len);
+
+#endif
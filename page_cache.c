@@ -0,0 +1,237 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "page_cache.h"
+#include "metrics.h"
+
+
+#define BUCKETS (1024)
+
+struct page {
+  struct page *next_bucket;
+  struct page *lru_prev, *lru_next;
+  uint64_t hash;
+  char *key;
+  size_t key_len;
+  char *data;
+  size_t len;
+};
+
+// page contents are refcounted so a reader can keep streaming a page that
+// gets evicted meanwhile
+struct page_data {
+  int refs;
+  char bytes[];
+};
+
+// guards everything below, including refcounts
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct page *buckets[BUCKETS];
+// most recently used at the head
+static struct page *lru_head, *lru_tail;
+static size_t total_bytes = 0;
+static size_t max_total_bytes = 0;
+static char *cache_dir = NULL;
+
+
+uint64_t page_cache_hash(uint64_t hash, const void *data, size_t len) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static char * data_alloc(size_t len) {
+  struct page_data *d = malloc(sizeof(*d) + len + 1);
+  if (d == NULL)
+    return NULL;
+  d->refs = 1;
+  d->bytes[len] = '\0';
+  return d->bytes;
+}
+static void data_release(const char *bytes) {
+  struct page_data *d = (struct page_data *) (bytes - offsetof(struct page_data, bytes));
+  if (--d->refs == 0)
+    free(d);
+}
+static void data_ref(const char *bytes) {
+  struct page_data *d = (struct page_data *) (bytes - offsetof(struct page_data, bytes));
+  d->refs++;
+}
+
+static void lru_unlink(struct page *p) {
+  if (p->lru_prev) p->lru_prev->lru_next = p->lru_next; else lru_head = p->lru_next;
+  if (p->lru_next) p->lru_next->lru_prev = p->lru_prev; else lru_tail = p->lru_prev;
+  p->lru_prev = p->lru_next = NULL;
+}
+static void lru_push(struct page *p) {
+  p->lru_next = lru_head;
+  if (lru_head) lru_head->lru_prev = p;
+  lru_head = p;
+  if (lru_tail == NULL) lru_tail = p;
+}
+static void page_remove(struct page *p) {
+  struct page **b = &buckets[p->hash % BUCKETS];
+  while (*b != p)
+    b = &(*b)->next_bucket;
+  *b = p->next_bucket;
+  lru_unlink(p);
+  total_bytes -= p->key_len + p->len;
+  free(p->key);
+  data_release(p->data);
+  free(p);
+}
+static struct page * page_find(uint64_t hash, const void *key, size_t key_len) {
+  for (struct page *p = buckets[hash % BUCKETS]; p != NULL; p = p->next_bucket)
+    if (p->hash == hash && p->key_len == key_len && memcmp(p->key, key, key_len) == 0)
+      return p;
+  return NULL;
+}
+static struct page * page_insert(uint64_t hash, const void *key, size_t key_len, char *data, size_t len) {
+  if (key_len + len > max_total_bytes / 4) {
+    // a single huge page would flush everything else
+    data_release(data);
+    return NULL;
+  }
+  while (lru_tail != NULL && total_bytes + key_len + len > max_total_bytes)
+    page_remove(lru_tail);
+
+  struct page *p = calloc(1, sizeof(*p));
+  p->hash = hash;
+  p->key = malloc(key_len);
+  memcpy(p->key, key, key_len);
+  p->key_len = key_len;
+  p->data = data;
+  p->len = len;
+  p->next_bucket = buckets[hash % BUCKETS];
+  buckets[hash % BUCKETS] = p;
+  lru_push(p);
+  total_bytes += key_len + len;
+  return p;
+}
+
+// on disk a page is stored as <key_len><key><data> in a file named by the hash
+static void disk_path(char *buf, size_t size, uint64_t hash) {
+  snprintf(buf, size, "%s/%016llx", cache_dir, (unsigned long long) hash);
+}
+static char * disk_read(uint64_t hash, const void *key, size_t key_len, size_t *len) {
+  char path[4096];
+  disk_path(path, sizeof(path), hash);
+  FILE *f = fopen(path, "rb");
+  if (f == NULL)
+    return NULL;
+
+  char *data = NULL;
+  size_t stored_key_len;
+  char *stored_key = malloc(key_len);
+  if (fread(&stored_key_len, sizeof(stored_key_len), 1, f) == 1 && stored_key_len == key_len &&
+      fread(stored_key, 1, key_len, f) == key_len && memcmp(stored_key, key, key_len) == 0)
+  {
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f) - sizeof(stored_key_len) - key_len;
+    fseek(f, sizeof(stored_key_len) + key_len, SEEK_SET);
+    data = data_alloc(*len);
+    if (data != NULL && fread(data, 1, *len, f) != *len) {
+      data_release(data);
+      data = NULL;
+    }
+  }
+  free(stored_key);
+  fclose(f);
+  return data;
+}
+static void disk_write(uint64_t hash, const void *key, size_t key_len, const char *data, size_t len) {
+  char path[4096], tmp[4096 + 32];
+  disk_path(path, sizeof(path), hash);
+  snprintf(tmp, sizeof(tmp), "%s.%lx.tmp", path, (unsigned long) pthread_self());
+  FILE *f = fopen(tmp, "wb");
+  if (f == NULL)
+    return;
+  bool ok = fwrite(&key_len, sizeof(key_len), 1, f) == 1 &&
+            fwrite(key, 1, key_len, f) == key_len &&
+            fwrite(data, 1, len, f) == len;
+  ok = (fclose(f) == 0) && ok;
+  if (ok)
+    rename(tmp, path);
+  else
+    remove(tmp);
+}
+
+void page_cache_init(size_t max_bytes, const char *disk_dir) {
+  max_total_bytes = max_bytes;
+  cache_dir = disk_dir != NULL ? strdup(disk_dir) : NULL;
+}
+
+const char * page_cache_get(const void *key, size_t key_len, size_t *len) {
+  uint64_t hash = page_cache_hash(PAGE_CACHE_HASH_INIT, key, key_len);
+  pthread_mutex_lock(&lock);
+  struct page *p = page_find(hash, key, key_len);
+  pthread_mutex_unlock(&lock);
+
+  if (p == NULL && cache_dir != NULL) {
+    size_t data_len;
+    char *data = disk_read(hash, key, key_len, &data_len);
+    if (data != NULL) {
+      pthread_mutex_lock(&lock);
+      // somebody else might have loaded it meanwhile
+      struct page *existing = page_find(hash, key, key_len);
+      if (existing != NULL)
+        page_remove(existing);
+      page_insert(hash, key, key_len, data, data_len);
+      pthread_mutex_unlock(&lock);
+    }
+  }
+
+  pthread_mutex_lock(&lock);
+  p = page_find(hash, key, key_len);
+  const char *data = NULL;
+  if (p != NULL) {
+    lru_unlink(p);
+    lru_push(p);
+    data_ref(p->data);
+    data = p->data;
+    *len = p->len;
+  }
+  pthread_mutex_unlock(&lock);
+  metrics_cache(METRICS_CACHE_PAGE, data != NULL);
+  return data;
+}
+
+void page_cache_release(const char *data) {
+  pthread_mutex_lock(&lock);
+  data_release(data);
+  pthread_mutex_unlock(&lock);
+}
+
+void page_cache_put(const void *key, size_t key_len, const char *data, size_t len) {
+  uint64_t hash = page_cache_hash(PAGE_CACHE_HASH_INIT, key, key_len);
+  char *copy = data_alloc(len);
+  if (copy == NULL)
+    return;
+  memcpy(copy, data, len);
+
+  pthread_mutex_lock(&lock);
+  struct page *p = page_find(hash, key, key_len);
+  if (p != NULL)
+    page_remove(p);
+  page_insert(hash, key, key_len, copy, len);
+  pthread_mutex_unlock(&lock);
+
+  if (cache_dir != NULL)
+    disk_write(hash, key, key_len, data, len);
+}
+
+void page_cache_free(void) {
+  pthread_mutex_lock(&lock);
+  while (lru_head != NULL)
+    page_remove(lru_head);
+  pthread_mutex_unlock(&lock);
+  free(cache_dir);
+  cache_dir = NULL;
+}
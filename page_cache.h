@@ -0,0 +1,24 @@
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bounded LRU cache of rendered, immutable page fragments.
+// Keys are arbitrary bytes. If disk_dir is set, fragments are also written
+// there and survive restarts (the directory is never pruned by us).
+void page_cache_init(size_t max_bytes, const char *disk_dir);
+
+// Safe to use from several threads. A returned page stays valid until it
+// is handed back with page_cache_release, even if it is evicted meanwhile.
+const char * page_cache_get(const void *key, size_t key_len, size_t *len);
+void page_cache_release(const char *data);
+void page_cache_put(const void *key, size_t key_len, const char *data, size_t len);
+
+void page_cache_free(void);
+
+// 64 bit FNV-1a, used for keys and ETags
+uint64_t page_cache_hash(uint64_t hash, const void *data, size_t len);
+#define PAGE_CACHE_HASH_INIT (0xcbf29ce484222325ULL)
+
+#endif
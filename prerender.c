@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+#include "prerender.h"
+#include "repo_cache.h"
+#include "commit_index.h"
+#include "diff_cache.h"
+#include "workers.h"
+#include "metrics.h"
+
+
+#define MIN(a,b) (a<b?a:b)
+
+// there is no glibc wrapper for ioprio_set, see linux/ioprio.h
+#define IOPRIO_WHO_PROCESS (1)
+#define IOPRIO_CLASS_IDLE (3)
+#define IOPRIO_CLASS_SHIFT (13)
+
+struct branch_state {
+  struct branch_state *next;
+  char *repo_path, *branch;
+  // last tip handed to the thread and the last one it got through
+  git_oid wanted, warmed;
+  bool has_warmed;
+  bool queued;
+  struct branch_state *next_queued;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+// only stopping wakes up a resting thread, new work doesn't
+static pthread_cond_t rest_cond = PTHREAD_COND_INITIALIZER;
+static struct branch_state *states = NULL;
+static struct branch_state *queue_head = NULL, *queue_tail = NULL;
+static bool stopping = false;
+static bool started = false;
+static pthread_t thread;
+
+static int budget = PRERENDER_BUDGET_PERCENT;
+// git pages queued or rendering, written by the event loop
+static int busy = 0;
+
+
+// Sleeps up to ms, false if we are stopping. Called with lock held.
+static bool wait_ms(uint64_t ms) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += ms / 1000;
+  ts.tv_nsec += (ms % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  if (! stopping)
+    pthread_cond_timedwait(&rest_cond, &lock, &ts);
+  return ! stopping;
+}
+
+// Called after each step that started at start (metrics_now): rests long
+// enough to stay within the budget, then until no git page is rendering.
+// Wall time covers waiting for the disk as well as the CPU.
+static bool rest(uint64_t start) {
+  uint64_t pause = (metrics_now() - start) / 1000000 * (100 - budget) / budget;
+  pthread_mutex_lock(&lock);
+  bool ok = wait_ms(pause);
+  while (ok && __atomic_load_n(&busy, __ATOMIC_RELAXED))
+    ok = wait_ms(PRERENDER_POLL_MS);
+  pthread_mutex_unlock(&lock);
+  return ok;
+}
+
+static git_tree * commit_tree(git_repository *repo, const git_oid *oid) {
+  git_commit *commit;
+  git_tree *tree = NULL;
+  if (git_commit_lookup(&commit, repo, oid) != 0)
+    return NULL;
+  git_commit_tree(&tree, commit);
+  git_commit_free(commit);
+  return tree;
+}
+
+// The same lookups the log, tree and diff pages of the tip make, so their
+// results are cached by the time somebody asks. old is the previously
+// warmed tip, the commits in between are new.
+static void warm(const char *repo_path, const char *branch, const git_oid *tip, const git_oid *old) {
+  git_repository *repo = repo_cache_open(repo_path);
+  if (repo == NULL)
+    return;
+
+  // log positions, only the new commits are walked
+  uint64_t start = metrics_now();
+  struct commit_index *index = commit_index_get(repo, repo_path, branch, tip);
+  if (index == NULL)
+    return;
+  long fresh = old != NULL ? commit_index_position(index, old) : -1;
+  size_t count = fresh > 0 ? MIN((size_t) fresh, PRERENDER_MAX_COMMITS) : 1;
+  // each diff is against the next commit in the log, like the diff page
+  git_oid oids[PRERENDER_MAX_COMMITS + 1];
+  size_t oidsLen = 0;
+  for (size_t i = 0; i <= count && i < commit_index_count(index); i++)
+    oids[oidsLen++] = *commit_index_at(index, i);
+  size_t total = commit_index_count(index);
+  commit_index_put(index);
+  if (! rest(start))
+    return;
+
+  // top level tree with the last change of every entry, which indexes the
+  // paths of the new commits, a step at a time with rests in between
+  start = metrics_now();
+  git_tree *tree = commit_tree(repo, tip);
+  if (tree == NULL)
+    return;
+  git_tree_free(tree);
+  // bounded in case a commit keeps failing to diff
+  for (size_t step = 0; step <= total / PRERENDER_PATHS_STEP; step++) {
+    bool done = commit_index_update_paths(repo, repo_path, branch, tip, PRERENDER_PATHS_STEP);
+    if (! rest(start))
+      return;
+    if (done)
+      break;
+    start = metrics_now();
+  }
+
+  // diff stats, newest first
+  for (size_t i = 0; i < MIN(count, oidsLen); i++) {
+    start = metrics_now();
+    git_tree *newTree = commit_tree(repo, &oids[i]);
+    git_tree *oldTree = i + 1 < oidsLen ? commit_tree(repo, &oids[i + 1]) : NULL;
+    if (newTree != NULL) {
+      const struct diff_summary *summary = diff_cache_get(repo, oldTree, newTree, false);
+      if (summary != NULL)
+        diff_cache_release(summary);
+    }
+    git_tree_free(oldTree);
+    git_tree_free(newTree);
+    if (! rest(start))
+      return;
+  }
+}
+
+static void * prerender_main(void *arg) {
+  // behind live traffic, for the CPU and the disk
+  pid_t tid = syscall(SYS_gettid);
+  setpriority(PRIO_PROCESS, tid, 19);
+  syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (queue_head == NULL && ! stopping)
+      pthread_cond_wait(&cond, &lock);
+    if (stopping)
+      break;
+    struct branch_state *s = queue_head;
+    queue_head = s->next_queued;
+    if (queue_head == NULL)
+      queue_tail = NULL;
+    s->queued = false;
+    // states are only freed once the thread is gone
+    git_oid tip = s->wanted, old = s->warmed;
+    bool hasOld = s->has_warmed;
+    pthread_mutex_unlock(&lock);
+
+    warm(s->repo_path, s->branch, &tip, hasOld ? &old : NULL);
+
+    pthread_mutex_lock(&lock);
+    s->warmed = tip;
+    s->has_warmed = true;
+  }
+  pthread_mutex_unlock(&lock);
+
+  // the repository handles this thread opened
+  repo_cache_free();
+  return NULL;
+}
+
+static void poll_fn(void *arg) {
+  __atomic_store_n(&busy, workers_pending() > 0, __ATOMIC_RELAXED);
+}
+
+void prerender_init(struct mg_mgr *mgr, int budget_percent) {
+  if (budget_percent <= 0)
+    return;
+  budget = MIN(budget_percent, 100);
+  mg_timer_add(mgr, PRERENDER_POLL_MS, MG_TIMER_REPEAT, poll_fn, NULL);
+  started = pthread_create(&thread, NULL, prerender_main, NULL) == 0;
+}
+
+void prerender_stop(void) {
+  if (started) {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&cond);
+    pthread_cond_broadcast(&rest_cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    started = false;
+  }
+  while (states != NULL) {
+    struct branch_state *next = states->next;
+    free(states->repo_path);
+    free(states->branch);
+    free(states);
+    states = next;
+  }
+  queue_head = queue_tail = NULL;
+}
+
+void prerender_submit(const char *repo_path, const char *branch, const git_oid *tip) {
+  if (! started)
+    return;
+  pthread_mutex_lock(&lock);
+  struct branch_state *s;
+  for (s = states; s != NULL; s = s->next)
+    if (strcmp(s->repo_path, repo_path) == 0 && strcmp(s->branch, branch) == 0)
+      break;
+  if (s == NULL) {
+    s = calloc(1, sizeof(*s));
+    s->repo_path = strdup(repo_path);
+    s->branch = strdup(branch);
+    s->next = states;
+    states = s;
+  }
+  else if (git_oid_equal(&s->wanted, tip)) {
+    // queued or warmed already
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  // a queued branch that moved again is warmed at the newest tip only
+  s->wanted = *tip;
+  if (! s->queued) {
+    s->queued = true;
+    s->next_queued = NULL;
+    if (queue_tail) queue_tail->next_queued = s; else queue_head = s;
+    queue_tail = s;
+    pthread_cond_signal(&cond);
+  }
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,32 @@
+#ifndef PRERENDER_H
+#define PRERENDER_H
+
+#include <git2.h>
+#include <mongoose.h>
+
+// share of the time the warmup thread may be busy, see -p
+#define PRERENDER_BUDGET_PERCENT (10)
+// newest commits of a push whose diffs are computed ahead, older ones are
+// left to whoever visits them
+#define PRERENDER_MAX_COMMITS (16)
+// commits whose paths are indexed per step, pages needing the index wait
+// at most for one
+#define PRERENDER_PATHS_STEP (32)
+// how often the event loop tells the thread whether git pages are rendering
+#define PRERENDER_POLL_MS (100)
+
+// Warms the caches behind the git pages when a branch tip moves: the
+// commit index (log positions and the last change of each top level
+// entry), the top level tree and the diff stats of the new commits. One
+// background thread at idle CPU and I/O priority does it, resting after
+// each step so it is busy at most budget_percent of the time, and waiting
+// while git pages are queued or rendering. 0 disables it.
+void prerender_init(struct mg_mgr *mgr, int budget_percent);
+void prerender_stop(void);
+
+// Queues branch of the repository at repo_path for warming at tip, unless
+// that tip was warmed already. The catalog calls it whenever it reloads a
+// repository's refs, on its own thread.
+void prerender_submit(const char *repo_path, const char *branch, const git_oid *tip);
+
+#endif
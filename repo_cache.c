@@ -0,0 +1,163 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "repo_cache.h"
+#include "metrics.h"
+
+
+// what we stat to notice that a repo changed underneath us:
+// refs/heads (and the directories of nested branches below it) and
+// objects/pack get a new mtime whenever git renames a lockfile into
+// place, packed-refs and HEAD are replaced as a whole
+static const char * watched_files[] = {
+  "refs/heads",
+  "packed-refs",
+  "HEAD",
+  "objects/pack",
+};
+#define WATCHED_LEN (sizeof(watched_files) / sizeof(watched_files[0]))
+
+struct repo_entry {
+  char *path;
+  git_repository *repo;
+  unsigned long last_used;
+  struct timespec mtimes[WATCHED_LEN];
+  // metrics_now of the last stat_watched
+  uint64_t checked;
+  unsigned long generation;
+};
+
+// a git_repository must not be used by two threads at once, so every
+// thread (the worker threads) keeps its own set of handles
+static __thread struct repo_entry entries[REPO_CACHE_SIZE];
+static __thread unsigned long use_counter = 0;
+
+// bumped by repo_cache_invalidate for all threads, by hash of the path
+static unsigned long generations[REPO_CACHE_GENERATIONS];
+
+
+static unsigned long * generation(const char *path) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (const char *p = path; *p; p++)
+    hash = (hash ^ (unsigned char) *p) * 1099511628211ULL;
+  return &generations[hash % REPO_CACHE_GENERATIONS];
+}
+
+static bool newer(const struct timespec *a, const struct timespec *b) {
+  return a->tv_sec != b->tv_sec ? a->tv_sec > b->tv_sec : a->tv_nsec > b->tv_nsec;
+}
+// newest mtime of dir and the directories below it
+static void newest_mtime(const char *dir, struct timespec *mtime) {
+  DIR *d = opendir(dir);
+  if (d == NULL)
+    return;
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    if (e->d_name[0] == '.' || (e->d_type != DT_DIR && e->d_type != DT_UNKNOWN))
+      continue;
+    char buf[4096];
+    struct stat st;
+    snprintf(buf, sizeof(buf), "%s/%s", dir, e->d_name);
+    if (stat(buf, &st) != 0 || ! S_ISDIR(st.st_mode))
+      continue;
+    if (newer(&st.st_mtim, mtime))
+      *mtime = st.st_mtim;
+    newest_mtime(buf, mtime);
+  }
+  closedir(d);
+}
+
+static void stat_watched(const char *path, struct timespec *mtimes) {
+  char buf[4096];
+  for (int i = 0; i < WATCHED_LEN; i++) {
+    struct stat st;
+    snprintf(buf, sizeof(buf), "%s/%s", path, watched_files[i]);
+    if (stat(buf, &st) == 0)
+      mtimes[i] = st.st_mtim;
+    else
+      memset(&mtimes[i], 0, sizeof(mtimes[i]));
+    // a branch like x/y is renamed into refs/heads/x
+    if (i == 0)
+      newest_mtime(buf, &mtimes[i]);
+  }
+}
+static bool mtimes_equal(const struct timespec *a, const struct timespec *b) {
+  for (int i = 0; i < WATCHED_LEN; i++)
+    if (a[i].tv_sec != b[i].tv_sec || a[i].tv_nsec != b[i].tv_nsec)
+      return false;
+  return true;
+}
+static void entry_free(struct repo_entry *e) {
+  git_repository_free(e->repo);
+  free(e->path);
+  memset(e, 0, sizeof(*e));
+}
+
+git_repository * repo_cache_open(const char *path) {
+  uint64_t now = metrics_now();
+  unsigned long gen = __atomic_load_n(generation(path), __ATOMIC_ACQUIRE);
+  struct timespec mtimes[WATCHED_LEN];
+  bool statted = false;
+
+  struct repo_entry *victim = &entries[0];
+  for (int i = 0; i < REPO_CACHE_SIZE; i++) {
+    struct repo_entry *e = &entries[i];
+    if (e->repo != NULL && strcmp(e->path, path) == 0) {
+      // the walk below refs/heads is a stat per directory, so a handle
+      // checked recently is trusted, pushes seen by inotify invalidate it
+      bool fresh = e->generation == gen && now - e->checked < REPO_CACHE_REVALIDATE_MS * 1000000ULL;
+      if (! fresh && e->generation == gen) {
+        stat_watched(path, mtimes);
+        statted = true;
+        fresh = mtimes_equal(e->mtimes, mtimes);
+        if (fresh)
+          e->checked = now;
+      }
+      if (fresh) {
+        e->last_used = ++use_counter;
+        metrics_cache(METRICS_CACHE_REPO, true);
+        return e->repo;
+      }
+      // stale, reopen in place
+      victim = e;
+      break;
+    }
+    // prefer empty slots, then the least recently used one
+    if (victim->repo != NULL && (e->repo == NULL || e->last_used < victim->last_used))
+      victim = e;
+  }
+
+  metrics_cache(METRICS_CACHE_REPO, false);
+  // before opening, so a change in between is noticed next time
+  if (! statted)
+    stat_watched(path, mtimes);
+  git_repository *repo = NULL;
+  if (git_repository_open_bare(&repo, path) != 0)
+    return NULL;
+
+  if (victim->repo != NULL)
+    entry_free(victim);
+
+  victim->path = strdup(path);
+  victim->repo = repo;
+  victim->last_used = ++use_counter;
+  memcpy(victim->mtimes, mtimes, sizeof(mtimes));
+  victim->checked = now;
+  victim->generation = gen;
+  return repo;
+}
+
+void repo_cache_invalidate(const char *path) {
+  __atomic_add_fetch(generation(path), 1, __ATOMIC_RELEASE);
+}
+
+void repo_cache_free(void) {
+  for (int i = 0; i < REPO_CACHE_SIZE; i++)
+    if (entries[i].repo != NULL)
+      entry_free(&entries[i]);
+}
@@ -0,0 +1,26 @@
+#ifndef REPO_CACHE_H
+#define REPO_CACHE_H
+
+#include <git2.h>
+
+#define REPO_CACHE_SIZE (16)
+// invalidations are counted per path hash, collisions only cost a reopen
+#define REPO_CACHE_GENERATIONS (256)
+// how long a handle is trusted before refs and packs are stat'ed again
+#define REPO_CACHE_REVALIDATE_MS (1000)
+
+// Returns an open handle for the bare repository at path, or NULL.
+// The handle stays owned by the cache; callers must not free it.
+// Caches are per thread, handles must not be passed to other threads.
+// A handle is reopened when the repository was invalidated, or when refs
+// or packs changed on disk since it was opened, which is checked at most
+// every REPO_CACHE_REVALIDATE_MS.
+git_repository * repo_cache_open(const char *path);
+
+// Makes every thread reopen the repository on its next use, e.g. when
+// inotify saw its refs change or it was deleted. Any thread.
+void repo_cache_invalidate(const char *path);
+// Everything cached by the calling thread.
+void repo_cache_free(void);
+
+#endif
@@ -0,0 +1,223 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#include "routes.h"
+
+
+// one node per url byte, children as a sibling list (a few dozen routes)
+struct node {
+  struct node *child, *sibling;
+  unsigned char c;
+  const struct route *exact, *prefix;
+};
+
+struct table {
+  struct route *routes;
+  size_t len;
+  struct node *root;
+};
+
+static struct table table = { NULL, 0, NULL };
+
+static const char * kind_names[] = {
+  [ROUTE_FILE] = "file",
+  [ROUTE_DIR] = "dir",
+  [ROUTE_MEDIA] = "media",
+  [ROUTE_GIT] = "git",
+  [ROUTE_ARCHIVE] = "archive",
+  [ROUTE_SEARCH] = "search",
+  [ROUTE_METRICS] = "metrics",
+  [ROUTE_COMMAND] = "command",
+};
+#define KINDS_LEN (sizeof(kind_names) / sizeof(kind_names[0]))
+
+
+static bool is_prefix_kind(enum route_kind kind) {
+  return kind == ROUTE_DIR || kind == ROUTE_MEDIA || kind == ROUTE_GIT || kind == ROUTE_ARCHIVE;
+}
+
+static void node_free(struct node *n) {
+  while (n != NULL) {
+    struct node *next = n->sibling;
+    node_free(n->child);
+    free(n);
+    n = next;
+  }
+}
+
+static void table_free(struct table *t) {
+  for (size_t i = 0; i < t->len; i++) {
+    free(t->routes[i].url);
+    free(t->routes[i].target);
+  }
+  free(t->routes);
+  node_free(t->root);
+  memset(t, 0, sizeof(*t));
+}
+
+// false if the url already has a route of the same sort
+static bool insert(struct node *root, const struct route *r) {
+  struct node *n = root;
+  for (const char *p = r->url; *p != '\0'; p++) {
+    struct node *child;
+    for (child = n->child; child != NULL; child = child->sibling)
+      if (child->c == (unsigned char) *p)
+        break;
+    if (child == NULL) {
+      child = calloc(1, sizeof(*child));
+      child->c = *p;
+      child->sibling = n->child;
+      n->child = child;
+    }
+    n = child;
+  }
+  const struct route **slot = is_prefix_kind(r->kind) ? &n->prefix : &n->exact;
+  if (*slot != NULL)
+    return false;
+  *slot = r;
+  return true;
+}
+
+static char * trim(char *s) {
+  while (isspace((unsigned char) *s))
+    s++;
+  size_t len = strlen(s);
+  while (len > 0 && isspace((unsigned char) s[len - 1]))
+    s[--len] = '\0';
+  return s;
+}
+
+// one line into r, NULL or the reason it is wrong
+static const char * parse_line(char *line, struct route *r) {
+  char *kind = line;
+  char *url = kind + strcspn(kind, " \t");
+  if (*url == '\0')
+    return "missing url";
+  *url++ = '\0';
+  url = trim(url);
+  char *target = url + strcspn(url, " \t");
+  if (*target != '\0')
+    *target++ = '\0';
+  // the rest of the line, paths and commands may contain spaces
+  target = trim(target);
+
+  size_t k;
+  for (k = 0; k < KINDS_LEN; k++)
+    if (strcmp(kind, kind_names[k]) == 0)
+      break;
+  if (k == KINDS_LEN)
+    return "unknown kind";
+  r->kind = k;
+
+  if (url[0] != '/')
+    return "url must start with /";
+  // prefix routes are stored without the trailing slash, / stays /
+  size_t urlLen = strlen(url);
+  if (is_prefix_kind(r->kind) && urlLen > 1 && url[urlLen - 1] == '/')
+    url[urlLen - 1] = '\0';
+  // the git pages link to /git/..., see serve_git
+  if (r->kind == ROUTE_GIT && strcmp(url, "/git") != 0)
+    return "git pages can only be mounted at /git";
+  if (r->kind == ROUTE_ARCHIVE && strcmp(url, "/archive") != 0)
+    return "archives can only be mounted at /archive";
+
+  bool needsTarget = r->kind != ROUTE_SEARCH && r->kind != ROUTE_METRICS && r->kind != ROUTE_ARCHIVE;
+  if (needsTarget && target[0] == '\0')
+    return "missing target";
+  if (! needsTarget && target[0] != '\0')
+    return "unexpected target";
+
+  r->url = strdup(url);
+  r->target = strdup(target);
+  r->file = r->kind == ROUTE_FILE ? static_cache_open(target) : NULL;
+  return NULL;
+}
+
+bool routes_load(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "cannot read routes from %s\n", path);
+    return false;
+  }
+
+  struct table t = { NULL, 0, calloc(1, sizeof(struct node)) };
+  size_t cap = 0;
+  bool ok = true;
+  char buf[4096];
+  for (int lineNo = 1; fgets(buf, sizeof(buf), fp) != NULL; lineNo++) {
+    buf[strcspn(buf, "#")] = '\0';
+    char *line = trim(buf);
+    if (line[0] == '\0')
+      continue;
+
+    if (t.len == cap) {
+      cap = cap ? cap * 2 : 32;
+      t.routes = realloc(t.routes, cap * sizeof(*t.routes));
+    }
+    struct route *r = &t.routes[t.len];
+    memset(r, 0, sizeof(*r));
+    const char *error = parse_line(line, r);
+    if (error != NULL) {
+      fprintf(stderr, "%s:%d: %s\n", path, lineNo, error);
+      free(r->url);
+      free(r->target);
+      ok = false;
+      continue;
+    }
+    t.len++;
+  }
+  fclose(fp);
+
+  // the trie points into routes, so it is built once routes stopped moving
+  for (size_t i = 0; ok && i < t.len; i++) {
+    if (! insert(t.root, &t.routes[i])) {
+      fprintf(stderr, "%s: %s is routed twice\n", path, t.routes[i].url);
+      ok = false;
+    }
+  }
+
+  if (! ok) {
+    table_free(&t);
+    return false;
+  }
+  table_free(&table);
+  table = t;
+  return true;
+}
+
+const struct route * routes_match(struct mg_str uri) {
+  if (table.root == NULL)
+    return NULL;
+  const struct route *best = NULL;
+  struct node *n = table.root;
+  size_t i = 0;
+  for (;;) {
+    // a prefix route covers the url itself and everything below it
+    if (n->prefix != NULL && (i == uri.len || uri.ptr[i] == '/' || (i > 0 && uri.ptr[i - 1] == '/')))
+      best = n->prefix;
+    if (i == uri.len)
+      return n->exact != NULL ? n->exact : best;
+
+    struct node *child;
+    for (child = n->child; child != NULL; child = child->sibling)
+      if (child->c == (unsigned char) uri.ptr[i])
+        break;
+    if (child == NULL)
+      return best;
+    n = child;
+    i++;
+  }
+}
+
+const struct route * routes_find(enum route_kind kind) {
+  for (size_t i = 0; i < table.len; i++)
+    if (table.routes[i].kind == kind)
+      return &table.routes[i];
+  return NULL;
+}
+
+void routes_free(void) {
+  table_free(&table);
+}
@@ -0,0 +1,44 @@
+#ifndef ROUTES_H
+#define ROUTES_H
+
+#include <stdbool.h>
+#include <mongoose.h>
+
+#include "static_cache.h"
+
+enum route_kind {
+  ROUTE_FILE,     // exact url, a file kept in memory
+  ROUTE_DIR,      // url prefix, files (not listings) below a directory via mongoose
+  ROUTE_MEDIA,    // url prefix, files below a directory with ranges, see media.h
+  ROUTE_GIT,      // /git and everything below it
+  ROUTE_ARCHIVE,  // url prefix, snapshots of the git repositories
+  ROUTE_SEARCH,   // exact url
+  ROUTE_METRICS,  // exact url
+  ROUTE_COMMAND,  // exact url, runs a shell command
+};
+
+struct route {
+  enum route_kind kind;
+  char *url;
+  char *target;
+  // ROUTE_FILE only
+  struct static_file *file;
+};
+
+// Reads "<kind> <url> [<target>]" lines, # starts a comment, e.g.
+//   file   /portfolio  html/portfolio.html
+//   media  /clips      /mnt/hdd/clips
+// Prefix routes match the url itself and everything below it (/clips and
+// /clips/a, not /clipsx), the longest match wins, exact routes beat
+// prefix ones. On errors the previous table stays in use and false is
+// returned. Only used from the event loop.
+bool routes_load(const char *path);
+
+const struct route * routes_match(struct mg_str uri);
+
+// First route of the given kind, e.g. to find the git root.
+const struct route * routes_find(enum route_kind kind);
+
+void routes_free(void);
+
+#endif
@@ -0,0 +1,715 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <regex.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "search.h"
+#include "repo_cache.h"
+#include "metrics.h"
+
+
+#define MIN(a,b) (a<b?a:b)
+
+#define SEARCH_MAGIC "GSI1"
+
+// On disk: header, files, trigrams, postings, paths. Trigrams are sorted,
+// each points to a sorted run of file ids in postings.
+struct index_header {
+  char magic[4];
+  uint32_t files, trigrams, postings, paths_size;
+  git_oid tip;
+};
+struct index_file {
+  git_oid blob;
+  uint32_t path; // offset into paths
+};
+struct index_trigram {
+  uint32_t trigram, first, count;
+};
+
+struct search_index {
+  char *repo_path;
+  unsigned long last_used;
+  // guarded by lock
+  int refs;
+
+  void *map;
+  size_t map_len;
+  const struct index_header *header;
+  const struct index_file *files;
+  const struct index_trigram *trigrams;
+  const uint32_t *postings;
+  const char *paths;
+};
+
+// repos whose index is being rebuilt, so two queries don't build the same
+// one. Builds run without the lock, the second query waits on build_cond.
+struct building {
+  struct building *next;
+  const char *repo_path;
+};
+
+// guards the table, refcounts and the building list
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t build_cond = PTHREAD_COND_INITIALIZER;
+static struct building *building = NULL;
+static struct search_index *indexes[SEARCH_CACHE_SIZE];
+static unsigned long use_counter = 0;
+static char *index_dir = NULL;
+
+
+void search_init(const char *dir) {
+  index_dir = strdup(dir);
+  mkdir(index_dir, 0755);
+}
+
+static void index_free(struct search_index *index) {
+  if (index->map != NULL)
+    munmap(index->map, index->map_len);
+  free(index->repo_path);
+  free(index);
+}
+static void index_release(struct search_index *index) {
+  pthread_mutex_lock(&lock);
+  if (--index->refs == 0)
+    index_free(index);
+  pthread_mutex_unlock(&lock);
+}
+
+static void index_file_path(char *buf, size_t len, const char *repo_path) {
+  const char *name = strrchr(repo_path, '/');
+  snprintf(buf, len, "%s/%s.idx", index_dir, name != NULL ? name + 1 : repo_path);
+}
+
+static struct search_index * index_map(const char *repo_path) {
+  char path[4096];
+  index_file_path(path, sizeof(path), repo_path);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= sizeof(struct index_header))
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  const struct index_header *h = map;
+  size_t expected = sizeof(*h) + (size_t) h->files * sizeof(struct index_file) +
+    (size_t) h->trigrams * sizeof(struct index_trigram) + (size_t) h->postings * sizeof(uint32_t) + h->paths_size;
+  if (memcmp(h->magic, SEARCH_MAGIC, 4) != 0 || expected != st.st_size) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  struct search_index *index = calloc(1, sizeof(*index));
+  index->repo_path = strdup(repo_path);
+  index->refs = 1;
+  index->map = map;
+  index->map_len = st.st_size;
+  index->header = h;
+  index->files = (const void *) (h + 1);
+  index->trigrams = (const void *) (index->files + h->files);
+  index->postings = (const void *) (index->trigrams + h->trigrams);
+  index->paths = (const char *) (index->postings + h->postings);
+  return index;
+}
+
+
+// Index building. Pairs are (trigram << 32 | file id), sorted at the end.
+struct builder {
+  git_repository *repo;
+  struct index_file *files;
+  size_t files_len, files_cap;
+  char *paths;
+  size_t paths_len, paths_cap;
+  uint64_t *pairs;
+  size_t pairs_len, pairs_cap;
+  // scratch for the trigrams of one blob
+  uint32_t *trigrams;
+  size_t trigrams_cap;
+};
+
+static uint32_t trigram_at(const unsigned char *p) {
+  return (uint32_t) tolower(p[0]) << 16 | (uint32_t) tolower(p[1]) << 8 | (uint32_t) tolower(p[2]);
+}
+static int compare_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+  return x < y ? -1 : x > y;
+}
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+static void push_pair(struct builder *b, uint32_t trigram, uint32_t file) {
+  if (b->pairs_len == b->pairs_cap) {
+    b->pairs_cap = b->pairs_cap ? b->pairs_cap * 2 : 65536;
+    b->pairs = realloc(b->pairs, b->pairs_cap * sizeof(*b->pairs));
+  }
+  b->pairs[b->pairs_len++] = (uint64_t) trigram << 32 | file;
+}
+static uint32_t push_file(struct builder *b, const git_oid *blob, const char *path) {
+  size_t len = strlen(path) + 1;
+  if (b->paths_len + len > b->paths_cap) {
+    while (b->paths_len + len > b->paths_cap)
+      b->paths_cap = b->paths_cap ? b->paths_cap * 2 : 65536;
+    b->paths = realloc(b->paths, b->paths_cap);
+  }
+  memcpy(b->paths + b->paths_len, path, len);
+  if (b->files_len == b->files_cap) {
+    b->files_cap = b->files_cap ? b->files_cap * 2 : 1024;
+    b->files = realloc(b->files, b->files_cap * sizeof(*b->files));
+  }
+  b->files[b->files_len].blob = *blob;
+  b->files[b->files_len].path = b->paths_len;
+  b->paths_len += len;
+  return b->files_len++;
+}
+
+// Reads a blob and adds it with its distinct trigrams
+static void add_blob(struct builder *b, const git_oid *oid, const char *path) {
+  uint64_t start = metrics_now();
+  git_blob *blob;
+  int res = git_blob_lookup(&blob, b->repo, oid);
+  metrics_git(METRICS_GIT_BLOB, start);
+  if (res != 0)
+    return;
+  size_t size = git_blob_rawsize(blob);
+  if (size > SEARCH_MAX_BLOB || git_blob_is_binary(blob)) {
+    git_blob_free(blob);
+    return;
+  }
+  const unsigned char *data = git_blob_rawcontent(blob);
+
+  if (size > b->trigrams_cap) {
+    b->trigrams_cap = size;
+    b->trigrams = realloc(b->trigrams, b->trigrams_cap * sizeof(*b->trigrams));
+  }
+  size_t n = 0;
+  for (size_t i = 0; i + 3 <= size; i++) {
+    // queries are matched per line
+    if (data[i] == '\n' || data[i + 1] == '\n' || data[i + 2] == '\n')
+      continue;
+    b->trigrams[n++] = trigram_at(data + i);
+  }
+  qsort(b->trigrams, n, sizeof(*b->trigrams), compare_u32);
+
+  uint32_t file = push_file(b, oid, path);
+  for (size_t i = 0; i < n; i++)
+    if (i == 0 || b->trigrams[i] != b->trigrams[i - 1])
+      push_pair(b, b->trigrams[i], file);
+  git_blob_free(blob);
+}
+
+static int walk_cb(const char *root, const git_tree_entry *entry, void *payload) {
+  if (git_tree_entry_type(entry) != GIT_OBJECT_BLOB)
+    return 0;
+  char path[4096];
+  snprintf(path, sizeof(path), "%s%s", root, git_tree_entry_name(entry));
+  add_blob(payload, git_tree_entry_id(entry), path);
+  return 0;
+}
+
+static int compare_str(const void *a, const void *b) {
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Carries over the files of old that didn't change between its tip and
+// tree, then reads the blobs that did. false if old can't be used.
+static bool build_incremental(struct builder *b, struct search_index *old, git_tree *tree) {
+  git_commit *oldCommit;
+  git_tree *oldTree;
+  git_diff *diff;
+  if (git_commit_lookup(&oldCommit, b->repo, &old->header->tip) != 0)
+    return false;
+  bool ok = git_commit_tree(&oldTree, oldCommit) == 0;
+  git_commit_free(oldCommit);
+  if (! ok)
+    return false;
+  uint64_t start = metrics_now();
+  ok = git_diff_tree_to_tree(&diff, b->repo, oldTree, tree, NULL) == 0;
+  metrics_git(METRICS_GIT_DIFF, start);
+  git_tree_free(oldTree);
+  if (! ok)
+    return false;
+
+  size_t deltas = git_diff_num_deltas(diff);
+  const char **changed = malloc((deltas > 0 ? deltas : 1) * sizeof(*changed));
+  for (size_t i = 0; i < deltas; i++)
+    changed[i] = git_diff_get_delta(diff, i)->old_file.path;
+  qsort(changed, deltas, sizeof(*changed), compare_str);
+
+  uint32_t oldFiles = old->header->files;
+  uint32_t *remap = malloc((oldFiles > 0 ? oldFiles : 1) * sizeof(*remap));
+  for (uint32_t i = 0; i < oldFiles; i++) {
+    const char *path = old->paths + old->files[i].path;
+    remap[i] = bsearch(&path, changed, deltas, sizeof(*changed), compare_str) != NULL
+      ? UINT32_MAX
+      : push_file(b, &old->files[i].blob, path);
+  }
+  for (uint32_t t = 0; t < old->header->trigrams; t++) {
+    const struct index_trigram *tri = &old->trigrams[t];
+    for (uint32_t p = tri->first; p < tri->first + tri->count; p++)
+      if (remap[old->postings[p]] != UINT32_MAX)
+        push_pair(b, tri->trigram, remap[old->postings[p]]);
+  }
+
+  for (size_t i = 0; i < deltas; i++) {
+    const git_diff_delta *delta = git_diff_get_delta(diff, i);
+    if (delta->status != GIT_DELTA_DELETED)
+      add_blob(b, &delta->new_file.id, delta->new_file.path);
+  }
+
+  free(remap);
+  free(changed);
+  git_diff_free(diff);
+  return true;
+}
+
+static bool write_index(struct builder *b, const char *repo_path, const git_oid *tip) {
+  qsort(b->pairs, b->pairs_len, sizeof(*b->pairs), compare_u64);
+
+  struct index_header h;
+  memcpy(h.magic, SEARCH_MAGIC, 4);
+  h.files = b->files_len;
+  h.postings = b->pairs_len;
+  h.paths_size = b->paths_len;
+  h.tip = *tip;
+  h.trigrams = 0;
+  for (size_t i = 0; i < b->pairs_len; i++)
+    if (i == 0 || (b->pairs[i] >> 32) != (b->pairs[i - 1] >> 32))
+      h.trigrams++;
+
+  char path[4096], tmp[4096 + 32];
+  index_file_path(path, sizeof(path), repo_path);
+  snprintf(tmp, sizeof(tmp), "%s.%lx.tmp", path, (unsigned long) pthread_self());
+  FILE *f = fopen(tmp, "wb");
+  if (f == NULL)
+    return false;
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+  ok = ok && fwrite(b->files, sizeof(*b->files), b->files_len, f) == b->files_len;
+  for (size_t i = 0; ok && i < b->pairs_len; ) {
+    struct index_trigram t = { b->pairs[i] >> 32, i, 0 };
+    while (i < b->pairs_len && (b->pairs[i] >> 32) == t.trigram) {
+      t.count++;
+      i++;
+    }
+    ok = fwrite(&t, sizeof(t), 1, f) == 1;
+  }
+  for (size_t i = 0; ok && i < b->pairs_len; i++) {
+    uint32_t file = (uint32_t) b->pairs[i];
+    ok = fwrite(&file, sizeof(file), 1, f) == 1;
+  }
+  ok = ok && fwrite(b->paths, 1, b->paths_len, f) == b->paths_len;
+  ok = fclose(f) == 0 && ok;
+  if (ok)
+    ok = rename(tmp, path) == 0;
+  if (! ok)
+    remove(tmp);
+  return ok;
+}
+
+static struct search_index * index_build(git_repository *repo, const char *repo_path, const git_oid *tip,
+  struct search_index *old)
+{
+  git_commit *commit;
+  git_tree *tree;
+  if (git_commit_lookup(&commit, repo, tip) != 0)
+    return NULL;
+  bool ok = git_commit_tree(&tree, commit) == 0;
+  git_commit_free(commit);
+  if (! ok)
+    return NULL;
+
+  struct builder b;
+  memset(&b, 0, sizeof(b));
+  b.repo = repo;
+  if (old == NULL || ! build_incremental(&b, old, tree)) {
+    b.files_len = b.paths_len = b.pairs_len = 0;
+    git_tree_walk(tree, GIT_TREEWALK_PRE, walk_cb, &b);
+  }
+  git_tree_free(tree);
+
+  ok = write_index(&b, repo_path, tip);
+  free(b.files);
+  free(b.paths);
+  free(b.pairs);
+  free(b.trigrams);
+  return ok ? index_map(repo_path) : NULL;
+}
+
+// Slot of repo_path in the table, mapped from disk if it isn't there.
+// Takes the least recently used slot otherwise. Called with lock held.
+static int index_slot(const char *repo_path) {
+  int slot = -1;
+  for (int i = 0; i < SEARCH_CACHE_SIZE; i++) {
+    if (indexes[i] != NULL && strcmp(indexes[i]->repo_path, repo_path) == 0)
+      return i;
+    if (slot < 0 || indexes[i] == NULL ||
+        (indexes[slot] != NULL && indexes[i]->last_used < indexes[slot]->last_used))
+      slot = i;
+  }
+  struct search_index *index = indexes[slot];
+  // evicted, readers keep their reference
+  if (index != NULL && --index->refs == 0)
+    index_free(index);
+  indexes[slot] = index_map(repo_path);
+  return slot;
+}
+
+static bool is_building(const char *repo_path) {
+  for (struct building *b = building; b != NULL; b = b->next)
+    if (strcmp(b->repo_path, repo_path) == 0)
+      return true;
+  return false;
+}
+
+// Index for the repo's current tip, rebuilt if the tip moved. The lock is
+// only held for the table, so a big rebuild doesn't hold up other repos.
+static struct search_index * index_get(git_repository *repo, const char *repo_path, const git_oid *tip) {
+  pthread_mutex_lock(&lock);
+  while (is_building(repo_path))
+    pthread_cond_wait(&build_cond, &lock);
+
+  struct search_index *index = indexes[index_slot(repo_path)];
+  if (index == NULL || ! git_oid_equal(&index->header->tip, tip)) {
+    struct building b = { building, repo_path };
+    building = &b;
+    // the old index is read by the incremental build
+    if (index != NULL)
+      index->refs++;
+    pthread_mutex_unlock(&lock);
+
+    struct search_index *fresh = index_build(repo, repo_path, tip, index);
+
+    pthread_mutex_lock(&lock);
+    struct building **p = &building;
+    while (*p != &b)
+      p = &(*p)->next;
+    *p = b.next;
+    pthread_cond_broadcast(&build_cond);
+
+    if (index != NULL && --index->refs == 0)
+      index_free(index);
+    // the table may have changed meanwhile
+    int slot = index_slot(repo_path);
+    if (fresh != NULL) {
+      if (indexes[slot] != NULL && --indexes[slot]->refs == 0)
+        index_free(indexes[slot]);
+      indexes[slot] = fresh;
+    }
+    index = indexes[slot];
+  }
+  if (index != NULL) {
+    index->refs++;
+    index->last_used = ++use_counter;
+  }
+  pthread_mutex_unlock(&lock);
+  return index;
+}
+
+static const struct index_trigram * find_trigram(struct search_index *index, uint32_t trigram) {
+  size_t lo = 0, hi = index->header->trigrams;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (index->trigrams[mid].trigram < trigram)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < index->header->trigrams && index->trigrams[lo].trigram == trigram ? &index->trigrams[lo] : NULL;
+}
+
+// Collects the literal runs of a regex that every match must contain, as
+// "ab\0cd\0\0". Groups may be optional or repeated, so only text outside
+// of them counts. Returns false if there is nothing we can rely on (|).
+static bool regex_literals(const char *re, char *out, size_t out_len) {
+  size_t n = 0;
+  int depth = 0;
+  for (const char *p = re; *p != '\0' && n + 3 < out_len; p++) {
+    char c = *p;
+    bool literal = false;
+    if (c == '|') {
+      return false;
+    }
+    else if (c == '\\') {
+      if (p[1] == '\0')
+        break;
+      // \w, \1 and friends are classes or backrefs
+      literal = ! isalnum((unsigned char) p[1]);
+      c = *++p;
+    }
+    else if (c == '[') {
+      p++;
+      if (*p == '^') p++;
+      if (*p == ']') p++;
+      while (*p != '\0' && *p != ']') p++;
+      if (*p == '\0') break;
+    }
+    else if (c == '{') {
+      while (*p != '\0' && *p != '}') p++;
+      if (*p == '\0') break;
+    }
+    else if (c == '(') {
+      depth++;
+    }
+    else if (c == ')') {
+      depth--;
+    }
+    else {
+      literal = strchr(".^$*+?", c) == NULL;
+    }
+
+    // an optional char doesn't have to be there
+    if (p[1] == '*' || p[1] == '?' || p[1] == '{')
+      literal = false;
+    if (literal && depth == 0) {
+      out[n++] = c;
+      // x+ is x at least once, but what follows isn't adjacent
+      if (p[1] == '+')
+        out[n++] = '\0';
+    }
+    else if (n > 0 && out[n - 1] != '\0') {
+      out[n++] = '\0';
+    }
+  }
+  if (n > 0 && out[n - 1] != '\0')
+    out[n++] = '\0';
+  out[n] = '\0';
+  return true;
+}
+
+static void add_query_trigrams(const char *s, uint32_t *trigrams, size_t *len, size_t max) {
+  size_t slen = strlen(s);
+  for (size_t i = 0; i + 3 <= slen && *len < max; i++)
+    trigrams[(*len)++] = trigram_at((const unsigned char *) s + i);
+}
+
+// File ids that contain all trigrams, sorted. NULL with *len = -1 means
+// no prefilter (every file is a candidate).
+static uint32_t * candidates(struct search_index *index, uint32_t *trigrams, size_t trigrams_len, long *len) {
+  if (trigrams_len == 0) {
+    *len = -1;
+    return NULL;
+  }
+  // intersect starting with the rarest trigram
+  const struct index_trigram *lists[64];
+  size_t lists_len = 0;
+  qsort(trigrams, trigrams_len, sizeof(*trigrams), compare_u32);
+  for (size_t i = 0; i < trigrams_len && lists_len < 64; i++) {
+    if (i > 0 && trigrams[i] == trigrams[i - 1])
+      continue;
+    const struct index_trigram *t = find_trigram(index, trigrams[i]);
+    if (t == NULL) {
+      *len = 0;
+      return NULL;
+    }
+    lists[lists_len++] = t;
+  }
+  size_t rarest = 0;
+  for (size_t i = 1; i < lists_len; i++)
+    if (lists[i]->count < lists[rarest]->count)
+      rarest = i;
+
+  uint32_t *result = malloc((lists[rarest]->count + 1) * sizeof(*result));
+  size_t n = lists[rarest]->count;
+  memcpy(result, index->postings + lists[rarest]->first, n * sizeof(*result));
+  for (size_t l = 0; l < lists_len && n > 0; l++) {
+    if (l == rarest)
+      continue;
+    const uint32_t *p = index->postings + lists[l]->first, *end = p + lists[l]->count;
+    size_t kept = 0;
+    for (size_t i = 0; i < n; i++) {
+      while (p < end && *p < result[i])
+        p++;
+      if (p < end && *p == result[i])
+        result[kept++] = result[i];
+    }
+    n = kept;
+  }
+  *len = n;
+  return result;
+}
+
+static const char * find_literal(const char *line, size_t len, const char *query, size_t query_len) {
+  for (size_t i = 0; i + query_len <= len; i++)
+    if (strncasecmp(line + i, query, query_len) == 0)
+      return line + i;
+  return NULL;
+}
+
+struct query {
+  const char *text;
+  size_t text_len;
+  bool regex;
+  regex_t re;
+  // prefilter, the same for every repository
+  uint32_t trigrams[256];
+  size_t trigrams_len;
+  // blob bytes read so far
+  size_t scanned;
+  const char *repo_name, *branch;
+  git_oid tip;
+  search_hit_fn fn;
+  void *arg;
+  int hits;
+};
+
+// Checks one candidate file line by line, false once we should stop
+static bool search_file(struct query *q, git_repository *repo, struct search_index *index, uint32_t file) {
+  uint64_t start = metrics_now();
+  git_blob *blob;
+  int res = git_blob_lookup(&blob, repo, &index->files[file].blob);
+  metrics_git(METRICS_GIT_BLOB, start);
+  if (res != 0)
+    return true;
+  const char *data = git_blob_rawcontent(blob);
+  size_t size = git_blob_rawsize(blob);
+  q->scanned += size;
+  const char *path = index->paths + index->files[file].path;
+
+  bool go = true;
+  int fileHits = 0;
+  size_t lineNo = 1;
+  for (const char *line = data, *end = data + size; line < end && go && fileHits < SEARCH_MAX_HITS_PER_FILE; lineNo++) {
+    const char *eol = memchr(line, '\n', end - line);
+    if (eol == NULL)
+      eol = end;
+    bool match;
+    if (q->regex) {
+      regmatch_t m = { .rm_so = 0, .rm_eo = eol - line };
+      match = regexec(&q->re, line, 1, &m, REG_STARTEND) == 0;
+    }
+    else {
+      match = find_literal(line, eol - line, q->text, q->text_len) != NULL;
+    }
+    if (match) {
+      fileHits++;
+      go = q->fn(q->arg, q->repo_name, q->branch, &q->tip, path, lineNo, line, eol - line) &&
+        ++q->hits < SEARCH_MAX_HITS;
+    }
+    line = eol + 1;
+  }
+  git_blob_free(blob);
+  return go;
+}
+
+static bool search_repo(struct query *q, const char *root, const char *name) {
+  char repoPath[4096];
+  snprintf(repoPath, sizeof(repoPath), "%s/%s", root, name);
+  git_repository *repo = repo_cache_open(repoPath);
+  if (repo == NULL)
+    return true;
+
+  git_reference *head;
+  if (git_repository_head(&head, repo) != 0)
+    return true;
+  const git_oid *tip = git_reference_target(head);
+  if (tip == NULL) {
+    git_reference_free(head);
+    return true;
+  }
+  q->tip = *tip;
+  q->branch = git_reference_shorthand(head);
+  q->repo_name = name;
+
+  struct search_index *index = index_get(repo, repoPath, tip);
+  if (index == NULL) {
+    git_reference_free(head);
+    return true;
+  }
+
+  // candidates sorts its copy
+  uint32_t trigrams[256];
+  memcpy(trigrams, q->trigrams, q->trigrams_len * sizeof(*trigrams));
+  long candidatesLen;
+  uint32_t *files = candidates(index, trigrams, q->trigrams_len, &candidatesLen);
+  bool go = true;
+  if (candidatesLen < 0) {
+    for (uint32_t i = 0; i < index->header->files && go && q->scanned < SEARCH_MAX_SCAN; i++)
+      go = search_file(q, repo, index, i);
+  }
+  else {
+    for (long i = 0; i < candidatesLen && go; i++)
+      go = search_file(q, repo, index, files[i]);
+  }
+  free(files);
+
+  index_release(index);
+  git_reference_free(head);
+  return go;
+}
+
+int search_run(const char *root, const char *repo, const char *query, bool regex,
+  search_hit_fn fn, void *arg)
+{
+  struct query q;
+  memset(&q, 0, sizeof(q));
+  q.text = query;
+  q.text_len = strlen(query);
+  q.regex = regex;
+  q.fn = fn;
+  q.arg = arg;
+  if (q.text_len == 0)
+    return 0;
+  if (regex && regcomp(&q.re, query, REG_EXTENDED | REG_ICASE | REG_NEWLINE | REG_NOSUB) != 0)
+    return -1;
+
+  if (regex) {
+    char literals[512];
+    if (regex_literals(query, literals, sizeof(literals)))
+      for (const char *l = literals; *l != '\0'; l += strlen(l) + 1)
+        add_query_trigrams(l, q.trigrams, &q.trigrams_len, 256);
+  }
+  else {
+    add_query_trigrams(query, q.trigrams, &q.trigrams_len, 256);
+  }
+  // without prefilter every blob of every repository would be read
+  if (q.trigrams_len == 0 && repo == NULL) {
+    if (regex)
+      regfree(&q.re);
+    return -2;
+  }
+
+  if (repo != NULL) {
+    search_repo(&q, root, repo);
+  }
+  else {
+    DIR *dir = opendir(root);
+    struct dirent *e;
+    while (dir != NULL && (e = readdir(dir)) != NULL) {
+      size_t len = strlen(e->d_name);
+      if (len > 4 && strcmp(e->d_name + len - 4, ".git") == 0)
+        if (! search_repo(&q, root, e->d_name))
+          break;
+    }
+    if (dir != NULL)
+      closedir(dir);
+  }
+
+  if (regex)
+    regfree(&q.re);
+  return q.hits;
+}
+
+void search_free(void) {
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < SEARCH_CACHE_SIZE; i++) {
+    if (indexes[i] != NULL && --indexes[i]->refs == 0)
+      index_free(indexes[i]);
+    indexes[i] = NULL;
+  }
+  pthread_mutex_unlock(&lock);
+  free(index_dir);
+  index_dir = NULL;
+}
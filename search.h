@@ -0,0 +1,39 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <git2.h>
+
+// blobs above this size or binary ones are not indexed
+#define SEARCH_MAX_BLOB (1024*1024)
+#define SEARCH_MAX_HITS (200)
+#define SEARCH_MAX_HITS_PER_FILE (10)
+// blob bytes a query without trigram prefilter (no literal run of 3
+// characters) may read, it has to scan every file
+#define SEARCH_MAX_SCAN (16*1024*1024)
+// indexes kept mapped at once
+#define SEARCH_CACHE_SIZE (16)
+
+// Trigram index over the blobs at the tip of each repository's default
+// branch, one memory mapped file per repository in index_dir. When the
+// tip moved, the next query rebuilds the index from the old one and only
+// reads the blobs that changed between the two trees.
+void search_init(const char *index_dir);
+void search_free(void);
+
+// Called for every matching line, return false to stop.
+typedef bool (*search_hit_fn)(void *arg, const char *repo, const char *branch, const git_oid *commit,
+  const char *path, size_t line_no, const char *line, size_t line_len);
+
+// Searches the repositories (*.git) below root, or only root/repo if repo
+// is set. Literal queries match case-insensitive substrings, regex ones
+// are POSIX extended regular expressions whose literal runs are used as
+// trigram prefilter. Returns the number of hits, -1 if regex doesn't
+// compile, -2 if the query has no trigram to prefilter with and repo isn't
+// set; with repo set such a query stops after SEARCH_MAX_SCAN bytes. Safe
+// to call from several threads.
+int search_run(const char *root, const char *repo, const char *query, bool regex,
+  search_hit_fn fn, void *arg);
+
+#endif
@@ -0,0 +1,570 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <git2.h>
+
+#include "smart_http.h"
+#include "repo_cache.h"
+#include "metrics.h"
+#include "disk_cache.h"
+
+#define MIN(a,b) (a<b?a:b)
+
+// request bodies are inflated up to this size
+#define REQUEST_MAX (16*1024*1024)
+// largest data payload of a side-band-64k / side-band packet
+#define SIDEBAND_64K_DATA (65520 - 5)
+#define SIDEBAND_DATA (1000 - 5)
+
+#define CAPABILITIES "multi_ack_detailed side-band-64k side-band no-progress agent=gitserve"
+
+
+static struct disk_cache *packs = NULL;
+
+struct oids {
+  git_oid *ids;
+  size_t len, cap;
+};
+
+struct upload_request {
+  struct oids wants, haves;
+  bool done;
+  bool multi_ack;
+  size_t sideband;
+};
+
+// where pack data goes while it is built or read back from the cache
+struct pack_sink {
+  struct out *o;
+  size_t sideband;
+  FILE *cache;
+};
+
+
+void smart_http_init(const char *pack_dir) {
+  packs = disk_cache_new(pack_dir, PACK_CACHE_MAX_BYTES);
+}
+
+void smart_http_free(void) {
+  disk_cache_free(packs);
+  packs = NULL;
+}
+
+bool smart_http_match(struct mg_http_message *hm) {
+  return mg_http_match_uri(hm, "/git/*/info/refs") ||
+    mg_http_match_uri(hm, "/git/*/git-upload-pack") ||
+    mg_http_match_uri(hm, "/git/*/git-receive-pack");
+}
+
+// pkt-line framing: 4 hex digits of length (including themselves), then the payload
+static void pkt_write(struct out *o, const void *data, size_t len) {
+  char head[5];
+  snprintf(head, sizeof(head), "%04zx", len + 4);
+  out_write(o, head, 4);
+  out_write(o, data, len);
+}
+static void pkt_printf(struct out *o, const char *fmt, ...) {
+  char buf[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  pkt_write(o, buf, MIN(n, sizeof(buf) - 1));
+}
+static void pkt_flush(struct out *o) {
+  out_write(o, "0000", 4);
+}
+
+static void oids_add(struct oids *s, const git_oid *id) {
+  if (s->len == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 16;
+    s->ids = realloc(s->ids, s->cap * sizeof(*s->ids));
+  }
+  git_oid_cpy(&s->ids[s->len++], id);
+}
+static int oid_compare(const void *a, const void *b) {
+  return git_oid_cmp(a, b);
+}
+
+// the repository of /git/<name>/..., also found without its .git suffix
+static git_repository * open_repo(struct mg_http_message *hm, const char *root) {
+  struct mg_str name = mg_str_n(hm->uri.ptr + 5, 0);
+  while (name.ptr + name.len < hm->uri.ptr + hm->uri.len && name.ptr[name.len] != '/')
+    name.len++;
+  if ((name.len == 1 && name.ptr[0] == '.') || (name.len == 2 && strncmp(name.ptr, "..", 2) == 0))
+    return NULL;
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%.*s", root, (int) name.len, name.ptr);
+  git_repository *repo = repo_cache_open(path);
+  if (repo == NULL && (name.len < 4 || strncmp(name.ptr + name.len - 4, ".git", 4) != 0)) {
+    snprintf(path, sizeof(path), "%s/%.*s.git", root, (int) name.len, name.ptr);
+    repo = repo_cache_open(path);
+  }
+  return repo;
+}
+
+static int strcmp_p(const void *a, const void *b) {
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// ref lines of an info/refs advertisement, capabilities go on the first one
+static void advertise_refs(struct out *o, git_repository *repo) {
+  char hex[GIT_OID_HEXSZ + 1];
+  bool first = true;
+
+  // HEAD first, with the branch it points to so clones check that out
+  git_oid id;
+  if (git_reference_name_to_id(&id, repo, "HEAD") == 0) {
+    char symref[512] = "";
+    git_reference *head;
+    if (git_reference_lookup(&head, repo, "HEAD") == 0) {
+      if (git_reference_type(head) == GIT_REFERENCE_SYMBOLIC)
+        snprintf(symref, sizeof(symref), " symref=HEAD:%s", git_reference_symbolic_target(head));
+      git_reference_free(head);
+    }
+    pkt_printf(o, "%s HEAD%c%s%s\n", git_oid_tostr(hex, sizeof(hex), &id), '\0', CAPABILITIES, symref);
+    first = false;
+  }
+
+  git_strarray names;
+  if (git_reference_list(&names, repo) == 0) {
+    qsort(names.strings, names.count, sizeof(char *), strcmp_p);
+    for (size_t i = 0; i < names.count; i++) {
+      if (git_reference_name_to_id(&id, repo, names.strings[i]) != 0)
+        continue;
+      if (first)
+        pkt_printf(o, "%s %s%c%s\n", git_oid_tostr(hex, sizeof(hex), &id), names.strings[i], '\0', CAPABILITIES);
+      else
+        pkt_printf(o, "%s %s\n", git_oid_tostr(hex, sizeof(hex), &id), names.strings[i]);
+      first = false;
+
+      // annotated tags also advertise what they point to
+      git_tag *tag;
+      if (git_tag_lookup(&tag, repo, &id) == 0) {
+        git_object *target;
+        if (git_tag_peel(&target, tag) == 0) {
+          pkt_printf(o, "%s %s^{}\n", git_oid_tostr(hex, sizeof(hex), git_object_id(target)), names.strings[i]);
+          git_object_free(target);
+        }
+        git_tag_free(tag);
+      }
+    }
+    git_strarray_dispose(&names);
+  }
+
+  if (first)
+    pkt_printf(o, "%s capabilities^{}%c%s\n", git_oid_tostr(hex, sizeof(hex), &(git_oid) {{ 0 }}), '\0', CAPABILITIES);
+  pkt_flush(o);
+}
+
+// the ids advertise_refs lists: HEAD, every ref and what tags point to
+static void advertised_tips(git_repository *repo, struct oids *tips) {
+  git_oid id;
+  if (git_reference_name_to_id(&id, repo, "HEAD") == 0)
+    oids_add(tips, &id);
+  git_strarray names;
+  if (git_reference_list(&names, repo) != 0)
+    return;
+  for (size_t i = 0; i < names.count; i++) {
+    if (git_reference_name_to_id(&id, repo, names.strings[i]) != 0)
+      continue;
+    oids_add(tips, &id);
+    git_tag *tag;
+    if (git_tag_lookup(&tag, repo, &id) == 0) {
+      git_object *target;
+      if (git_tag_peel(&target, tag) == 0) {
+        oids_add(tips, git_object_id(target));
+        git_object_free(target);
+      }
+      git_tag_free(tag);
+    }
+  }
+  git_strarray_dispose(&names);
+}
+
+// True if every want is an advertised tip or a commit reachable from one,
+// otherwise bad is the first that isn't. Anything else in the object
+// database (e.g. commits of a force-pushed-away branch) isn't served.
+static bool wants_advertised(git_repository *repo, struct oids *wants, git_oid *bad) {
+  struct oids tips, rest;
+  memset(&tips, 0, sizeof(tips));
+  memset(&rest, 0, sizeof(rest));
+  advertised_tips(repo, &tips);
+  if (tips.len > 0)
+    qsort(tips.ids, tips.len, sizeof(git_oid), oid_compare);
+  for (size_t i = 0; i < wants->len; i++)
+    if (tips.len == 0 || bsearch(&wants->ids[i], tips.ids, tips.len, sizeof(git_oid), oid_compare) == NULL)
+      oids_add(&rest, &wants->ids[i]);
+  // duplicate wants are fine, the walk only has to find each once
+  if (rest.len > 0)
+    qsort(rest.ids, rest.len, sizeof(git_oid), oid_compare);
+  size_t n = 0;
+  for (size_t i = 0; i < rest.len; i++)
+    if (n == 0 || ! git_oid_equal(&rest.ids[n - 1], &rest.ids[i]))
+      rest.ids[n++] = rest.ids[i];
+  rest.len = n;
+
+  // the rest have to turn up walking the history of the tips, which
+  // stops as soon as all of them did
+  size_t found = 0;
+  bool *seen = rest.len > 0 ? calloc(rest.len, sizeof(bool)) : NULL;
+  git_revwalk *walk = NULL;
+  if (rest.len > 0 && git_revwalk_new(&walk, repo) == 0) {
+    for (size_t i = 0; i < tips.len; i++) {
+      git_object *obj;
+      if (git_object_lookup(&obj, repo, &tips.ids[i], GIT_OBJECT_COMMIT) == 0) {
+        git_revwalk_push(walk, &tips.ids[i]);
+        git_object_free(obj);
+      }
+    }
+    git_oid id;
+    while (found < rest.len && git_revwalk_next(&id, walk) == 0) {
+      git_oid *hit = bsearch(&id, rest.ids, rest.len, sizeof(git_oid), oid_compare);
+      if (hit != NULL && ! seen[hit - rest.ids]) {
+        seen[hit - rest.ids] = true;
+        found++;
+      }
+    }
+    git_revwalk_free(walk);
+  }
+  for (size_t i = 0; i < rest.len; i++)
+    if (! seen[i]) {
+      git_oid_cpy(bad, &rest.ids[i]);
+      break;
+    }
+
+  bool ok = found == rest.len;
+  free(seen);
+  free(rest.ids);
+  free(tips.ids);
+  return ok;
+}
+
+static void serve_refs(struct out *o, struct mg_http_message *hm, git_repository *repo) {
+  char service[64] = "";
+  mg_http_get_var(&hm->query, "service", service, sizeof(service));
+  if (strcmp(service, "git-upload-pack") != 0) {
+    // dumb http would need the loose objects and packs served as files
+    out_reply(o, 403, NULL, "Only smart HTTP clones are supported\n");
+    return;
+  }
+
+  // protocol v2 clients fall back to v0 when they get this
+  out_set_content_type(o, "application/x-git-upload-pack-advertisement");
+  out_begin(o, 200, "Cache-Control: no-cache\r\n");
+  pkt_printf(o, "# service=git-upload-pack\n");
+  pkt_flush(o);
+  advertise_refs(o, repo);
+  out_end(o);
+}
+
+// the request body, inflated if the client gzip'ed it; malloc'ed
+static char * request_body(struct mg_http_message *hm, size_t *len) {
+  struct mg_str *encoding = mg_http_get_header(hm, "Content-Encoding");
+  if (encoding == NULL || mg_vcasecmp(encoding, "gzip") != 0) {
+    char *body = malloc(hm->body.len + 1);
+    memcpy(body, hm->body.ptr, hm->body.len);
+    *len = hm->body.len;
+    return body;
+  }
+
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  if (inflateInit2(&z, 15 + 32) != Z_OK)
+    return NULL;
+  size_t cap = hm->body.len * 4 + 1024;
+  char *body = malloc(cap);
+  z.next_in = (Bytef *) hm->body.ptr;
+  z.avail_in = hm->body.len;
+  int rc = Z_OK;
+  while (rc == Z_OK) {
+    if (z.total_out == cap) {
+      if (cap >= REQUEST_MAX)
+        break;
+      cap *= 2;
+      body = realloc(body, cap);
+    }
+    z.next_out = (Bytef *) body + z.total_out;
+    z.avail_out = cap - z.total_out;
+    rc = inflate(&z, Z_NO_FLUSH);
+  }
+  inflateEnd(&z);
+  if (rc != Z_STREAM_END) {
+    free(body);
+    return NULL;
+  }
+  *len = z.total_out;
+  return body;
+}
+
+// wants, haves and capabilities of an upload-pack request, false if malformed
+static bool parse_request(const char *data, size_t len, struct upload_request *r) {
+  for (size_t pos = 0; pos + 4 <= len; ) {
+    char head[5];
+    memcpy(head, data + pos, 4);
+    head[4] = '\0';
+    char *end;
+    size_t pktLen = strtoul(head, &end, 16);
+    if (*end != '\0')
+      return false;
+    if (pktLen == 0) {
+      pos += 4;
+      continue;
+    }
+    if (pktLen < 4 || pos + pktLen > len)
+      return false;
+    struct mg_str line = mg_str_n(data + pos + 4, pktLen - 4);
+    pos += pktLen;
+    if (line.len > 0 && line.ptr[line.len - 1] == '\n')
+      line.len--;
+
+    git_oid id;
+    if (line.len >= 5 + GIT_OID_HEXSZ && strncmp(line.ptr, "want ", 5) == 0) {
+      if (git_oid_fromstrn(&id, line.ptr + 5, GIT_OID_HEXSZ) != 0)
+        return false;
+      // capabilities come with the first want
+      if (r->wants.len == 0) {
+        struct mg_str caps = mg_str_n(line.ptr + 5 + GIT_OID_HEXSZ, line.len - 5 - GIT_OID_HEXSZ);
+        for (size_t i = 0; i < caps.len; ) {
+          while (i < caps.len && caps.ptr[i] == ' ')
+            i++;
+          size_t start = i;
+          while (i < caps.len && caps.ptr[i] != ' ')
+            i++;
+          struct mg_str cap = mg_str_n(caps.ptr + start, i - start);
+          /**/ if (mg_vcmp(&cap, "multi_ack_detailed") == 0) r->multi_ack = true;
+          else if (mg_vcmp(&cap, "side-band-64k") == 0)      r->sideband = SIDEBAND_64K_DATA;
+          else if (mg_vcmp(&cap, "side-band") == 0 && r->sideband == 0) r->sideband = SIDEBAND_DATA;
+        }
+      }
+      oids_add(&r->wants, &id);
+    }
+    else if (line.len >= 5 + GIT_OID_HEXSZ && strncmp(line.ptr, "have ", 5) == 0) {
+      if (git_oid_fromstrn(&id, line.ptr + 5, GIT_OID_HEXSZ) != 0)
+        return false;
+      oids_add(&r->haves, &id);
+    }
+    else if (line.len == 4 && strncmp(line.ptr, "done", 4) == 0) {
+      r->done = true;
+    }
+    // shallow and filter requests need capabilities we don't advertise
+  }
+  return r->wants.len > 0;
+}
+
+// pack bytes to the client (in band 1 with side-band) and the cache file
+static int pack_write(void *data, size_t len, void *arg) {
+  struct pack_sink *s = arg;
+  if (s->cache != NULL && fwrite(data, 1, len, s->cache) != len) {
+    fclose(s->cache);
+    s->cache = NULL;
+  }
+  if (s->sideband == 0) {
+    out_write(s->o, data, len);
+  }
+  else {
+    for (size_t done = 0; done < len; ) {
+      size_t n = MIN(len - done, s->sideband);
+      char head[6];
+      snprintf(head, sizeof(head), "%04zx", n + 5);
+      head[4] = 1;
+      out_write(s->o, head, 5);
+      out_write(s->o, (char *) data + done, n);
+      done += n;
+    }
+  }
+  return s->o->failed ? -1 : 0;
+}
+
+// <sha1 of repo, wants and commons>.pack
+static void pack_name(char *buf, size_t len, git_repository *repo, struct upload_request *r, struct oids *common) {
+  qsort(r->wants.ids, r->wants.len, sizeof(git_oid), oid_compare);
+  qsort(common->ids, common->len, sizeof(git_oid), oid_compare);
+  size_t keyLen = 4096 + (r->wants.len + common->len + 1) * sizeof(git_oid);
+  char *key = malloc(keyLen);
+  size_t n = snprintf(key, 4096, "%s", git_repository_path(repo)) + 1;
+  memcpy(key + n, r->wants.ids, r->wants.len * sizeof(git_oid));
+  n += r->wants.len * sizeof(git_oid);
+  // separates the two sets
+  memset(key + n, 0, sizeof(git_oid));
+  n += sizeof(git_oid);
+  memcpy(key + n, common->ids, common->len * sizeof(git_oid));
+  n += common->len * sizeof(git_oid);
+
+  git_oid hash;
+  git_odb_hash(&hash, key, n, GIT_OBJECT_BLOB);
+  free(key);
+  char hex[GIT_OID_HEXSZ + 1];
+  snprintf(buf, len, "%s.pack", git_oid_tostr(hex, sizeof(hex), &hash));
+}
+
+// streams a cached pack, false if it is gone
+static bool send_cached(const char *path, struct pack_sink *s) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL)
+    return false;
+  char buf[64*1024];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    if (pack_write(buf, n, s) != 0)
+      break;
+  fclose(fp);
+  return true;
+}
+
+// builds the pack of everything reachable from the wants but not from
+// the commons, false if a want isn't in the repository
+static bool build_pack(git_repository *repo, struct upload_request *r, struct oids *common, struct pack_sink *s) {
+  uint64_t start = metrics_now();
+  git_packbuilder *pb = NULL;
+  git_revwalk *walk = NULL;
+  bool ok = git_packbuilder_new(&pb, repo) == 0 && git_revwalk_new(&walk, repo) == 0;
+
+  for (size_t i = 0; ok && i < r->wants.len; i++) {
+    git_object *obj;
+    if (git_object_lookup(&obj, repo, &r->wants.ids[i], GIT_OBJECT_ANY) != 0) {
+      ok = false;
+      break;
+    }
+    git_object *target = NULL;
+    if (git_object_type(obj) == GIT_OBJECT_TAG) {
+      // the tag itself goes in as well as what it points to
+      ok = git_packbuilder_insert(pb, git_object_id(obj), NULL) == 0 &&
+        git_tag_peel(&target, (git_tag *) obj) == 0;
+    }
+    const git_object *tip = target != NULL ? target : obj;
+    if (ok && git_object_type(tip) == GIT_OBJECT_COMMIT)
+      ok = git_revwalk_push(walk, git_object_id(tip)) == 0;
+    else if (ok)
+      ok = git_packbuilder_insert_recur(pb, git_object_id(tip), NULL) == 0;
+    git_object_free(target);
+    git_object_free(obj);
+  }
+  // commons that aren't commits (e.g. tags) just don't limit the walk
+  for (size_t i = 0; ok && i < common->len; i++)
+    git_revwalk_hide(walk, &common->ids[i]);
+
+  if (ok)
+    ok = git_packbuilder_insert_walk(pb, walk) == 0;
+  metrics_git(METRICS_GIT_REVWALK, start);
+  if (ok) {
+    start = metrics_now();
+    git_packbuilder_foreach(pb, pack_write, s);
+    metrics_git(METRICS_GIT_PACK, start);
+  }
+  git_revwalk_free(walk);
+  git_packbuilder_free(pb);
+  return ok;
+}
+
+// One negotiation round of the stateless (http) protocol: every request
+// repeats the wants and the commons found so far, and the pack only
+// follows once the client said done.
+static void serve_upload_pack(struct out *o, struct mg_http_message *hm, git_repository *repo) {
+  size_t len;
+  char *body = request_body(hm, &len);
+  struct upload_request r;
+  memset(&r, 0, sizeof(r));
+  if (body == NULL || ! parse_request(body, len, &r)) {
+    out_reply(o, 400, NULL, "Bad upload-pack request\n");
+    goto out;
+  }
+
+  out_set_content_type(o, "application/x-git-upload-pack-result");
+  out_begin(o, 200, "Cache-Control: no-cache\r\n");
+
+  // like upload-pack without allowAnySHA1InWant, before any negotiation
+  // so a cached pack isn't handed out either
+  char hex[GIT_OID_HEXSZ + 1];
+  git_oid bad;
+  if (! wants_advertised(repo, &r.wants, &bad)) {
+    pkt_printf(o, "ERR upload-pack: not our ref %s", git_oid_tostr(hex, sizeof(hex), &bad));
+    out_end(o);
+    goto out;
+  }
+
+  // the haves we have too, the pack leaves out what is reachable from them
+  struct oids common;
+  memset(&common, 0, sizeof(common));
+  git_odb *odb;
+  if (git_repository_odb(&odb, repo) == 0) {
+    for (size_t i = 0; i < r.haves.len; i++) {
+      if (! git_odb_exists(odb, &r.haves.ids[i]))
+        continue;
+      oids_add(&common, &r.haves.ids[i]);
+      if (r.multi_ack && ! r.done)
+        pkt_printf(o, "ACK %s common\n", git_oid_tostr(hex, sizeof(hex), &r.haves.ids[i]));
+    }
+    git_odb_free(odb);
+  }
+
+  if (! r.done) {
+    // without multi_ack the first common one ends the negotiation
+    if (! r.multi_ack && common.len > 0)
+      pkt_printf(o, "ACK %s\n", git_oid_tostr(hex, sizeof(hex), &common.ids[0]));
+    else
+      pkt_printf(o, "NAK\n");
+    out_end(o);
+    free(common.ids);
+    goto out;
+  }
+  if (common.len > 0)
+    pkt_printf(o, "ACK %s\n", git_oid_tostr(hex, sizeof(hex), &common.ids[r.multi_ack ? common.len - 1 : 0]));
+  else
+    pkt_printf(o, "NAK\n");
+
+  char name[64], path[4096];
+  pack_name(name, sizeof(name), repo, &r, &common);
+  struct pack_sink s = { o, r.sideband, NULL };
+  bool cached = disk_cache_lookup(packs, name, path, sizeof(path)) && send_cached(path, &s);
+  metrics_cache(METRICS_CACHE_PACK, cached);
+  if (! cached) {
+    struct disk_cache_file f;
+    bool caching = disk_cache_create(packs, name, &f);
+    s.cache = caching ? f.fp : NULL;
+    bool built = build_pack(repo, &r, &common, &s);
+    if (! built) {
+      // the client only reads the pack from band 1, errors go to band 3
+      if (r.sideband != 0)
+        pkt_printf(o, "%cupload-pack: not our ref", 3);
+      else
+        pkt_printf(o, "ERR upload-pack: not our ref");
+    }
+    // only complete packs are kept, a write error already closed the file
+    f.fp = s.cache;
+    if (caching && s.cache != NULL && built && ! o->failed)
+      disk_cache_commit(packs, &f);
+    else if (caching)
+      disk_cache_abort(&f);
+  }
+  if (r.sideband != 0)
+    pkt_flush(o);
+  out_end(o);
+  free(common.ids);
+
+out:
+  free(body);
+  free(r.wants.ids);
+  free(r.haves.ids);
+}
+
+void smart_http_serve(struct out *o, struct mg_http_message *hm, const char *root) {
+  if (mg_http_match_uri(hm, "/git/*/git-receive-pack")) {
+    out_reply(o, 403, NULL, "Pushing isn't supported\n");
+    return;
+  }
+  git_repository *repo = open_repo(hm, root);
+  if (repo == NULL) {
+    out_reply(o, 404, NULL, "Repository not found :(\n");
+    return;
+  }
+  if (mg_http_match_uri(hm, "/git/*/info/refs"))
+    serve_refs(o, hm, repo);
+  else if (mg_vcasecmp(&hm->method, "POST") == 0)
+    serve_upload_pack(o, hm, repo);
+  else
+    out_reply(o, 400, NULL, "upload-pack needs a POST\n");
+}
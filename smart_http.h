@@ -0,0 +1,29 @@
+#ifndef SMART_HTTP_H
+#define SMART_HTTP_H
+
+#include <stdbool.h>
+#include <mongoose.h>
+
+#include "out.h"
+
+// packs on disk above this are evicted, least recently used first
+#define PACK_CACHE_MAX_BYTES (1024L*1024*1024)
+
+// Read-only git smart HTTP (protocol v0), so repositories can be cloned
+// from https://host/git/<repo>.git:
+//   GET  /git/<repo>/info/refs?service=git-upload-pack
+//   POST /git/<repo>/git-upload-pack
+// Packs are built in process with libgit2's packbuilder and kept in
+// pack_dir, named after the repository and the want/have set, so another
+// clone of the same tips is streamed from disk instead of being
+// compressed again. Pushes are refused.
+void smart_http_init(const char *pack_dir);
+void smart_http_free(void);
+
+// True for the urls above (and the push ones, which get a 403).
+bool smart_http_match(struct mg_http_message *hm);
+
+// Serves hm for the repositories in root. Runs on a worker thread.
+void smart_http_serve(struct out *o, struct mg_http_message *hm, const char *root);
+
+#endif
@@ -0,0 +1,184 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "static_cache.h"
+#include "compress.h"
+#include "media.h"
+#include "metrics.h"
+
+
+struct static_file {
+  struct static_file *next;
+  char *path;
+  const char *mime;
+  uint64_t checked;
+  bool exists;
+  time_t mtime;
+  off_t size;
+  // indexed by enum encoding: status line, headers and body in one piece
+  char *response[3];
+  size_t response_len[3], headers_len[3];
+  char etag[3][64];
+};
+
+static struct static_file *files = NULL;
+
+
+static char * read_file(const char *path, size_t size) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL)
+    return NULL;
+  char *data = malloc(size + 1);
+  if (fread(data, 1, size, fp) != size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(fp);
+  return data;
+}
+
+static void drop_variants(struct static_file *f) {
+  for (int i = 0; i < 3; i++) {
+    free(f->response[i]);
+    f->response[i] = NULL;
+  }
+}
+
+// stats the file at most every STATIC_CACHE_REVALIDATE_MS
+static void revalidate(struct static_file *f) {
+  uint64_t now = mg_millis();
+  if (f->checked != 0 && now - f->checked < STATIC_CACHE_REVALIDATE_MS)
+    return;
+  f->checked = now;
+  struct stat st;
+  bool exists = stat(f->path, &st) == 0 && S_ISREG(st.st_mode);
+  if (exists == f->exists && (! exists || (st.st_mtime == f->mtime && st.st_size == f->size)))
+    return;
+  drop_variants(f);
+  f->exists = exists;
+  f->mtime = exists ? st.st_mtime : 0;
+  f->size = exists ? st.st_size : 0;
+  for (int i = 0; i < 3; i++)
+    snprintf(f->etag[i], sizeof(f->etag[i]), "\"%lx.%lx-%s\"", (unsigned long) f->mtime, (unsigned long) f->size,
+      compress_encoding_name(i));
+}
+
+// builds the response for one encoding, false if the file can't be read
+static bool build(struct static_file *f, enum encoding encoding) {
+  char *raw = read_file(f->path, f->size);
+  if (raw == NULL)
+    return false;
+  const char *body = raw;
+  size_t bodyLen = f->size;
+  char *compressed = NULL;
+  if (encoding != ENCODING_IDENTITY) {
+    // done once per file version, so spend the CPU on the best ratio
+    compressed = compress_buffer(encoding, encoding == ENCODING_BROTLI ? 11 : 9, raw, f->size, &bodyLen);
+    if (compressed == NULL) {
+      free(raw);
+      return false;
+    }
+    body = compressed;
+  }
+
+  char headers[512];
+  int headersLen = snprintf(headers, sizeof(headers),
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: %s\r\n"
+    "%s%s%s"
+    "Vary: Accept-Encoding\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "ETag: %s\r\n"
+    "Content-Length: %zu\r\n\r\n",
+    f->mime,
+    encoding != ENCODING_IDENTITY ? "Content-Encoding: " : "",
+    encoding != ENCODING_IDENTITY ? compress_encoding_name(encoding) : "",
+    encoding != ENCODING_IDENTITY ? "\r\n" : "",
+    f->etag[encoding], bodyLen);
+
+  f->response[encoding] = malloc(headersLen + bodyLen);
+  memcpy(f->response[encoding], headers, headersLen);
+  memcpy(f->response[encoding] + headersLen, body, bodyLen);
+  f->headers_len[encoding] = headersLen;
+  f->response_len[encoding] = headersLen + bodyLen;
+  free(compressed);
+  free(raw);
+  return true;
+}
+
+struct static_file * static_cache_open(const char *path) {
+  for (struct static_file *f = files; f != NULL; f = f->next)
+    if (strcmp(f->path, path) == 0)
+      return f;
+  struct static_file *f = calloc(1, sizeof(*f));
+  f->path = strdup(path);
+  f->mime = media_mime_type(path);
+  f->next = files;
+  files = f;
+  return f;
+}
+
+void static_cache_serve(struct mg_connection *c, struct mg_http_message *hm, struct static_file *f) {
+  revalidate(f);
+  if (! f->exists) {
+    mg_http_reply(c, 404, NULL, "Not found :(\n");
+    return;
+  }
+  if (f->size > STATIC_CACHE_MAX_FILE) {
+    struct mg_http_serve_opts opts = { 0 };
+    mg_http_serve_file(c, hm, f->path, &opts);
+    return;
+  }
+
+  // ranges only make sense on the uncompressed bytes
+  struct mg_str *range = mg_http_get_header(hm, "Range");
+  enum encoding encoding = range != NULL ? ENCODING_IDENTITY : compress_negotiate(hm, f->mime);
+
+  struct mg_str *inm = mg_http_get_header(hm, "If-None-Match");
+  if (inm != NULL && mg_vcmp(inm, f->etag[encoding]) == 0) {
+    mg_printf(c, "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nVary: Accept-Encoding\r\nContent-Length: 0\r\n\r\n",
+      f->etag[encoding]);
+    return;
+  }
+
+  metrics_cache(METRICS_CACHE_STATIC, f->response[encoding] != NULL);
+  if (f->response[encoding] == NULL && ! build(f, encoding)) {
+    mg_http_reply(c, 500, NULL, "Error reading file :(\n");
+    return;
+  }
+  const char *body = f->response[encoding] + f->headers_len[encoding];
+  bool head = mg_vcmp(&hm->method, "HEAD") == 0;
+
+  // only single ranges, multiple ones get the whole file
+  off_t starts[MEDIA_MAX_RANGES], ends[MEDIA_MAX_RANGES];
+  int ranges = range != NULL ? media_parse_ranges(range, f->size, starts, ends) : 0;
+  if (ranges < 0) {
+    mg_printf(c, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%lld\r\nContent-Length: 0\r\n\r\n",
+      (long long) f->size);
+    return;
+  }
+  if (ranges == 1) {
+    mg_printf(c, "HTTP/1.1 206 Partial Content\r\nContent-Type: %s\r\nETag: %s\r\n"
+      "Content-Range: bytes %lld-%lld/%lld\r\nContent-Length: %lld\r\n\r\n",
+      f->mime, f->etag[encoding], (long long) starts[0], (long long) ends[0] - 1, (long long) f->size,
+      (long long) (ends[0] - starts[0]));
+    if (! head)
+      mg_send(c, body + starts[0], ends[0] - starts[0]);
+    return;
+  }
+
+  mg_send(c, f->response[encoding], head ? f->headers_len[encoding] : f->response_len[encoding]);
+}
+
+void static_cache_free(void) {
+  while (files != NULL) {
+    struct static_file *f = files;
+    files = f->next;
+    drop_variants(f);
+    free(f->path);
+    free(f);
+  }
+}
@@ -0,0 +1,25 @@
+#ifndef STATIC_CACHE_H
+#define STATIC_CACHE_H
+
+#include <mongoose.h>
+
+// Larger files are left to mg_http_serve_file.
+#define STATIC_CACHE_MAX_FILE (16*1024*1024)
+// how long a cached file is trusted before it is stat'ed again
+#define STATIC_CACHE_REVALIDATE_MS (1000)
+
+// Small files (pages, css, pdfs) kept in memory as complete responses,
+// headers included, so a hit is a single send. gzip and brotli variants
+// are built on first use at the best level. A file is reread when its
+// mtime or size changed. Only used from the event loop.
+struct static_file;
+
+// Never NULL, the same path gives the same handle until static_cache_free.
+struct static_file * static_cache_open(const char *path);
+
+// Answers If-None-Match and single ranges, the latter uncompressed.
+void static_cache_serve(struct mg_connection *c, struct mg_http_message *hm, struct static_file *f);
+
+void static_cache_free(void);
+
+#endif
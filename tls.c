@@ -0,0 +1,167 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "tls.h"
+
+#if MG_ENABLE_CUSTOM_TLS
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+
+
+// connections hold a reference of their own (SSL_new), so replacing this
+// never pulls the context from under a running connection
+static SSL_CTX *ctx = NULL;
+static char *cert_path = NULL, *key_path = NULL;
+static struct timespec cert_mtime, key_mtime;
+// shared by every context, so tickets stay valid across reloads
+static unsigned char ticket_keys[80];
+
+
+static void file_mtime(const char *path, struct timespec *mtime) {
+  struct stat st;
+  if (stat(path, &st) == 0)
+    *mtime = st.st_mtim;
+  else
+    memset(mtime, 0, sizeof(*mtime));
+}
+
+static SSL_CTX * ctx_new(void) {
+  SSL_CTX *c = SSL_CTX_new(TLS_server_method());
+  if (c == NULL)
+    return NULL;
+  SSL_CTX_set_min_proto_version(c, TLS1_2_VERSION);
+  if (SSL_CTX_use_certificate_chain_file(c, cert_path) != 1 ||
+      SSL_CTX_use_PrivateKey_file(c, key_path, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(c) != 1) {
+    unsigned long err = ERR_get_error();
+    fprintf(stderr, "cannot load %s / %s: %s\n", cert_path, key_path, ERR_error_string(err, NULL));
+    ERR_clear_error();
+    SSL_CTX_free(c);
+    return NULL;
+  }
+
+  // resumption skips the key exchange, by session id or by ticket
+  SSL_CTX_set_session_cache_mode(c, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(c, TLS_SESSION_CACHE_SIZE);
+  SSL_CTX_set_timeout(c, TLS_SESSION_TIMEOUT_S);
+  SSL_CTX_set_session_id_context(c, (const unsigned char *) "gitserve", 8);
+  SSL_CTX_set_tlsext_ticket_keys(c, ticket_keys, sizeof(ticket_keys));
+
+  // mongoose retries writes from a moved buffer, and idle keep-alive
+  // connections shouldn't keep 2x16 KB of record buffers around
+  SSL_CTX_set_mode(c, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+  return c;
+}
+
+static void check_fn(void *arg) {
+  struct timespec cert, key;
+  file_mtime(cert_path, &cert);
+  file_mtime(key_path, &key);
+  if (cert.tv_sec != cert_mtime.tv_sec || cert.tv_nsec != cert_mtime.tv_nsec ||
+      key.tv_sec != key_mtime.tv_sec || key.tv_nsec != key_mtime.tv_nsec)
+    tls_reload();
+}
+
+bool tls_init(struct mg_mgr *mgr, const char *cert, const char *key) {
+  cert_path = strdup(cert);
+  key_path = strdup(key);
+  if (RAND_bytes(ticket_keys, sizeof(ticket_keys)) != 1)
+    return false;
+  file_mtime(cert_path, &cert_mtime);
+  file_mtime(key_path, &key_mtime);
+  ctx = ctx_new();
+  if (ctx == NULL)
+    return false;
+  mg_timer_add(mgr, TLS_CHECK_MS, MG_TIMER_REPEAT, check_fn, NULL);
+  return true;
+}
+
+void tls_reload(void) {
+  // remembered first, a half written file is retried on the next change
+  file_mtime(cert_path, &cert_mtime);
+  file_mtime(key_path, &key_mtime);
+  SSL_CTX *c = ctx_new();
+  if (c == NULL) {
+    fprintf(stderr, "keeping the old certificate\n");
+    return;
+  }
+  SSL_CTX_free(ctx);
+  ctx = c;
+  printf("reloaded %s\n", cert_path);
+}
+
+void tls_free(void) {
+  SSL_CTX_free(ctx);
+  ctx = NULL;
+  free(cert_path);
+  free(key_path);
+  cert_path = key_path = NULL;
+}
+
+// 0 if the call just has to be repeated once the socket is ready
+static int tls_err(SSL *ssl, int rc) {
+  int err = SSL_get_error(ssl, rc);
+  if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+    return 0;
+  ERR_clear_error();
+  return err;
+}
+
+// mongoose's TLS interface, see MG_ENABLE_CUSTOM_TLS
+
+void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
+  SSL *ssl = ctx != NULL ? SSL_new(ctx) : NULL;
+  if (ssl == NULL) {
+    mg_error(c, "no TLS context");
+    return;
+  }
+  SSL_set_fd(ssl, (int) (size_t) c->fd);
+  c->tls = ssl;
+  c->is_tls = 1;
+  c->is_tls_hs = 1;
+}
+
+void mg_tls_handshake(struct mg_connection *c) {
+  SSL *ssl = c->tls;
+  int rc = SSL_accept(ssl);
+  if (rc == 1)
+    c->is_tls_hs = 0;
+  else if (tls_err(ssl, rc) != 0)
+    mg_error(c, "TLS handshake failed");
+}
+
+void mg_tls_free(struct mg_connection *c) {
+  SSL_free(c->tls);
+  c->tls = NULL;
+}
+
+long mg_tls_send(struct mg_connection *c, const void *buf, size_t len) {
+  int n = SSL_write(c->tls, buf, (int) len);
+  return n > 0 ? n : tls_err(c->tls, n) == 0 ? 0 : -1;
+}
+
+long mg_tls_recv(struct mg_connection *c, void *buf, size_t len) {
+  int n = SSL_read(c->tls, buf, (int) len);
+  return n > 0 ? n : tls_err(c->tls, n) == 0 ? 0 : -1;
+}
+
+size_t mg_tls_pending(struct mg_connection *c) {
+  return c->tls != NULL ? SSL_pending(c->tls) : 0;
+}
+
+#else
+
+bool tls_init(struct mg_mgr *mgr, const char *cert, const char *key) {
+  fprintf(stderr, "built without TLS, see make https\n");
+  return false;
+}
+void tls_reload(void) {
+}
+void tls_free(void) {
+}
+
+#endif
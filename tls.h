@@ -0,0 +1,24 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stdbool.h>
+#include <mongoose.h>
+
+#define TLS_SESSION_CACHE_SIZE (1024)
+#define TLS_SESSION_TIMEOUT_S (24*60*60)
+// how often the certificate files are stat'ed for renewals
+#define TLS_CHECK_MS (60*1000)
+
+// One OpenSSL context for all connections, built from cert and key once
+// instead of on every accept, with a session cache and session tickets
+// for resumption. When the files change (checked every TLS_CHECK_MS) or
+// on tls_reload a new context replaces the old one; connections keep the
+// context they started with. Needs the https build (MG_ENABLE_CUSTOM_TLS,
+// see Makefile), false otherwise or if the files can't be loaded.
+// mg_tls_init then sets up c with the current context, its opts are
+// ignored.
+bool tls_init(struct mg_mgr *mgr, const char *cert, const char *key);
+void tls_reload(void);
+void tls_free(void);
+
+#endif
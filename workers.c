@@ -0,0 +1,311 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "workers.h"
+#include "repo_cache.h"
+#include "metrics.h"
+
+
+#define MIN(a,b) (a<b?a:b)
+
+struct job {
+  // all jobs, only touched by the event loop
+  struct job *prev, *next;
+  // NULL once the connection closed, only touched by the event loop
+  struct mg_connection *c;
+
+  // waiting jobs, guarded by lock
+  struct job *next_queued;
+
+  char *request;
+  size_t request_len;
+  worker_fn fn;
+  void *arg;
+
+  // produced but not yet sent output, guarded by lock
+  char *buf;
+  size_t len, cap;
+  // bytes moved onto the connection so far, to tell a stalled client
+  size_t sent;
+  bool done;
+  bool cancelled;
+  // the client read nothing for OUT_SEND_TIMEOUT_MS, the connection is
+  // closed instead of sending the rest
+  bool stalled;
+  // see out.close
+  bool close;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// signalled when a job was queued
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+// signalled when a job's output buffer drained or it was cancelled
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+
+static struct job *queue_head, *queue_tail;
+static int queue_len = 0;
+static int max_queue_len = 0;
+static bool stopping = false;
+
+static struct job *jobs;
+// length of jobs, see workers_pending
+static int job_count = 0;
+static pthread_t *threads;
+static int thread_count = 0;
+// socket that wakes up the event loop, see mg_mkpipe
+static int wakeup_fd = -1;
+
+
+static void wakeup(void) {
+  send(wakeup_fd, "x", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static struct timespec deadline(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += OUT_SEND_TIMEOUT_MS / 1000;
+  ts.tv_nsec += (OUT_SEND_TIMEOUT_MS % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  return ts;
+}
+
+// out sink on the worker side, blocks while the connection is behind,
+// but not for longer than OUT_SEND_TIMEOUT_MS without the client reading
+static void job_sink(struct out *o, const void *data, size_t len) {
+  struct job *job = o->sink_data;
+  const char *p = data;
+  while (len > 0) {
+    pthread_mutex_lock(&lock);
+    size_t sent = job->sent;
+    struct timespec until = deadline();
+    while (job->len >= OUT_HIGH_WATER && ! job->cancelled) {
+      if (pthread_cond_timedwait(&space_cond, &lock, &until) != ETIMEDOUT)
+        continue;
+      if (job->sent == sent) {
+        // frees the worker for somebody else
+        job->cancelled = true;
+        job->stalled = true;
+        break;
+      }
+      sent = job->sent;
+      until = deadline();
+    }
+    if (job->cancelled) {
+      o->failed = true;
+      pthread_mutex_unlock(&lock);
+      return;
+    }
+
+    size_t n = MIN(len, OUT_HIGH_WATER);
+    if (job->len + n > job->cap) {
+      job->cap = job->len + n;
+      job->buf = realloc(job->buf, job->cap);
+    }
+    memcpy(job->buf + job->len, p, n);
+    bool wasEmpty = job->len == 0;
+    job->len += n;
+    pthread_mutex_unlock(&lock);
+
+    // the event loop comes back by itself while there is data left
+    if (wasEmpty)
+      wakeup();
+    p += n;
+    len -= n;
+  }
+}
+
+static void job_free(struct job *job) {
+  if (job->prev) job->prev->next = job->next; else jobs = job->next;
+  if (job->next) job->next->prev = job->prev;
+  job_count--;
+  metrics_git_renders(-1);
+  free(job->request);
+  free(job->buf);
+  free(job);
+}
+
+// Moves produced output onto the connection, frees finished jobs.
+static void job_pump(struct job *job) {
+  pthread_mutex_lock(&lock);
+  struct mg_connection *c = job->c;
+  if (c != NULL && job->len > 0 && c->send.len < OUT_HIGH_WATER) {
+    size_t n = MIN(job->len, OUT_HIGH_WATER - c->send.len);
+    mg_send(c, job->buf, n);
+    memmove(job->buf, job->buf + n, job->len - n);
+    job->len -= n;
+    job->sent += n;
+    if (job->len < OUT_LOW_WATER)
+      pthread_cond_broadcast(&space_cond);
+  }
+  bool finished = job->done && (job->len == 0 || job->c == NULL || job->stalled);
+  if (finished && job->stalled && c != NULL)
+    c->is_closing = 1;
+  else if (finished && job->close && c != NULL)
+    c->is_draining = 1;
+  pthread_mutex_unlock(&lock);
+
+  if (finished)
+    job_free(job);
+}
+
+static void pipe_fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+  if (ev == MG_EV_READ) {
+    c->recv.len = 0;
+    for (struct job *job = jobs, *next; job != NULL; job = next) {
+      next = job->next;
+      job_pump(job);
+    }
+  }
+}
+
+static void * worker_main(void *arg) {
+  for (;;) {
+    pthread_mutex_lock(&lock);
+    while (queue_head == NULL && ! stopping)
+      pthread_cond_wait(&work_cond, &lock);
+    if (stopping) {
+      pthread_mutex_unlock(&lock);
+      break;
+    }
+    struct job *job = queue_head;
+    queue_head = job->next_queued;
+    if (queue_head == NULL)
+      queue_tail = NULL;
+    queue_len--;
+    bool cancelled = job->cancelled;
+    pthread_mutex_unlock(&lock);
+
+    if (! cancelled) {
+      struct out o;
+      out_init(&o, job_sink, job);
+      struct mg_http_message hm;
+      mg_http_parse(job->request, job->request_len, &hm);
+      job->fn(&o, &hm, job->arg);
+      job->close = o.close;
+    }
+
+    pthread_mutex_lock(&lock);
+    job->done = true;
+    pthread_mutex_unlock(&lock);
+    wakeup();
+  }
+
+  // the repository handles this thread opened
+  repo_cache_free();
+  return NULL;
+}
+
+void workers_init(struct mg_mgr *mgr, int count, int queue_depth) {
+  max_queue_len = queue_depth;
+  thread_count = count;
+  if (count == 0)
+    return;
+
+  wakeup_fd = mg_mkpipe(mgr, pipe_fn, NULL, false);
+  threads = calloc(count, sizeof(*threads));
+  for (int i = 0; i < count; i++)
+    pthread_create(&threads[i], NULL, worker_main, NULL);
+}
+
+void workers_stop(void) {
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  for (struct job *job = jobs; job != NULL; job = job->next)
+    job->cancelled = true;
+  pthread_cond_broadcast(&work_cond);
+  pthread_cond_broadcast(&space_cond);
+  pthread_mutex_unlock(&lock);
+
+  for (int i = 0; i < thread_count; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+  threads = NULL;
+  thread_count = 0;
+
+  while (jobs != NULL)
+    job_free(jobs);
+}
+
+bool workers_submit(struct mg_connection *c, struct mg_http_message *hm, worker_fn fn, void *arg) {
+  if (thread_count == 0) {
+    struct out o;
+    out_init_conn(&o, c);
+    fn(&o, hm, arg);
+    return true;
+  }
+
+  pthread_mutex_lock(&lock);
+  if (queue_len >= max_queue_len) {
+    pthread_mutex_unlock(&lock);
+    return false;
+  }
+  pthread_mutex_unlock(&lock);
+
+  struct job *job = calloc(1, sizeof(*job));
+  job->c = c;
+  // hm points into the connection's receive buffer, which mongoose
+  // reuses once we return, so the worker gets its own copy
+  job->request_len = hm->message.len;
+  job->request = malloc(job->request_len + 1);
+  memcpy(job->request, hm->message.ptr, job->request_len);
+  job->request[job->request_len] = '\0';
+  job->fn = fn;
+  job->arg = arg;
+
+  job->next = jobs;
+  if (jobs) jobs->prev = job;
+  jobs = job;
+  job_count++;
+  metrics_git_renders(1);
+
+  pthread_mutex_lock(&lock);
+  if (queue_tail) queue_tail->next_queued = job; else queue_head = job;
+  queue_tail = job;
+  queue_len++;
+  pthread_cond_signal(&work_cond);
+  pthread_mutex_unlock(&lock);
+  return true;
+}
+
+static struct job * job_for(struct mg_connection *c) {
+  for (struct job *job = jobs; job != NULL; job = job->next)
+    if (job->c == c)
+      return job;
+  return NULL;
+}
+
+int workers_pending(void) {
+  return job_count;
+}
+
+bool workers_busy(struct mg_connection *c) {
+  return job_for(c) != NULL;
+}
+
+void workers_conn_event(struct mg_connection *c, int ev) {
+  struct job *job = job_for(c);
+  if (job == NULL)
+    return;
+
+  if (ev == MG_EV_CLOSE) {
+    pthread_mutex_lock(&lock);
+    job->c = NULL;
+    job->cancelled = true;
+    pthread_cond_broadcast(&space_cond);
+    bool done = job->done;
+    pthread_mutex_unlock(&lock);
+    // otherwise freed once the worker noticed
+    if (done)
+      job_free(job);
+  }
+  else if (ev == MG_EV_WRITE || ev == MG_EV_POLL) {
+    job_pump(job);
+  }
+}
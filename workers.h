@@ -0,0 +1,34 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <stdbool.h>
+#include <mongoose.h>
+
+#include "out.h"
+
+// Renders a response for hm into o. Runs on a worker thread.
+typedef void (*worker_fn)(struct out *o, struct mg_http_message *hm, void *arg);
+
+// Starts threads workers that take at most queue_depth waiting requests.
+// With zero threads requests are handled inline on the event loop.
+void workers_init(struct mg_mgr *mgr, int threads, int queue_depth);
+void workers_stop(void);
+
+// Hands hm off to a worker, its output is streamed back to c as it is
+// produced. A client that reads nothing for OUT_SEND_TIMEOUT_MS while the
+// worker waits for it gets its connection closed and frees the worker.
+// Returns false if the queue is full.
+bool workers_submit(struct mg_connection *c, struct mg_http_message *hm, worker_fn fn, void *arg);
+
+// Requests submitted whose response isn't sent completely yet. Always 0
+// without threads.
+int workers_pending(void);
+
+// True while a response is still being produced for c.
+bool workers_busy(struct mg_connection *c);
+
+// Must see every MG_EV_WRITE, MG_EV_POLL and MG_EV_CLOSE of connections
+// that requests were submitted for.
+void workers_conn_event(struct mg_connection *c, int ev);
+
+#endif